@@ -3,19 +3,77 @@
  * provides interface to virtual disk
  * 
  */
+#define _DEFAULT_SOURCE // for mmap/msync under -std=c99.
 #include "filesys.h"
 #include <stdio.h>
 #include <unistd.h>
 #include <string.h>
 #include <stdlib.h>
-
-
-diskblock_t  virtualDisk [MAXBLOCKS];           // define our in-memory virtual, with MAXBLOCKS blocks
-fatentry_t   FAT         [MAXBLOCKS];           // define a file allocation table with MAXBLOCKS 16-bit entries
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <errno.h>
+#include <limits.h>
+#if defined(__linux__) && defined(__NR_io_uring_setup)
+#include <linux/io_uring.h>
+#define HAVE_IO_URING 1
+#endif
+
+#define MAXIOV 1024 // blocks gathered into one pwritev().
+
+
+Byte        *memoryDisk              = NULL;    // the in-memory disk, sized for the current geometry
+size_t       memoryDiskSize          = 0;
+Byte        *virtualDisk             = NULL;    // view of the disk: memoryDisk, or a mounted image
+int          mountedFd               = -1;      // file descriptor of the mounted image (-1 if none)
+char         mountedName [MAXPATHLENGTH];       // filename of the mounted image
+Byte        *dirtyBlocks             = NULL;    // bitmap of blocks written since the disk last matched imageName
+char         imageName   [MAXPATHLENGTH];       // image file the clean blocks are known to match ("" if none)
+diskstats_t  diskStats;                         // counters for disk writes
+int          pinnedBlocks            = 0;       // blocks currently borrowed with pinblock()/pinblock_rw()
+cacheframe_t *cacheFrames            = NULL;    // the block cache, used instead of virtualDisk by mountdisk_cached()
+Byte        *cacheData               = NULL;    // cacheCapacity blocks of data, one per frame
+int          cacheCapacity           = 0;       // frames in the cache (0 when the disk is not cached)
+int          cachePolicy             = CACHE_LRU;
+int         *cacheBuckets            = NULL;    // hash of block number -> first frame in the bucket
+int          cacheBucketCount        = 0;
+int          lruHead                 = -1;      // most recently used frame
+int          lruTail                 = -1;      // least recently used frame
+int          clockHand               = 0;
+blockio_request_t *ioRequests        = NULL;    // the block I/O request slots (ioDepth of them)
+int          ioDepth                 = 0;       // requests that can be queued or in flight at once (0 until blockio_init)
+int          ioBackend               = BLOCKIO_SYNC;
+int          ioQueued                = 0;       // requests waiting for blockio_submit()
+int          ioInflight              = 0;       // requests submitted but not yet reaped
+superblock_t superBlock = { .magic = FSMAGIC, .version = FSVERSION, .blocksize = DEFAULTBLOCKSIZE, .blockcount = DEFAULTBLOCKS }; // geometry of the disk in use
+fatentry_t  *FAT                     = NULL;    // define a file allocation table with MAXBLOCKS 32-bit entries
+uint64_t    *freeMap                 = NULL;    // bitmap of UNUSED blocks (bit set = free), kept in step with the FAT
+int         *regionFree              = NULL;    // free blocks in each FREEREGIONBLOCKS-block region
+fatentry_t   freeBlocks              = 0;       // free blocks on the whole disk
+MyFILE       fileTable [MAXOPENFILES];         // the open file table; a file's descriptor is its slot
+int          freeFiles [MAXOPENFILES];         // stack of free slots
+int          freeFileCount           = -1;      // (-1 until the table is first used)
+int          openFiles               = 0;
+int32_t     *refCount                = NULL;    // extra references to each block from cloned files (NULL if there are no clones)
+hole_t      *holeTable               = NULL;    // the holes in sparse files' chains (see HOLE in filesys.h)
+int          holeSlots               = 0;       // slots used in holeTable (free ones included)
+int          holeCap                 = 0;
+int          holeFreeSlot            = -1;      // first free slot (-1 if none)
+int          holeDirtyFrom           = 0;       // slots from here ...
+int          holeDirtyTo             = 0;       // ... to here have changed since the table was written
+long         chainGeneration         = 0;       // bumped whenever blocks are freed, so chain indexes know to rebuild
+fatentry_t   allocHint               = 0;       // next-fit: where the search for a free block starts
+Byte        *fatDirty                = NULL;    // bitmap of FAT blocks whose entries have changed since they were written
+int          fatDeferred             = FALSE;   // TRUE: FAT changes wait for syncFAT() (at myfclose or a disk sync)
 fatentry_t   rootDirIndex            = 0;       // rootDir will be set by format
 direntry_t *currentDir              = NULL;
 fatentry_t   currentDirIndex         = 0;
 
+// Address of a block on the virtual disk.
+#define BLOCK(block_address) ((diskblock_t *) (virtualDisk + (size_t) (block_address) * BLOCKSIZE))
+
 
 /* --------  DISK FUNCTIONS ---------------
 
@@ -23,29 +81,1064 @@ fatentry_t   currentDirIndex         = 0;
   ------------------------------------
 */
 
+// Write the disk out to a file.
+// If the file is the mounted image, only its dirty pages need writing back, so just sync it.
+// If it is the image the disk was last written to, only the dirty blocks are written.
+// Otherwise the whole disk goes to a temporary file that then replaces the old one, so a write
+// that fails part way leaves the old image as it was.
 void writedisk ( const char * filename )
 {
-   FILE * dest = fopen( filename, "w" );
-   if ( fwrite ( virtualDisk, sizeof(virtualDisk), 1, dest ) < 0 )
+   syncFAT();
+   if ( mountedFd >= 0 && strcmp ( filename, mountedName ) == 0 )
+   {
+      syncdisk();
+      return;
+   }
+   if ( strcmp ( filename, imageName ) == 0 && flushdisk ( filename ) == 0 ) return;
+
+   char temp[strlen(filename) + 8];
+   sprintf ( temp, "%s.XXXXXX", filename );
+   int fd = mkstemp ( temp );
+   FILE * dest = ( fd >= 0 ) ? fdopen ( fd, "w" ) : NULL;
+   int ok = ( dest != NULL && fchmod ( fd, 0644 ) == 0 );
+   if ( ok && cacheCapacity > 0 )
+   {
+      // Only the image file holds the whole disk, so bring it up to date and copy it.
+      ok = ( cache_sync() == 0 && copy_image ( mountedFd, fd ) == 0 );
+   }
+   else if ( ok ) ok = ( fwrite ( virtualDisk, DISKSIZE, 1, dest ) == 1 );
+   if ( dest ) ok = ( fclose(dest) == 0 ) && ok;
+   else if ( fd >= 0 ) close(fd);
+   if ( !ok || rename ( temp, filename ) < 0 )
    {
       fprintf ( stderr, "write virtual disk to disk failed\n" );
+      if ( fd >= 0 ) unlink(temp);
+      imageName[0] = '\0';
+      return;
    }
-   //write(dest, virtualDisk, sizeof(virtualDisk) );
-   fclose(dest);
-   
+
+   diskStats.fullwrites++;
+   diskStats.bytesflushed += DISKSIZE;
+   if ( strlen(filename) < MAXPATHLENGTH ) strcpy ( imageName, filename );
+   clear_dirty();
+}
+
+// Incrementally flush the disk to an image that holds an earlier copy of it.
+// Only dirty blocks are written, with each run of adjacent dirty blocks coalesced into a single pwritev().
+// Returns 0 on success, -1 on failure (the caller should then fall back to a full write).
+int flushdisk ( const char * filename )
+{
+   int fd = open ( filename, O_WRONLY );
+   if ( fd < 0 ) return -1;
+
+   // Pin the run (up to MAXIOV blocks at a time, or half the cache) and write it in one go.
+   struct iovec iov[MAXIOV];
+   int batch = ( cacheCapacity > 0 && cacheCapacity / 2 < MAXIOV ) ? cacheCapacity / 2 : MAXIOV;
+   fatentry_t start = next_dirty(0);
+   while ( start < MAXBLOCKS )
+   {
+      int n = 0;
+      while ( start + n < MAXBLOCKS && n < batch && is_dirty(start + n) )
+      {
+         iov[n].iov_base = (void *) pinblock(start + n);
+         if ( iov[n].iov_base == NULL ) break; // (the cache has no frame to spare; write what is pinned.)
+         iov[n].iov_len = BLOCKSIZE;
+         n++;
+      }
+      size_t len = (size_t) n * BLOCKSIZE;
+      ssize_t written = ( n > 0 ) ? pwritev ( fd, iov, n, (off_t) start * BLOCKSIZE ) : -1;
+      for ( int i = 0; i < n; i++ ) unpinblock(start + i);
+      if ( written != (ssize_t) len )
+      {
+         fprintf ( stderr, "(flushdisk) write to %s failed\n", filename );
+         close(fd);
+         return -1;
+      }
+      diskStats.runsflushed++;
+      diskStats.bytesflushed += len;
+      start = next_dirty(start + n);
+   }
+   close(fd);
+
+   diskStats.flushes++;
+   clear_dirty();
+   return 0;
+}
+
+// Copy the whole of an image file to another (open) file.
+// Returns 0 on success, -1 on failure.
+int copy_image ( int fd, int dest )
+{
+   size_t chunk = 1 << 20;
+   Byte *buf = malloc ( chunk );
+   for ( size_t off = 0; off < DISKSIZE; off += chunk )
+   {
+      size_t len = ( DISKSIZE - off < chunk ) ? DISKSIZE - off : chunk;
+      ssize_t got = pread ( fd, buf, len, off );
+      if ( got < 0 ) got = 0;
+      memset ( buf + got, 0, len - got ); // short images read as zeros.
+      if ( pwrite ( dest, buf, len, off ) != (ssize_t) len )
+      {
+         free(buf);
+         return -1;
+      }
+   }
+   free(buf);
+   return 0;
 }
 
+// Read a whole image into the in-memory disk, taking the geometry from its superblock.
 void readdisk ( const char * filename )
 {
+   superblock_t super;
+   int fd = open ( filename, O_RDONLY );
+   if ( fd < 0 || read_superblock ( fd, &super ) < 0 )
+   {
+      fprintf ( stderr, "read virtual disk from disk failed\n" );
+      if ( fd >= 0 ) close(fd);
+      return;
+   }
+   close(fd);
+   if ( mountedFd >= 0 ) unmountdisk();
+   if ( set_geometry ( &super ) < 0 ) return;
+
    FILE * dest = fopen( filename, "r" );
-   if ( fread ( virtualDisk, sizeof(virtualDisk), 1, dest ) < 0 )
+   if ( fread ( virtualDisk, DISKSIZE, 1, dest ) != 1 )
    {
-      fprintf ( stderr, "write virtual disk to disk failed\n" );
+      fprintf ( stderr, "read virtual disk from disk failed\n" );
    }
    //write( dest, virtualDisk, sizeof(virtualDisk) );
    fclose(dest);
+
+   loadFAT(FAT);
+   rootDirIndex = superBlock.rootdir;
+   currentDirIndex = rootDirIndex;
+   dcache_clear();
+
+   // The disk now matches this image, so later writedisk() calls to it can be incremental.
+   if ( strlen(filename) < MAXPATHLENGTH ) strcpy ( imageName, filename );
+   clear_dirty();
+}
+
+// Read and check the superblock at the start of an image file.
+// Returns 0 if it describes a valid disk, -1 otherwise. Only images of the current FSVERSION
+// are read: earlier layouts have to be recreated.
+int read_superblock ( int fd, superblock_t *super )
+{
+   if ( pread ( fd, super, sizeof(superblock_t), 0 ) != sizeof(superblock_t) ) return -1;
+   if ( super->magic != FSMAGIC ) return -1;
+   if ( super->version != FSVERSION )
+   {
+      fprintf ( stderr, "(read_superblock) image is format version %d, but only version %d can be read\n", super->version, FSVERSION );
+      return -1;
+   }
+   if ( super->blocksize < MINBLOCKSIZE || super->blocksize > MAXBLOCKSIZE || (super->blocksize & (super->blocksize - 1)) ) return -1;
+   if ( super->blockcount <= super->rootdir || super->rootdir <= super->fatblocks ) return -1;
+   return 0;
+}
+
+// Switch the filesystem to a new geometry: size the in-memory disk, FAT and dirty bitmap to suit.
+// If an image is mounted it is resized and remapped instead of the in-memory disk.
+// Returns 0 on success, -1 on failure (a mounted image is then closed, and left unmounted).
+int set_geometry ( const superblock_t *super )
+{
+   size_t disksize = (size_t) super->blockcount * super->blocksize;
+
+   if ( mountedFd >= 0 && cacheCapacity > 0 )
+   {
+      // The cached blocks belong to the old geometry, so start the cache afresh.
+      if ( ftruncate ( mountedFd, disksize ) < 0 || cache_init ( cacheCapacity, cachePolicy, super->blocksize ) < 0 )
+      {
+         fprintf ( stderr, "(set_geometry) could not resize %s\n", mountedName );
+         cache_free();
+         close ( mountedFd );
+         mountedFd = -1;
+         mountedName[0] = '\0';
+         virtualDisk = NULL;
+         return -1;
+      }
+   }
+   else if ( mountedFd >= 0 )
+   {
+      if ( virtualDisk ) munmap ( virtualDisk, DISKSIZE );
+      void *map = MAP_FAILED;
+      if ( ftruncate ( mountedFd, disksize ) == 0 )
+      {
+         map = mmap ( NULL, disksize, PROT_READ | PROT_WRITE, MAP_SHARED, mountedFd, 0 );
+      }
+      if ( map == MAP_FAILED )
+      {
+         fprintf ( stderr, "(set_geometry) could not map %s\n", mountedName );
+         close ( mountedFd );
+         mountedFd = -1;
+         mountedName[0] = '\0';
+         virtualDisk = NULL;
+         return -1;
+      }
+      virtualDisk = map;
+   }
+   else if ( disksize != memoryDiskSize )
+   {
+      // Anonymous memory, so the untouched parts of a large disk cost nothing.
+      if ( memoryDisk ) munmap ( memoryDisk, memoryDiskSize );
+      memoryDisk = mmap ( NULL, disksize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0 );
+      if ( memoryDisk == MAP_FAILED )
+      {
+         fprintf ( stderr, "(set_geometry) could not allocate a %zu byte disk\n", disksize );
+         memoryDisk = NULL;
+         memoryDiskSize = 0;
+         virtualDisk = NULL;
+         return -1;
+      }
+      memoryDiskSize = disksize;
+      virtualDisk = memoryDisk;
+   }
+
+   // The dirty map starts out clean again, so an image written under the old geometry no longer
+   // matches the disk, and the next writedisk() to it has to be whole. (A mounted image is the disk.)
+   if ( super->blocksize != superBlock.blocksize || super->blockcount != superBlock.blockcount )
+   {
+      if ( mountedFd >= 0 ) strcpy ( imageName, mountedName );
+      else imageName[0] = '\0';
+   }
+
+   superBlock = *super;
+   FAT = realloc ( FAT, (size_t) MAXBLOCKS * sizeof(fatentry_t) );
+   free ( dirtyBlocks );
+   dirtyBlocks = calloc ( ((size_t) MAXBLOCKS + 7) / 8, 1 );
+   free ( fatDirty );
+   fatDirty = calloc ( ((size_t) superBlock.fatblocks + 7) / 8, 1 );
+   return 0;
+}
+
+// Mount a disk image: the image file is mmap'ed and virtualDisk becomes a view onto it,
+// so pages are only faulted in when touched. The geometry comes from the image's superblock.
+// A missing or empty image is created with the current geometry (zero-filled), and must be formatted.
+// Returns 0 on success, -1 on failure.
+int mountdisk ( const char * filename )
+{
+   return attach_image ( filename, 0, CACHE_LRU );
+}
+
+// Mount a disk image through a block cache of capacity blocks, so memory use is bounded
+// whatever the size of the image. readblock/writeblock and pins go through the cache, which
+// evicts by policy (CACHE_LRU or CACHE_CLOCK) and writes dirty victims back to the image.
+// Returns 0 on success, -1 on failure.
+int mountdisk_cached ( const char * filename, int capacity, int policy )
+{
+   if ( capacity < CACHEMINFRAMES ) capacity = CACHEMINFRAMES;
+   return attach_image ( filename, capacity, policy );
+}
+
+// Open an image and make it the disk, either mapped (capacity 0) or cached.
+int attach_image ( const char * filename, int capacity, int policy )
+{
+   if ( strlen(filename) >= MAXPATHLENGTH )
+   {
+      fprintf ( stderr, "(mountdisk) image name too long\n" );
+      return -1;
+   }
+   if ( mountedFd >= 0 ) unmountdisk();
+
+   int fd = open ( filename, O_RDWR | O_CREAT, 0644 );
+   if ( fd < 0 )
+   {
+      fprintf ( stderr, "(mountdisk) could not open %s\n", filename );
+      return -1;
+   }
+
+   struct stat st;
+   superblock_t super = superBlock;
+   if ( fstat ( fd, &st ) < 0 )
+   {
+      close(fd);
+      return -1;
+   }
+   int isnew = ( st.st_size == 0 );
+   if ( !isnew && read_superblock ( fd, &super ) < 0 )
+   {
+      fprintf ( stderr, "(mountdisk) %s is not a disk image\n", filename );
+      close(fd);
+      return -1;
+   }
+
+   // Drop the in-memory disk and map (or cache) the image in its place.
+   // set_geometry() grows a new or short image to the full disk size (sparse, so this is cheap).
+   if ( memoryDisk ) munmap ( memoryDisk, memoryDiskSize );
+   memoryDisk = NULL;
+   memoryDiskSize = 0;
+   virtualDisk = NULL;
+   mountedFd = fd;
+   strcpy ( mountedName, filename );
+   cacheCapacity = capacity;
+   cachePolicy = policy;
+   if ( capacity > 0 && ioDepth == 0 ) blockio_init ( BLOCKIO_URING, BLOCKIODEPTH );
+   if ( set_geometry ( &super ) < 0 ) return -1;
+   strcpy ( imageName, filename );
+   clear_dirty();
+
+   // Pick up the FAT and root directory of an existing image.
+   if ( !isnew )
+   {
+      loadFAT(FAT);
+      rootDirIndex = superBlock.rootdir;
+      currentDirIndex = rootDirIndex;
+      dcache_clear();
+   }
+   return 0;
+}
+
+// Write the dirty blocks of the mounted image back to its file.
+// Each run of dirty blocks is widened to whole pages and msync'ed on its own.
+void syncdisk()
+{
+   if ( mountedFd < 0 ) return;
+   syncFAT();
+   if ( cacheCapacity > 0 )
+   {
+      if ( cache_sync() < 0 )
+      {
+         fprintf ( stderr, "(syncdisk) write back to %s failed\n", mountedName );
+         return;
+      }
+      diskStats.flushes++;
+      if ( strcmp ( imageName, mountedName ) == 0 ) clear_dirty();
+      return;
+   }
+
+   long pagesize = sysconf(_SC_PAGESIZE);
+   fatentry_t start = next_dirty(0);
+   while ( start < MAXBLOCKS )
+   {
+      fatentry_t end = start;
+      while ( end < MAXBLOCKS && is_dirty(end) ) end++;
+
+      size_t from = ((size_t) start * BLOCKSIZE) / pagesize * pagesize;
+      size_t to   = (size_t) end * BLOCKSIZE;
+      if ( msync ( virtualDisk + from, to - from, MS_SYNC ) < 0 )
+      {
+         fprintf ( stderr, "(syncdisk) msync of %s failed\n", mountedName );
+         return;
+      }
+      diskStats.runsflushed++;
+      diskStats.bytesflushed += (size_t) (end - start) * BLOCKSIZE;
+      start = next_dirty(end);
+   }
+
+   diskStats.flushes++;
+   if ( strcmp ( imageName, mountedName ) == 0 ) clear_dirty();
+}
+
+// Sync and unmap the mounted image.
+// The image is copied into anonymous memory, which becomes the in-memory disk, so the filesystem
+// carries on where it left off and owes nothing to the file any more (it may be overwritten or
+// removed). Blocks of zeros are not copied, so the untouched parts of a sparse image cost nothing.
+void unmountdisk()
+{
+   if ( mountedFd < 0 ) return;
+   syncdisk();
+
+   size_t disksize = DISKSIZE;
+   if ( cacheCapacity > 0 ) cache_free();
+   else munmap ( virtualDisk, disksize );
+   memoryDisk = mmap ( NULL, disksize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0 );
+   if ( memoryDisk == MAP_FAILED || load_image ( mountedFd, memoryDisk, disksize ) < 0 )
+   {
+      fprintf ( stderr, "(unmountdisk) could not keep a copy of %s\n", mountedName );
+      if ( memoryDisk != MAP_FAILED ) munmap ( memoryDisk, disksize );
+      memoryDisk = NULL;
+      disksize = 0;
+   }
+   memoryDiskSize = disksize;
+   virtualDisk = memoryDisk;
+
+   close ( mountedFd );
+   mountedFd = -1;
+   mountedName[0] = '\0';
+}
+
+// Read size bytes of an image file into memory that starts out zeroed, skipping any chunk that is
+// all zeros (so its pages are never touched). Returns 0 on success, -1 on failure.
+int load_image ( int fd, Byte *disk, size_t size )
+{
+   size_t chunk = 1 << 16;
+   Byte *buf = malloc ( chunk );
+   if ( buf == NULL ) return -1;
+   for ( size_t off = 0; off < size; off += chunk )
+   {
+      size_t len = ( size - off < chunk ) ? size - off : chunk;
+      ssize_t got = pread ( fd, buf, len, off );
+      if ( got < 0 )
+      {
+         free(buf);
+         return -1;
+      }
+      size_t i = 0;
+      while ( i < (size_t) got && buf[i] == 0 ) i++;
+      if ( i < (size_t) got ) memcpy ( disk + off, buf, got ); // (a short image reads as zeros past its end.)
+   }
+   free(buf);
+   return 0;
+}
+
+// Print the disk write and cache counters.
+void print_diskstats()
+{
+   printf("Disk stats: %ld full writes, %ld incremental flushes (%ld runs), %ld bytes flushed\n",
+          diskStats.fullwrites, diskStats.flushes, diskStats.runsflushed, diskStats.bytesflushed);
+   printf("Cache stats: %ld hits, %ld misses, %ld evictions, %ld write-backs, %ld prefetched\n",
+          diskStats.cachehits, diskStats.cachemisses, diskStats.evictions, diskStats.writebacks, diskStats.prefetched);
+   printf("Block I/O: %s, %ld requests in %ld batches\n",
+          ioBackend == BLOCKIO_URING ? "io_uring" : "preadv/pwritev", diskStats.ioreqs, diskStats.iobatches);
+   printf("Readahead: %ld hits, %ld wasted\n", diskStats.rahits, diskStats.rawasted);
+   printf("Files: %ld opens, %d open now, %ld at most, %ld blocks copied on write\n", diskStats.opens, openFiles, diskStats.peakopen, diskStats.cowblocks);
+   printf("Dentry cache: %ld hits, %ld misses\n", diskStats.dentryhits, diskStats.dentrymisses);
+}
+
+/* --------  DIRTY BLOCK FUNCTIONS ---------------
+
+  Tracking which blocks changed since the last write to disk.
+  ------------------------------------
+*/
+
+// Mark a block as changed.
+void mark_dirty(int block_address)
+{
+   dirtyBlocks[block_address / 8] |= (1 << (block_address % 8));
 }
 
+// Returns TRUE if the block changed since the disk was last written.
+int is_dirty(int block_address)
+{
+   return (dirtyBlocks[block_address / 8] >> (block_address % 8)) & 1;
+}
+
+// Returns the first dirty block at or after from (MAXBLOCKS if none), skipping clean bytes of the bitmap whole.
+fatentry_t next_dirty(fatentry_t from)
+{
+   while ( from < MAXBLOCKS )
+   {
+      if ( from % 8 == 0 && dirtyBlocks[from / 8] == 0 ) from += 8;
+      else if ( is_dirty(from) ) return from;
+      else from++;
+   }
+   return MAXBLOCKS;
+}
+
+// Mark every block as clean.
+void clear_dirty()
+{
+   memset ( dirtyBlocks, 0, ((size_t) MAXBLOCKS + 7) / 8 );
+}
+
+/* --------  BLOCK I/O FUNCTIONS ---------------
+
+  Asynchronous block reads and writes against an image file, used under the block cache.
+  Requests are queued, submitted in batches, and their callbacks run as completions are reaped.
+  The io_uring backend keeps up to ioDepth requests in flight; the fallback does plain
+  preadv/pwritev at submit time and delivers the completions the same way.
+  ------------------------------------
+*/
+
+#ifdef HAVE_IO_URING
+// The submission and completion rings shared with the kernel.
+typedef struct uring {
+   int                  fd;
+   unsigned            *sqhead, *sqtail, *sqmask, *sqarray;
+   unsigned            *cqhead, *cqtail, *cqmask;
+   struct io_uring_sqe *sqes;
+   struct io_uring_cqe *cqes;
+   void                *sqring, *cqring;
+   size_t               sqringsize, cqringsize, sqessize;
+} uring_t;
+
+uring_t ioRing = { .fd = -1 };
+
+// Set up an io_uring with room for depth requests. Returns 0 on success, -1 if io_uring is unavailable.
+int uring_setup(int depth)
+{
+   struct io_uring_params p;
+   memset ( &p, 0, sizeof(p) );
+   int fd = syscall ( __NR_io_uring_setup, depth, &p );
+   if ( fd < 0 ) return -1;
+
+   ioRing.fd = fd;
+   ioRing.sqringsize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+   ioRing.cqringsize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+   if ( p.features & IORING_FEAT_SINGLE_MMAP )
+   {
+      if ( ioRing.cqringsize > ioRing.sqringsize ) ioRing.sqringsize = ioRing.cqringsize;
+      ioRing.cqringsize = ioRing.sqringsize;
+   }
+   ioRing.sqessize = p.sq_entries * sizeof(struct io_uring_sqe);
+
+   ioRing.sqring = mmap ( NULL, ioRing.sqringsize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING );
+   if ( ioRing.sqring == MAP_FAILED )
+   {
+      close(fd);
+      ioRing.fd = -1;
+      return -1;
+   }
+   if ( p.features & IORING_FEAT_SINGLE_MMAP ) ioRing.cqring = ioRing.sqring;
+   else ioRing.cqring = mmap ( NULL, ioRing.cqringsize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING );
+   ioRing.sqes = mmap ( NULL, ioRing.sqessize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES );
+   if ( ioRing.cqring == MAP_FAILED || ioRing.sqes == MAP_FAILED )
+   {
+      if ( ioRing.cqring != MAP_FAILED && ioRing.cqring != ioRing.sqring ) munmap ( ioRing.cqring, ioRing.cqringsize );
+      if ( ioRing.sqes != MAP_FAILED ) munmap ( ioRing.sqes, ioRing.sqessize );
+      munmap ( ioRing.sqring, ioRing.sqringsize );
+      close(fd);
+      ioRing.fd = -1;
+      return -1;
+   }
+
+   Byte *sq = ioRing.sqring, *cq = ioRing.cqring;
+   ioRing.sqhead  = (unsigned *) (sq + p.sq_off.head);
+   ioRing.sqtail  = (unsigned *) (sq + p.sq_off.tail);
+   ioRing.sqmask  = (unsigned *) (sq + p.sq_off.ring_mask);
+   ioRing.sqarray = (unsigned *) (sq + p.sq_off.array);
+   ioRing.cqhead  = (unsigned *) (cq + p.cq_off.head);
+   ioRing.cqtail  = (unsigned *) (cq + p.cq_off.tail);
+   ioRing.cqmask  = (unsigned *) (cq + p.cq_off.ring_mask);
+   ioRing.cqes    = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+   return 0;
+}
+
+// Tear the io_uring down.
+void uring_teardown()
+{
+   if ( ioRing.fd < 0 ) return;
+   munmap ( ioRing.sqes, ioRing.sqessize );
+   if ( ioRing.cqring != ioRing.sqring ) munmap ( ioRing.cqring, ioRing.cqringsize );
+   munmap ( ioRing.sqring, ioRing.sqringsize );
+   close ( ioRing.fd );
+   ioRing.fd = -1;
+}
+
+// Put a request on the submission ring (the kernel sees it at the next io_uring_enter).
+void uring_push(int slot)
+{
+   blockio_request_t *req = &ioRequests[slot];
+   unsigned tail = *ioRing.sqtail;
+   unsigned index = tail & *ioRing.sqmask;
+   struct io_uring_sqe *sqe = &ioRing.sqes[index];
+
+   memset ( sqe, 0, sizeof(*sqe) );
+   sqe->opcode = ( req->op == BLOCKIO_READ ) ? IORING_OP_READV : IORING_OP_WRITEV;
+   sqe->fd = req->fd;
+   sqe->addr = (unsigned long) req->iov;
+   sqe->len = req->count;
+   sqe->off = (off_t) req->block * BLOCKSIZE;
+   sqe->user_data = slot;
+   ioRing.sqarray[index] = index;
+   __atomic_store_n ( ioRing.sqtail, tail + 1, __ATOMIC_RELEASE );
+}
+
+// Take the last count requests back off the submission ring, as the kernel has not picked them up,
+// and finish them with result instead.
+void uring_unpush(int count, int result)
+{
+   unsigned tail = *ioRing.sqtail;
+   for ( int i = 1; i <= count; i++ )
+   {
+      int slot = (int) ioRing.sqes[ioRing.sqarray[(tail - i) & *ioRing.sqmask]].user_data;
+      ioRequests[slot].result = result;
+      ioRequests[slot].state = IO_DONE;
+   }
+   __atomic_store_n ( ioRing.sqtail, tail - count, __ATOMIC_RELEASE );
+}
+
+// Enter the kernel to submit requests and/or wait for completions.
+int uring_enter(unsigned submit, unsigned wait)
+{
+   int ret;
+   do {
+      ret = syscall ( __NR_io_uring_enter, ioRing.fd, submit, wait, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0 );
+   } while ( ret < 0 && errno == EINTR );
+   return ret;
+}
+#endif
+
+// Choose the backend (BLOCKIO_URING falls back to BLOCKIO_SYNC where io_uring is unavailable)
+// and how many requests may be outstanding. Returns the backend in use.
+int blockio_init(int backend, int depth)
+{
+   blockio_shutdown();
+   if ( depth < 1 ) depth = BLOCKIODEPTH;
+   ioRequests = calloc ( depth, sizeof(blockio_request_t) );
+   ioDepth = depth;
+   ioBackend = BLOCKIO_SYNC;
+#ifdef HAVE_IO_URING
+   if ( backend == BLOCKIO_URING && uring_setup(depth) == 0 ) ioBackend = BLOCKIO_URING;
+#endif
+   return ioBackend;
+}
+
+// Finish outstanding requests and release the backend.
+void blockio_shutdown()
+{
+   if ( ioDepth == 0 ) return;
+   blockio_drain();
+#ifdef HAVE_IO_URING
+   uring_teardown();
+#endif
+   free ( ioRequests );
+   ioRequests = NULL;
+   ioDepth = 0;
+}
+
+// Queue a read or write of count consecutive blocks starting at block_address, to or from
+// the buffers in bufs (one block each). Nothing is sent until blockio_submit(); callback (if any)
+// runs when the request completes, with the bytes transferred or -errno.
+// If every slot is busy, outstanding requests are completed first to make room.
+// Returns 0, or -1 if no slot could be freed (the request is not queued).
+int blockio_queue(int op, int fd, fatentry_t block_address, int count, Byte **bufs, blockio_callback callback, void *arg)
+{
+   if ( ioDepth == 0 ) blockio_init(BLOCKIO_URING, BLOCKIODEPTH);
+
+   int slot = -1;
+   while ( slot < 0 )
+   {
+      for ( int i = 0; i < ioDepth && slot < 0; i++ ) if ( ioRequests[i].state == IO_FREE ) slot = i;
+      if ( slot < 0 && blockio_wait(1) < 0 ) return -1;
+   }
+
+   blockio_request_t *req = &ioRequests[slot];
+   req->op = op;
+   req->fd = fd;
+   req->block = block_address;
+   req->count = count;
+   for ( int i = 0; i < count; i++ )
+   {
+      req->iov[i].iov_base = bufs[i];
+      req->iov[i].iov_len = BLOCKSIZE;
+   }
+   req->callback = callback;
+   req->arg = arg;
+   req->result = 0;
+   req->state = IO_QUEUED;
+   ioQueued++;
+   diskStats.ioreqs++;
+#ifdef HAVE_IO_URING
+   if ( ioBackend == BLOCKIO_URING ) uring_push(slot);
+#endif
+   return 0;
+}
+
+// Send every queued request off in one batch. Returns the number submitted, or -1 if io_uring
+// would not take them all (those left over complete at the next blockio_wait() with -errno).
+int blockio_submit()
+{
+   if ( ioQueued == 0 ) return 0;
+   int submitted = ioQueued;
+#ifdef HAVE_IO_URING
+   if ( ioBackend == BLOCKIO_URING )
+   {
+      int left = ioQueued;
+      while ( left > 0 )
+      {
+         int ret = uring_enter ( left, 0 );
+         if ( ret < 0 )
+         {
+            fprintf ( stderr, "(blockio_submit) io_uring_enter failed\n" );
+            uring_unpush ( left, -errno );
+            break;
+         }
+         left -= ret;
+      }
+      for ( int i = 0; i < ioDepth; i++ ) if ( ioRequests[i].state == IO_QUEUED ) ioRequests[i].state = IO_INFLIGHT;
+      ioInflight += submitted;
+      ioQueued = 0;
+      diskStats.iobatches++;
+      return ( left > 0 ) ? -1 : submitted;
+   }
+#endif
+   // Fallback: do the I/O now, and hand the results out as completions.
+   for ( int i = 0; i < ioDepth; i++ )
+   {
+      blockio_request_t *req = &ioRequests[i];
+      if ( req->state != IO_QUEUED ) continue;
+      off_t off = (off_t) req->block * BLOCKSIZE;
+      ssize_t ret = ( req->op == BLOCKIO_READ ) ? preadv ( req->fd, req->iov, req->count, off )
+                                                : pwritev ( req->fd, req->iov, req->count, off );
+      req->result = ( ret < 0 ) ? -errno : (int) ret;
+      req->state = IO_DONE;
+   }
+   ioInflight += submitted;
+   ioQueued = 0;
+   diskStats.iobatches++;
+   return submitted;
+}
+
+// Free a finished request's slot and run its callback.
+void blockio_complete(int slot, int result)
+{
+   blockio_request_t *req = &ioRequests[slot];
+   blockio_callback callback = req->callback;
+   fatentry_t block = req->block;
+   int count = req->count;
+   void *arg = req->arg;
+   req->state = IO_FREE;
+   ioInflight--;
+   if ( callback ) callback ( block, count, result, arg );
+}
+
+// Reap completions, waiting until at least min of them have arrived (or nothing is left in flight).
+// Queued requests are submitted first. Returns the number of completions handled, or -1 if
+// io_uring could not be waited on.
+int blockio_wait(int min)
+{
+   blockio_submit();
+   if ( min > ioInflight ) min = ioInflight;
+   int reaped = 0;
+   for ( int i = 0; i < ioDepth; i++ )
+   {
+      if ( ioRequests[i].state != IO_DONE ) continue;
+      blockio_complete ( i, ioRequests[i].result );
+      reaped++;
+   }
+#ifdef HAVE_IO_URING
+   if ( ioBackend == BLOCKIO_URING )
+   {
+      while ( 1 )
+      {
+         unsigned head = *ioRing.cqhead;
+         unsigned tail = __atomic_load_n ( ioRing.cqtail, __ATOMIC_ACQUIRE );
+         while ( head != tail )
+         {
+            struct io_uring_cqe *cqe = &ioRing.cqes[head & *ioRing.cqmask];
+            int slot = (int) cqe->user_data;
+            int result = cqe->res;
+            head++;
+            __atomic_store_n ( ioRing.cqhead, head, __ATOMIC_RELEASE );
+            blockio_complete ( slot, result );
+            reaped++;
+         }
+         if ( reaped >= min ) return reaped;
+         if ( uring_enter ( 0, min - reaped ) < 0 )
+         {
+            fprintf ( stderr, "(blockio_wait) io_uring_enter failed\n" );
+            return -1;
+         }
+      }
+   }
+#endif
+   return reaped;
+}
+
+// Submit everything queued and wait for all of it to complete.
+// Returns 0, or -1 if some of it could not be waited for.
+int blockio_drain()
+{
+   blockio_submit();
+   while ( ioInflight > 0 ) if ( blockio_wait(ioInflight) < 0 ) return -1;
+   return 0;
+}
+
+/* --------  CACHE FUNCTIONS ---------------
+
+  A fixed-size block cache over the image file, for disks mounted with mountdisk_cached().
+  Frames are found through a hash of block numbers, and evicted in LRU or CLOCK order.
+  ------------------------------------
+*/
+
+// Data held by a cache frame.
+#define FRAME(frame) (cacheData + (size_t) (frame) * BLOCKSIZE)
+
+// (Re)create an empty cache of capacity frames of blocksize bytes.
+// Returns 0 on success, -1 if the memory could not be had.
+int cache_init(int capacity, int policy, int blocksize)
+{
+   cache_free();
+   cacheFrames = calloc ( capacity, sizeof(cacheframe_t) );
+   cacheData = malloc ( (size_t) capacity * blocksize );
+   for ( cacheBucketCount = 1; cacheBucketCount < capacity; cacheBucketCount <<= 1 );
+   cacheBuckets = malloc ( cacheBucketCount * sizeof(int) );
+   if ( cacheFrames == NULL || cacheData == NULL || cacheBuckets == NULL )
+   {
+      cache_free();
+      return -1;
+   }
+   for ( int i = 0; i < cacheBucketCount; i++ ) cacheBuckets[i] = -1;
+
+   // Every frame starts empty, chained into the LRU list in order.
+   for ( int i = 0; i < capacity; i++ )
+   {
+      cacheFrames[i].block = UNUSED;
+      cacheFrames[i].hnext = -1;
+      cacheFrames[i].prev = i - 1;
+      cacheFrames[i].next = ( i + 1 < capacity ) ? i + 1 : -1;
+   }
+   lruHead = 0;
+   lruTail = capacity - 1;
+   clockHand = 0;
+   cacheCapacity = capacity;
+   cachePolicy = policy;
+   return 0;
+}
+
+// Throw the cache away (without writing anything back).
+void cache_free()
+{
+   free ( cacheFrames );
+   free ( cacheData );
+   free ( cacheBuckets );
+   cacheFrames = NULL;
+   cacheData = NULL;
+   cacheBuckets = NULL;
+   cacheBucketCount = 0;
+   cacheCapacity = 0;
+}
+
+// Returns the frame holding a block, or -1 if it is not cached.
+int cache_find(fatentry_t block_address)
+{
+   int frame = cacheBuckets[block_address & (cacheBucketCount - 1)];
+   while ( frame >= 0 && cacheFrames[frame].block != block_address ) frame = cacheFrames[frame].hnext;
+   return frame;
+}
+
+// Move a frame to the front of the LRU list (or mark it referenced, for CLOCK).
+void cache_touch(int frame)
+{
+   cacheframe_t *f = &cacheFrames[frame];
+   f->referenced = TRUE;
+   if ( cachePolicy != CACHE_LRU || lruHead == frame ) return;
+
+   // Unlink.
+   if ( f->prev >= 0 ) cacheFrames[f->prev].next = f->next;
+   if ( f->next >= 0 ) cacheFrames[f->next].prev = f->prev;
+   else lruTail = f->prev;
+
+   // Push on the front.
+   f->prev = -1;
+   f->next = lruHead;
+   cacheFrames[lruHead].prev = frame;
+   lruHead = frame;
+}
+
+// Pick a frame to reuse: the least recently used unpinned frame, or (CLOCK) the first
+// unpinned frame the hand finds unreferenced. Returns -1 if every frame is pinned.
+int cache_victim()
+{
+   if ( cachePolicy == CACHE_LRU )
+   {
+      int frame = lruTail;
+      while ( frame >= 0 && cacheFrames[frame].pins > 0 ) frame = cacheFrames[frame].prev;
+      return frame;
+   }
+
+   for ( int sweep = 0; sweep < 2 * cacheCapacity; sweep++ )
+   {
+      int frame = clockHand;
+      clockHand = ( clockHand + 1 ) % cacheCapacity;
+      if ( cacheFrames[frame].pins > 0 ) continue;
+      if ( cacheFrames[frame].block == UNUSED || !cacheFrames[frame].referenced ) return frame;
+      cacheFrames[frame].referenced = FALSE;
+   }
+   return -1;
+}
+
+// Completion of a read into the cache: a short read (past the end of the image) reads as zeros.
+// A failed read's result is also left in *arg, if it is given.
+void cache_read_done(fatentry_t block_address, int count, int result, void *arg)
+{
+   if ( arg && result < 0 ) *(int *) arg = result;
+   if ( result < 0 ) fprintf ( stderr, "(cache_read_done) read of block %d from %s failed\n", (int) block_address, mountedName );
+   for ( int i = 0; i < count; i++ )
+   {
+      long got = (long) result - (long) i * BLOCKSIZE;
+      if ( got >= BLOCKSIZE ) continue;
+      if ( got < 0 ) got = 0;
+      int frame = cache_find ( block_address + i );
+      if ( frame >= 0 ) memset ( FRAME(frame) + got, 0, BLOCKSIZE - got );
+   }
+}
+
+// Completion of a write from the cache: the frames still holding those blocks are now clean.
+void cache_write_done(fatentry_t block_address, int count, int result, void *arg)
+{
+   (void) arg;
+   if ( result != count * BLOCKSIZE )
+   {
+      fprintf ( stderr, "(cache_write_done) write of block %d to %s failed\n", (int) block_address, mountedName );
+      return;
+   }
+   for ( int i = 0; i < count; i++ )
+   {
+      int frame = cache_find ( block_address + i );
+      if ( frame >= 0 ) cacheFrames[frame].dirty = FALSE;
+   }
+   diskStats.writebacks += count;
+}
+
+// Write a dirty frame back to the image. Returns 0, or -1 if the write could not be done.
+int cache_writeback(int frame)
+{
+   Byte *buf = FRAME(frame);
+   if ( blockio_queue ( BLOCKIO_WRITE, mountedFd, cacheFrames[frame].block, 1, &buf, cache_write_done, NULL ) < 0 ) return -1;
+   return blockio_drain();
+}
+
+// Take a frame's block out of the hash, leaving the frame empty.
+void cache_unhash(int frame)
+{
+   cacheframe_t *f = &cacheFrames[frame];
+   int *link = &cacheBuckets[f->block & (cacheBucketCount - 1)];
+   while ( *link != frame ) link = &cacheFrames[*link].hnext;
+   *link = f->hnext;
+   f->block = UNUSED;
+   f->dirty = FALSE;
+}
+
+// Take a frame for a block that is not cached: evict its current block (queueing the write-back
+// of a dirty one, which the caller must drain before reusing the frame's data) and rehash it.
+// Returns the frame, or -1 if every frame is pinned or a dirty victim could not be queued.
+int cache_claim(fatentry_t block_address)
+{
+   int frame = cache_victim();
+   if ( frame < 0 )
+   {
+      fprintf ( stderr, "(cache_claim) every cache frame is pinned\n" );
+      return -1;
+   }
+
+   cacheframe_t *f = &cacheFrames[frame];
+   if ( f->block != UNUSED )
+   {
+      if ( f->dirty )
+      {
+         Byte *buf = FRAME(frame);
+         if ( blockio_queue ( BLOCKIO_WRITE, mountedFd, f->block, 1, &buf, NULL, NULL ) < 0 ) return -1;
+         diskStats.writebacks++;
+      }
+      cache_unhash(frame);
+      diskStats.evictions++;
+   }
+
+   f->block = block_address;
+   f->dirty = FALSE;
+   f->hnext = cacheBuckets[block_address & (cacheBucketCount - 1)];
+   cacheBuckets[block_address & (cacheBucketCount - 1)] = frame;
+   cache_touch(frame);
+   return frame;
+}
+
+// Returns the frame holding a block, loading it from the image on a miss (unless fill is FALSE,
+// for a block about to be overwritten). A dirty victim is written back before its frame is reused.
+// Returns -1 if no frame could be had (every one is pinned) or the block could not be read.
+int cache_get(fatentry_t block_address, int fill)
+{
+   int frame = cache_find(block_address);
+   if ( frame >= 0 )
+   {
+      diskStats.cachehits++;
+      cache_touch(frame);
+      return frame;
+   }
+   diskStats.cachemisses++;
+
+   frame = cache_claim(block_address);
+   if ( frame < 0 ) return -1;
+   int result = 0;
+   if ( blockio_drain() < 0 ) result = -1; // the victim's write-back has to finish before its data is replaced.
+   else if ( fill )
+   {
+      Byte *buf = FRAME(frame);
+      if ( blockio_queue ( BLOCKIO_READ, mountedFd, block_address, 1, &buf, cache_read_done, &result ) < 0 || blockio_drain() < 0 ) result = -1;
+   }
+   if ( result < 0 )
+   {
+      cache_unhash(frame); // so the block is read again next time.
+      return -1;
+   }
+   return frame;
+}
+
+// Load a batch of blocks into the cache ahead of use, as one submission: the victims'
+// write-backs go out together, then the reads, with runs of adjacent blocks read by one request.
+// At most half the cache is given over to a prefetch. Returns the number of blocks loaded.
+int cache_prefetch(const fatentry_t *blocks, int n)
+{
+   if ( n > cacheCapacity / 2 ) n = cacheCapacity / 2;
+
+   fatentry_t *wanted = malloc ( n * sizeof(fatentry_t) );
+   Byte **bufs = malloc ( n * sizeof(Byte *) );
+   int count = 0;
+   for ( int i = 0; i < n; i++ )
+   {
+      if ( blocks[i] < 0 || blocks[i] >= MAXBLOCKS || cache_find(blocks[i]) >= 0 ) continue;
+      int frame = cache_claim(blocks[i]);
+      if ( frame < 0 ) break; // (a prefetch is only a hint.)
+      cacheFrames[frame].pins++; // so a later claim in this batch cannot take it back.
+      bufs[count] = FRAME(frame);
+      wanted[count++] = blocks[i];
+   }
+   int result = blockio_drain();
+
+   int i = 0;
+   while ( i < count && result == 0 )
+   {
+      int run = 1;
+      while ( i + run < count && run < BLOCKIOMAXVEC && wanted[i + run] == wanted[i] + run ) run++;
+      if ( blockio_queue ( BLOCKIO_READ, mountedFd, wanted[i], run, &bufs[i], cache_read_done, &result ) < 0 ) result = -1;
+      i += run;
+   }
+   if ( blockio_drain() < 0 ) result = -1;
+
+   for ( int i = 0; i < count; i++ )
+   {
+      int frame = cache_find(wanted[i]);
+      cacheFrames[frame].pins--;
+      if ( result < 0 ) cache_unhash(frame); // (none of them can be trusted.)
+   }
+   if ( result < 0 ) count = 0;
+   diskStats.prefetched += count;
+   free ( wanted );
+   free ( bufs );
+   return count;
+}
+
+// Order frames by block number, for qsort.
+int cache_frame_cmp(const void *a, const void *b)
+{
+   fatentry_t x = cacheFrames[*(const int *) a].block, y = cacheFrames[*(const int *) b].block;
+   return (x > y) - (x < y);
+}
+
+// Write every dirty frame back to the image, in block order, as one batch of requests
+// with adjacent blocks coalesced into a single request. Returns 0, or -1 if a write failed.
+int cache_sync()
+{
+   int *dirty = malloc ( cacheCapacity * sizeof(int) );
+   Byte **bufs = malloc ( cacheCapacity * sizeof(Byte *) );
+   int count = 0;
+   for ( int i = 0; i < cacheCapacity; i++ )
+   {
+      if ( cacheFrames[i].block != UNUSED && cacheFrames[i].dirty ) dirty[count++] = i;
+   }
+   qsort ( dirty, count, sizeof(int), cache_frame_cmp );
+   for ( int i = 0; i < count; i++ ) bufs[i] = FRAME(dirty[i]);
+
+   int i = 0;
+   while ( i < count )
+   {
+      fatentry_t start = cacheFrames[dirty[i]].block;
+      int n = 1;
+      while ( i + n < count && n < BLOCKIOMAXVEC && cacheFrames[dirty[i + n]].block == start + n ) n++;
+      blockio_queue ( BLOCKIO_WRITE, mountedFd, start, n, &bufs[i], cache_write_done, NULL );
+      diskStats.runsflushed++;
+      diskStats.bytesflushed += (size_t) n * BLOCKSIZE;
+      i += n;
+   }
+   blockio_drain();
+   free ( dirty );
+   free ( bufs );
+
+   // A write that failed (or could not be made) leaves its frames dirty.
+   for ( int i = 0; i < cacheCapacity; i++ ) if ( cacheFrames[i].block != UNUSED && cacheFrames[i].dirty ) return -1;
+   return 0;
+}
 
 /* --------  BLOCK FUNCTIONS ---------------
 
@@ -54,28 +1147,149 @@ void readdisk ( const char * filename )
 */
 
 // Write a diskblock to the virtual disk.
-void writeblock ( diskblock_t *block, int block_address, int type )
+// Returns 0, or -1 if a cached disk has no frame to spare for it (every one is pinned).
+int writeblock ( diskblock_t *block, int block_address, int type )
 {
+   if ( cacheCapacity > 0 )
+   {
+      // The whole block is replaced, so a miss needs no read from the image.
+      int frame = cache_get ( block_address, FALSE );
+      if ( frame < 0 ) return -1;
+      mark_dirty(block_address);
+      memmove ( FRAME(frame), block->data, BLOCKSIZE );
+      cacheFrames[frame].dirty = TRUE;
+      return 0;
+   }
+   mark_dirty(block_address);
    if(type == TYPE_DATA)
    {
-      memmove ( virtualDisk[block_address].data, block->data, BLOCKSIZE );
+      memmove ( BLOCK(block_address)->data, block->data, BLOCKSIZE );
    }
    else if(type == TYPE_FAT)
    {
-      memmove ( virtualDisk[block_address].fat, block->fat, BLOCKSIZE ); 
+      memmove ( BLOCK(block_address)->fat, block->fat, BLOCKSIZE ); 
    }
    else if(type == TYPE_DIR)
    {
-      memmove ( virtualDisk[block_address].data, block->data, BLOCKSIZE );
+      memmove ( BLOCK(block_address)->data, block->data, BLOCKSIZE );
    }
+   return 0;
 }
 
 // Copy data from virtual disk into a diskblock.
-void readblock(diskblock_t *block, int block_address, int type)
+// Returns 0, or -1 if a cached disk could not bring the block in.
+int readblock(diskblock_t *block, int block_address, int type)
+{
+   if ( cacheCapacity > 0 )
+   {
+      int frame = cache_get ( block_address, TRUE );
+      if ( frame < 0 ) return -1;
+      memmove ( block->data, FRAME(frame), BLOCKSIZE );
+      return 0;
+   }
+   if(type == TYPE_DATA) memmove(block->data, BLOCK(block_address)->data, BLOCKSIZE);
+   else if(type == TYPE_FAT) memmove(block->fat, BLOCK(block_address)->fat, BLOCKSIZE);
+   else if(type == TYPE_DIR) memmove(block->data, BLOCK(block_address)->data, BLOCKSIZE);
+   return 0;
+}
+
+// Borrow a read-only view of a block, without copying it.
+// The pointer stays valid until the matching unpinblock() (a cached block is not evicted while pinned).
+// Returns NULL if a cached disk could not bring the block in (every frame is pinned, or the read
+// failed); nothing is pinned then.
+const diskblock_t *pinblock(fatentry_t block_address)
+{
+   if ( cacheCapacity > 0 )
+   {
+      int frame = cache_get ( block_address, TRUE );
+      if ( frame < 0 ) return NULL;
+      cacheFrames[frame].pins++;
+      pinnedBlocks++;
+      return (diskblock_t *) FRAME(frame);
+   }
+   pinnedBlocks++;
+   return BLOCK(block_address);
+}
+
+// Borrow a block for updating in place, without copying it.
+// Changes land on the disk directly; unpinblock_rw() marks the block dirty. Returns NULL as pinblock() does.
+diskblock_t *pinblock_rw(fatentry_t block_address)
+{
+   return (diskblock_t *) pinblock(block_address);
+}
+
+// Release a read-only pin.
+void unpinblock(fatentry_t block_address)
+{
+   pinnedBlocks--;
+   if ( cacheCapacity > 0 ) cacheFrames[cache_find(block_address)].pins--;
+}
+
+// Release a pin taken with pinblock_rw(), marking the block dirty.
+void unpinblock_rw(fatentry_t block_address)
+{
+   mark_dirty(block_address);
+   if ( cacheCapacity > 0 ) cacheFrames[cache_find(block_address)].dirty = TRUE;
+   unpinblock(block_address);
+}
+
+// Ask for count blocks from block_address on to be loaded ahead of use.
+// A cached disk reads them in as one batch; a mapped one is advised the pages will be needed.
+void prefetch_range(fatentry_t block_address, int count)
+{
+   if ( block_address + count > MAXBLOCKS ) count = MAXBLOCKS - block_address;
+   if ( count <= 0 ) return;
+   if ( cacheCapacity > 0 )
+   {
+      fatentry_t *blocks = malloc ( count * sizeof(fatentry_t) );
+      for ( int i = 0; i < count; i++ ) blocks[i] = block_address + i;
+      cache_prefetch ( blocks, count );
+      free ( blocks );
+   }
+   else if ( mountedFd >= 0 )
+   {
+      long pagesize = sysconf(_SC_PAGESIZE);
+      size_t from = ((size_t) block_address * BLOCKSIZE) / pagesize * pagesize;
+      madvise ( virtualDisk + from, (size_t) (block_address + count) * BLOCKSIZE - from, MADV_WILLNEED );
+   }
+}
+
+// Ask for the next count blocks of a FAT chain, from block_address on, to be loaded ahead of use.
+// The chain is walked in the in-memory FAT, and the blocks fetched as one batch (a mapped disk is
+// advised a run of adjacent blocks at a time). Returns the last block asked for (0 if none), so a
+// caller can carry on from there.
+fatentry_t prefetch_chain(fatentry_t block_address, int count)
 {
-   if(type == TYPE_DATA) memmove(block->data, virtualDisk[block_address].data, BLOCKSIZE);
-   else if(type == TYPE_FAT) memmove(block->fat, virtualDisk[block_address].fat, BLOCKSIZE);
-   else if(type == TYPE_DIR) memmove(block->data, virtualDisk[block_address].data, BLOCKSIZE);
+   if ( cacheCapacity == 0 && mountedFd < 0 ) return 0; // nothing to fetch on an in-memory disk.
+   if ( count <= 0 ) return 0;
+   fatentry_t *blocks = malloc ( count * sizeof(fatentry_t) );
+   if ( blocks == NULL ) return 0;
+   int n = 0;
+   while ( n < count && block_address > 0 )
+   {
+      blocks[n++] = block_address;
+      block_address = chain_next ( block_address );
+   }
+   if ( n == 0 )
+   {
+      free ( blocks );
+      return 0;
+   }
+   if ( cacheCapacity > 0 ) cache_prefetch ( blocks, n );
+   else
+   {
+      int i = 0;
+      while ( i < n )
+      {
+         int run = 1;
+         while ( i + run < n && blocks[i + run] == blocks[i] + run ) run++;
+         prefetch_range ( blocks[i], run );
+         i += run;
+      }
+   }
+   fatentry_t last = blocks[n - 1];
+   free ( blocks );
+   return last;
 }
 
 // Empties and initialises a block for neatness. (No junk memory data).
@@ -84,65 +1298,95 @@ void init_block(diskblock_t *block, int type)
   if(type == TYPE_DATA) for(int i=0; i<BLOCKSIZE; i++) block->data[i] = '\0';
 
   if(type == TYPE_DIR) {
-   direntry_t *entry = malloc(sizeof(direntry_t));
    for(int i=0; i<BLOCKSIZE; i++) block->data[i] = '\0';
    block->dir.isDir = TRUE;
    block->dir.nextEntry = 0;
-   for(int i=0; i<DIRENTRYCOUNT; i++) {
-     entry->isdir = FALSE;
-     entry->unused = TRUE;
-     //strcpy(entry->name, "[empty]");
-     block->dir.entrylist[i] = *entry;
-   }
-   //free(entry);
+   block->dir.entryStart = BLOCKSIZE; // no entries yet.
   }
 }
 
 // Print contents of block at given index (and of given type) -> depending on type, it prints them differently.
 void printBlock ( int blockIndex, int type )
 {
+   const diskblock_t *block = pinblock(blockIndex);
    if(type == TYPE_DATA) {
     printf("virtualDisk[%d] = \n", blockIndex);
     for(int i=0; i< BLOCKSIZE; i++) {
-      printf("%c", virtualDisk[blockIndex].data[i]);
+      printf("%c", block->data[i]);
     }
     printf("\n");
    }
    else if(type == TYPE_FAT)
    {
       printf("virtualdisk[%d] = ", blockIndex);
-      for(int i=0; i<FATENTRYCOUNT; i++) printf("%d", virtualDisk[blockIndex].fat[i]);
+      for(int i=0; i<FATENTRYCOUNT; i++) printf("%d", block->fat[i]);
      printf("\n");
    }
    else if(type == TYPE_DIR) {
-      printf("virtualdisk[%d] = directory block (isDir: %d, nextEntry: %d) => [", blockIndex, virtualDisk[blockIndex].dir.isDir, virtualDisk[blockIndex].dir.nextEntry);
-      for(int i=0; i < DIRENTRYCOUNT; i++) {
-        printf(" %s ", virtualDisk[blockIndex].dir.entrylist[i].name);
+      printf("virtualdisk[%d] = directory block (isDir: %d, nextEntry: %d) => [", blockIndex, block->dir.isDir, block->dir.nextEntry);
+      for(int i=0; i < block->dir.nextEntry; i++) {
+        const direntry_t *entry = dir_entry(&block->dir, i);
+        if(entry) printf(" %s ", entry->name);
       }
       printf("]\n");
    }
+   unpinblock(blockIndex);
 }
 
-// Main function for formatting the disk initially. 
-// Initialises FAT, names the drive at position 0, and initialises root directory, then sets the rootDirIndex.
+// Format the disk with the default geometry.
 void format()
 {
-  int fatblocksneeded =  (MAXBLOCKS / FATENTRYCOUNT);
-  int root_dir_index = fatblocksneeded + 1;
+  format_disk(DEFAULTBLOCKS, DEFAULTBLOCKSIZE);
+}
+
+// Main function for formatting the disk initially, with blockcount blocks of blocksize bytes.
+// Writes the superblock (geometry and drive name) to block 0, initialises the FAT and root directory,
+// then sets the rootDirIndex. Returns 0 on success, -1 if the geometry is not supported.
+int format_disk(fatentry_t blockcount, int blocksize)
+{
+  if(blocksize < MINBLOCKSIZE || blocksize > MAXBLOCKSIZE || (blocksize & (blocksize - 1))) {
+    printf("(format_disk) block size must be a power of two from %d to %d.\n", MINBLOCKSIZE, MAXBLOCKSIZE);
+    return -1;
+  }
 
-  // Give the drive a name, and store this at block 0 (reserved).
+  // The FAT needs one entry per block, so work out how many blocks it takes up.
+  int fatentries = blocksize / sizeof(fatentry_t);
+  fatentry_t fatblocksneeded = (blockcount + fatentries - 1) / fatentries;
+  fatentry_t root_dir_index = fatblocksneeded + 1;
+  if(blockcount <= root_dir_index + 1) {
+    printf("(format_disk) %d blocks is too small for a disk.\n", (int) blockcount);
+    return -1;
+  }
+
+  superblock_t super;
+  memset(&super, 0, sizeof(super));
+  super.magic = FSMAGIC;
+  super.version = FSVERSION;
+  super.blocksize = blocksize;
+  super.blockcount = blockcount;
+  super.fatstart = 1;
+  super.fatblocks = fatblocksneeded;
+  super.rootdir = root_dir_index;
+  if(set_geometry(&super) < 0) return -1;
+
+  // Give the drive a name, and store this at block 0 (reserved) along with the geometry.
   diskblock_t block;
   init_block(&block, TYPE_DATA);
-  memcpy(block.data, "Dylans_Drive", sizeof("Dylans_Drive"));
+  memcpy(super.name, "Dylans_Drive", sizeof("Dylans_Drive"));
+  superBlock = super;
+  block.super = super;
   writeblock(&block, 0, 0);
 
 	// prepare FAT table.
 	// write FAT blocks to virtual disk.
-  for(int i=0; i<MAXBLOCKS; i++) FAT[i] = UNUSED;
+  for(fatentry_t i=0; i<MAXBLOCKS; i++) FAT[i] = UNUSED;
   FAT[0] = ENDOFCHAIN;
-  FAT[1] = 2;
-  FAT[2] = ENDOFCHAIN;
-  FAT[3] = ENDOFCHAIN; // The root directory.
+  for(fatentry_t i=1; i<fatblocksneeded; i++) FAT[i] = i + 1;
+  FAT[fatblocksneeded] = ENDOFCHAIN;
+  FAT[root_dir_index] = ENDOFCHAIN; // The root directory.
+  build_freemap();
+  load_holes();
+  build_refcounts();
   copyFAT(FAT);
 
 	// prepare root directory.
@@ -153,19 +1397,12 @@ void format()
   rootblock.dir.isDir = TRUE;
   rootblock.dir.nextEntry = 0;
   rootDirIndex = root_dir_index; // Set the rootDirIndex global.
-
-  // Initialise the root's entrylist.
-  for(int i=0; i<3; i++) {
-    direntry_t entry;
-    entry.isdir = FALSE;
-    entry.unused = TRUE;
-    //strcpy(entry.name, "[empty]");
-    rootblock.dir.entrylist[i] = entry;
-  }
   writeblock(&rootblock, root_dir_index, TYPE_DIR); // account for space taken by FAT.
 
   // Update current directory.
   currentDirIndex = rootDirIndex;
+  dcache_clear();
+  return 0;
 }
 
 
@@ -178,75 +1415,36 @@ void format()
 // Opens and creates files given a path and mode.
 // Returns a 'MyFILE' file descriptor pointer.
 MyFILE * myfopen(const char *path, const char *mode)
-{
-  if(strlen(path) > MAXPATHLENGTH) {
-    printf("(myfopen) Pathname was too large (must be shorter than %d). Aborting.\n", MAXPATHLENGTH);
-    return NULL;
-  }
-
-  // Copy const path into temporary variables to avoid segfaults.
-  char *temp_p = malloc(sizeof(char) * MAXPATHLENGTH);
-  char *temp_x = malloc(sizeof(char) * MAXPATHLENGTH);
-  strcpy(temp_x, ""); // avoid garbage memory content.
-  strcpy(temp_p, path);
-
-  // Break down the path into a set of directories.
-  char *filename = malloc(sizeof(char) * MAXNAME);
-  strcpy(filename, ""); // avoid garbage memory content.
-  char *dir_name = malloc(sizeof(char) * MAXNAME);
-  char **directories = parse_path(temp_p);
-  fatentry_t prev_dir_index = currentDirIndex;
-
-  // Split filename and path into separate strings.
-  int i = 0;
-  int num_dirs = get_path_dir_no(directories);
-  if(num_dirs == 1) {
-    strcpy(temp_x, "/");
-    strcpy(filename, directories[0]);
-  }
-  else {
-    while(1) {
-      if(strcmp(directories[i], "") == 0) break;
-      strcpy(filename, directories[i]);
-      if(i < num_dirs) {
-        strcat(temp_x, "/");
-        strcat(temp_x, directories[i]);
-      }
-      i++;
-    }
-  }
-
-  // Call mymkdir to deal with the path (create any unexisting directories etc.).
-  if(strcmp(temp_x, "/") == 0) {
-    // if path is just "/", no need to do anything.
+{
+  if(strlen(path) > MAXPATHLENGTH) {
+    printf("(myfopen) Pathname was too large (must be shorter than %d). Aborting.\n", MAXPATHLENGTH);
+    return NULL;
   }
-  else {
-    mymkdir(temp_x); // Otherwise call mymkdir to make sure the directories are created.
-  
-    // Get the last directory from the path and CD into it.
-    i = 0;
-    while(1) {
-      if(strcmp(directories[i], "") == 0) break;
-      strcpy(filename, directories[i]);
-      if(i>0) strcpy(dir_name, directories[i-1]);
-      i++;
-    }
-    change_dir(dir_index(dir_name)); // CD into the last directory before creating/opening the file.
+  if(freeFileCount == 0) {
+    printf("(myfopen) too many open files (at most %d). Aborting.\n", MAXOPENFILES);
+    return NULL;
   }
 
+  // Find the directory the file is in (creating any missing on the way, unless reading), and CD into it.
+  char filename[MAXNAME];
+  fatentry_t prev_dir_index = currentDirIndex;
+  fatentry_t dir = resolve_path(path, filename, *mode != 'r');
+  if(dir < 0 || filename[0] == '\0') return NULL;
+  change_dir(dir);
+
   // READ MODE.
   if(*mode == 'r') { // Open a file for reading. The file must exist.
-    MyFILE *file = malloc(sizeof(MyFILE));
-
     // Find existing file.
-    if(file_index(filename) >= 0) // file_index searches the current directory and returns -1 if file not found.
+    int first = file_index(filename); // file_index searches the current directory and returns -1 if file not found.
+    if(first >= 0)
     {
-      diskblock_t block = virtualDisk[file_index(filename)];
+      MyFILE *file = file_alloc();
       file->pos = 0;
       memcpy(file->mode, "r", sizeof("r"));
       file->writing = 0;
-      file->blockno = file_index(filename);
-      file->buffer = block;
+      file->blockno = first;
+      file->first_block = first;
+      open_entry(file, filename);
 
       //free(directories);
       //free(dir_name);
@@ -266,17 +1464,26 @@ MyFILE * myfopen(const char *path, const char *mode)
 
   // WRITE MODE.
   else if(*mode == 'w') { // Create an empty file for writing. If a file with the same name already exists its content is erased and the file is considered as a new empty file.
-    MyFILE *file = malloc(sizeof(MyFILE));
-
     // Find existing file.
-    if(file_index(filename) >= 0)
+    int first = file_index(filename);
+    if(first >= 0)
     {
-      diskblock_t block = virtualDisk[file_index(filename)];
+      MyFILE *file = file_alloc();
       file->pos = 0;
       memcpy(file->mode, "w", sizeof("w"));
       file->writing = 1;
-      file->blockno = file_index(filename);
-      file->buffer = block;
+      myfsetbuf(file, FILEBUFSIZE);
+      file->blockno = first;
+      file->first_block = first;
+      open_entry(file, filename);
+      if(file_flush_others(file)) load_entry(file);
+
+      // Erase the old content. The chain of an empty file is kept for the new content to be written
+      // over (so space set aside with myfallocate is used), and whatever is left over is freed by myfclose;
+      // past the end of a file its blocks hold only zeros. Any other file's chain goes, with its data.
+      if(file->length > 0 || file->inlined) inline_reset(file);
+      file->changed = TRUE;
+      file_entry_reload(file);
 
       //free(directories);
       //free(dir_name);
@@ -286,33 +1493,30 @@ MyFILE * myfopen(const char *path, const char *mode)
     }
     else
     {
-      // New file.
-      diskblock_t block;
-      init_block(&block, TYPE_DATA);
-    
-      // Initialise the file.
-      MyFILE *file = malloc(sizeof(MyFILE));
+      // Initialise the file, empty and kept in its directory entry.
+      MyFILE *file = file_alloc();
       file->pos = 0;
       memcpy(file->mode, "w", sizeof("w"));
       file->writing = 1;
-      file->blockno = next_free_fat();
-      file->first_block = file->blockno;
-      file->buffer = block;
-      writeblock(&file->buffer, file->blockno, 0);
-
-      // Update blockchain on FAT.
-      FAT[file->blockno] = ENDOFCHAIN;
-      copyFAT(FAT);
+      myfsetbuf(file, FILEBUFSIZE);
+      file->blockno = 0; // (no blocks until it outgrows its directory entry.)
+      file->first_block = 0;
+      file->inlined = TRUE;
+      file->inlinecap = INLINEMAX;
 
       // Update directory.
-      direntry_t *newEntry = malloc(sizeof(direntry_t));
-      newEntry->entrylength = MAXNAME;
+      direntry_t *newEntry = calloc(1, DIRENTRYMAX);
       newEntry->isdir = FALSE;
-      newEntry->unused = FALSE;
-      newEntry->filelength = file_block_length(filename);
-      newEntry->firstblock = file->first_block;
+      newEntry->inlined = TRUE;
+      newEntry->modtime = time(NULL);
+      newEntry->filelength = 0;
+      newEntry->firstblock = 0;
+      newEntry->lastblock = 0;
+      newEntry->allocblocks = 0;
       strcpy(newEntry->name, filename);
       add_file(currentDirIndex, newEntry, TYPE_DATA);
+      free(newEntry);
+      open_entry(file, filename);
 
       //free(directories);
       //free(dir_name);
@@ -324,29 +1528,21 @@ MyFILE * myfopen(const char *path, const char *mode)
 
   // APPEND MODE.
   else if(*mode == 'a') { // Append to a file. Writing operations append data at the end of the file. The file is created if it does not exist.
-    MyFILE *file = malloc(sizeof(MyFILE));
-
     // Find existing file.
-    if(file_index(filename) >= 0)
+    int first = file_index(filename);
+    if(first >= 0)
     {
-      diskblock_t block = virtualDisk[file_index(filename)];
-      file->blockno = file_index(filename);
+      MyFILE *file = file_alloc();
+      file->blockno = first;
+      file->first_block = first;
       file->pos = 0;
       memcpy(file->mode, "a", sizeof("a"));
       file->writing = 1;
+      myfsetbuf(file, FILEBUFSIZE);
 
-      // Get last block of file, and set pos to end of that block.
-      // This is to start appending from the end of the file.
-      while(1) {
-        if(FAT[file->blockno] == ENDOFCHAIN) break;
-        file->blockno = FAT[file->blockno];
-      }
-      block = virtualDisk[file->blockno];
-      file->buffer = block;
-      for(int i=0; i<BLOCKSIZE; i++){
-        if(block.data[file->pos] == '\0') break;
-        else file->pos++;
-      }
+      // Start appending from the end of the file, which the directory entry records.
+      open_entry(file, filename);
+      myfseek(file, 0, SEEK_END);
 
       //free(directories);
       //free(dir_name);
@@ -357,33 +1553,30 @@ MyFILE * myfopen(const char *path, const char *mode)
     else
     {
 
-      // New file.
-      diskblock_t block;
-      init_block(&block, TYPE_DATA);
-    
-      // Initialise the file.
-      MyFILE *file = malloc(sizeof(MyFILE));
+      // Initialise the file, empty and kept in its directory entry.
+      MyFILE *file = file_alloc();
       file->pos = 0;
       memcpy(file->mode, "a", sizeof("a"));
       file->writing = TRUE;
-      file->blockno = next_free_fat();
-      file->first_block = file->blockno;
-      file->buffer = block;
-      writeblock(&file->buffer, file->blockno, 0);
-
-      // Update blockchain on FAT.
-      FAT[file->blockno] = ENDOFCHAIN;
-      copyFAT(FAT);
+      myfsetbuf(file, FILEBUFSIZE);
+      file->blockno = 0; // (no blocks until it outgrows its directory entry.)
+      file->first_block = 0;
+      file->inlined = TRUE;
+      file->inlinecap = INLINEMAX;
 
       // Update directory.
-      direntry_t *newEntry = malloc(sizeof(direntry_t));
-      newEntry->entrylength = MAXNAME;
+      direntry_t *newEntry = calloc(1, DIRENTRYMAX);
       newEntry->isdir = FALSE;
-      newEntry->unused = FALSE;
-      newEntry->filelength = file_block_length(filename);
-      newEntry->firstblock = file->first_block;
+      newEntry->inlined = TRUE;
+      newEntry->modtime = time(NULL);
+      newEntry->filelength = 0;
+      newEntry->firstblock = 0;
+      newEntry->lastblock = 0;
+      newEntry->allocblocks = 0;
       strcpy(newEntry->name, filename);
       add_file(currentDirIndex, newEntry, TYPE_DATA);
+      free(newEntry);
+      open_entry(file, filename);
 
       //free(directories);
       //free(dir_name);
@@ -393,211 +1586,1259 @@ MyFILE * myfopen(const char *path, const char *mode)
     }
   }
 
-  else { // Mode didn't match "a", "w", or "r".
-      
-      //free(directories);
-      //free(dir_name);
-      //free(temp_p);
-    change_dir(prev_dir_index);
-    return NULL;
+  else { // Mode didn't match "a", "w", or "r".
+      
+      //free(directories);
+      //free(dir_name);
+      //free(temp_p);
+    change_dir(prev_dir_index);
+    return NULL;
+  }
+}
+
+// Move a file on to the start of the next block in its chain, once it has reached the end of the current one.
+// The next block may be in a hole, where blockno is 0 until the block is written (fill_hole).
+// When writing (extend), the chain is extended with a fresh, empty block if it has run out; a reader
+// that runs off the end of the chain is in a hole that lasts to the end of the file.
+// Returns 0, or -1 if the disk is full when writing.
+int file_next_block(MyFILE *file, int extend)
+{
+  if(file->blockno == 0) { // In a hole: carry on through it, or out into the block after it.
+    file->blockindex++;
+    file->pos = 0;
+    if(file->blockindex == file->holeend) {
+      file->blockno = file->holenext;
+      if(!extend) readahead(file);
+    }
+    return 0;
+  }
+  fatentry_t after = FAT[file->blockno];
+  if(ISHOLE(after) || (!extend && (after == ENDOFCHAIN || after == UNUSED))) {
+    hole_enter(file, file->blockno, file->blockindex);
+    file->blockindex++;
+    file->pos = 0;
+    return 0;
+  }
+  if(after == ENDOFCHAIN || after == UNUSED) {
+    int next = extend_file(file);
+    if(next < 0) return -1;
+    updateFAT();
+    diskblock_t *block = pinblock_rw(next);
+    if(block == NULL) return -1;
+    init_block(block, TYPE_DATA);
+    unpinblock_rw(next);
+    file->blockno = next;
+  }
+  else { // There is still another block in the chain, so move to that one.
+    file->blockno = after;
+  }
+  file->blockindex++;
+  file->pos = 0;
+  if(!extend) readahead(file);
+  return 0;
+}
+
+// Adaptive readahead, called each time a reader moves on to the next block of its chain.
+// After READAHEADSTART blocks in a row, the next READAHEADMIN blocks of the chain are prefetched;
+// each further window is twice the last (up to READAHEADMAX, and a quarter of the cache, so windows
+// still being read are not evicted to make room for the next), and is opened once
+// the reader is halfway through the one before. A seek ends the streak (readahead_cancel).
+// There is nothing to read ahead from on an in-memory disk.
+void readahead(MyFILE *file)
+{
+  if(cacheCapacity == 0 && mountedFd < 0) return;
+  if(file->blockindex < file->ra_end) diskStats.rahits++; // this block was read ahead.
+  if(++file->ra_streak < READAHEADSTART) return;
+  if(file->ra_end - file->blockindex > file->ra_window / 2) return; // still well inside the last window.
+
+  fatentry_t from;
+  long fromindex;
+  if(file->ra_end > file->blockindex) { // carry on from the end of the last window.
+    from = FAT[file->ra_block];
+    fromindex = file->ra_end;
+  }
+  else {
+    from = FAT[file->blockno];
+    fromindex = file->blockindex + 1;
+  }
+  if(from <= 0) return; // the end of the chain, or a hole (there is nothing in one to read ahead).
+
+  int limit = (cacheCapacity > 0 && cacheCapacity / 4 < READAHEADMAX) ? cacheCapacity / 4 : READAHEADMAX;
+  if(file->ra_window == 0) file->ra_window = READAHEADMIN;
+  else if(file->ra_window < limit) file->ra_window *= 2;
+  if(file->ra_window > limit) file->ra_window = limit;
+
+  // Count the blocks as they are found, so the window ends where the chain (or a run without holes) does.
+  int n = 0;
+  fatentry_t last = from;
+  for(fatentry_t cur = from; n < file->ra_window && cur > 0; cur = FAT[cur]) {
+    last = cur;
+    n++;
+  }
+  prefetch_chain(from, n);
+  file->ra_block = last;
+  file->ra_end = fromindex + n;
+}
+
+// Stop reading ahead for a file (on seek or close); blocks read ahead but never reached are counted as wasted.
+void readahead_cancel(MyFILE *file)
+{
+  if(file->ra_end > file->blockindex + 1) diskStats.rawasted += file->ra_end - file->blockindex - 1;
+  file->ra_end = 0;
+  file->ra_streak = 0;
+  file->ra_window = 0;
+}
+
+// Reads character from file at it's current pos pointer.
+// Returns it as an unsigned char, or EOF at the end of the file, so any byte can be read back.
+int myfgetc(MyFILE *file)
+{
+  if(file->buflen > 0) myfflush(file); // so the read sees what has been written.
+  if(myftell(file) >= file->length) return EOF;
+  if(file->inlined) return file->inlinedata[file->pos++]; // (an inline file fits well inside a block.)
+  if(file->pos >= BLOCKSIZE) { // If the position reaches end of block, move to the next one.
+    if(file_next_block(file, FALSE) < 0) return EOF;
+  }
+  if(file->blockno == 0) { // A hole reads as zeros.
+    file->pos++;
+    return 0;
+  }
+
+  // Read the character straight out of the block.
+  const diskblock_t *block = pinblock(file->blockno);
+  if(block == NULL) return EOF;
+  int c = block->data[file->pos++];
+  unpinblock(file->blockno);
+  return c;
+}
+
+// Writes character to file at it's current pos pointer.
+// It is staged in the file's write buffer, which goes to the disk when it fills (or on seek, close or myfflush).
+int myfputc(MyFILE *file, const char ch)
+{
+  if(file == NULL) return 1; // (myfopen() failed.)
+  if(strcmp(file->mode, "r") == 0) {
+    printf("(myfputc) write rejected: file was in read mode.\n");
+    return 1;
+  }
+  if(file->bufsize == 0) { // Unbuffered: straight into the block.
+    if(file_write(file, (const Byte *) &ch, 1) < 1) {
+      printf("(myfputc) write rejected: disk is full.\n");
+      return 1;
+    }
+    return 0;
+  }
+  if(file->buflen == file->bufsize && myfflush(file) != 0) {
+    printf("(myfputc) write rejected: disk is full.\n");
+    return 1;
+  }
+  file->buffer[file->buflen++] = ch;
+  return 0;
+}
+
+// Reads up to n items of size bytes from a file into buf, like fread.
+// Data is copied straight out of each block, a block (or what is left of one) at a time.
+// Returns the number of whole items read; fewer than n means the end of the file was reached.
+// (Only the file's recorded length is read, never whatever follows it in the last block.)
+// Holes read as zeros without going to the disk.
+size_t myfread(void *buf, size_t size, size_t n, MyFILE *file)
+{
+  if(size == 0 || n == 0) return 0;
+  if(file->buflen > 0) myfflush(file);
+  Byte *dest = buf;
+  size_t want = size * n;
+  size_t done = 0;
+  long left = file->length - myftell(file);
+  if(left <= 0) return 0;
+  if(want > (size_t) left) want = left;
+  while(done < want) {
+    if(file->pos >= BLOCKSIZE && file_next_block(file, FALSE) < 0) break;
+
+    size_t chunk = BLOCKSIZE - file->pos;
+    if(chunk > want - done) chunk = want - done;
+    if(file->inlined) memcpy(dest + done, file->inlinedata + file->pos, chunk);
+    else if(file->blockno == 0) memset(dest + done, 0, chunk);
+    else {
+      const diskblock_t *block = pinblock(file->blockno);
+      if(block == NULL) break;
+      memcpy(dest + done, block->data + file->pos, chunk);
+      unpinblock(file->blockno);
+    }
+    file->pos += chunk;
+    done += chunk;
+  }
+  return done / size;
+}
+
+// Writes n items of size bytes from buf to a file, like fwrite, extending the file as needed.
+// Small writes are gathered in the file's write buffer; a write at least as big as the buffer
+// goes straight to the blocks. Returns the number of whole items written; fewer than n means the disk is full.
+size_t myfwrite(const void *buf, size_t size, size_t n, MyFILE *file)
+{
+  if(file == NULL) return 0; // (myfopen() failed.)
+  if(strcmp(file->mode, "r") == 0) {
+    printf("(myfwrite) write rejected: file was in read mode.\n");
+    return 0;
+  }
+  if(size == 0 || n == 0) return 0;
+  const Byte *src = buf;
+  size_t want = size * n;
+  size_t done = 0;
+
+  if(want < (size_t) file->bufsize) {
+    while(done < want) {
+      if(file->buflen == file->bufsize && myfflush(file) != 0) break;
+      size_t chunk = file->bufsize - file->buflen;
+      if(chunk > want - done) chunk = want - done;
+      memcpy(file->buffer + file->buflen, src + done, chunk);
+      file->buflen += chunk;
+      done += chunk;
+    }
+  }
+  else if(myfflush(file) == 0) done = file_write(file, src, want);
+
+  if(done < want) printf("(myfwrite) write rejected: disk is full.\n");
+  return done / size;
+}
+
+// Copy len bytes into the file's blocks at its position, block by block, extending the chain as needed.
+// Returns the number of bytes written (fewer than len if the disk is full, or a cached disk has no
+// frame to spare).
+size_t file_write(MyFILE *file, const Byte *src, size_t len)
+{
+  size_t done = 0;
+  long start = file->blockindex * BLOCKSIZE + file->pos;
+  if(file->inlined && start + (long) len <= file->inlinecap) { // Still small enough to stay in the directory entry.
+    memcpy(file->inlinedata + start, src, len);
+    file->pos += len;
+    done = len;
+  }
+  else if(file->inlined && inline_promote(file) < 0) return 0;
+  while(done < len) {
+    if(file->pos >= BLOCKSIZE && file_next_block(file, TRUE) < 0) break;
+    if(file->blockno == 0 && fill_hole(file) < 0) break; // the first write to a block in a hole gives it one.
+    if(FAT[file->blockno] == UNUSED) { // Claim the block back if it was freed.
+      init_block(pinblock_rw(file->blockno), TYPE_DATA);
+      unpinblock_rw(file->blockno);
+      take_block(file->blockno);
+      updateFAT();
+    }
+
+    if(block_shared(file->blockno) && cow_chain(file, chain_find(file, file->blockindex)) < 0) break; // copy on write.
+
+    size_t chunk = BLOCKSIZE - file->pos;
+    if(chunk > len - done) chunk = len - done;
+    diskblock_t *block = pinblock_rw(file->blockno);
+    if(block == NULL) break;
+    memcpy(block->data + file->pos, src + done, chunk);
+    unpinblock_rw(file->blockno);
+    file->pos += chunk;
+    done += chunk;
+  }
+  long end = file->blockindex * BLOCKSIZE + file->pos;
+  if(end > file->length) {
+    file->length = end;
+    file->lastblock = file->blockno;
+  }
+  file->changed = TRUE;
+  return done;
+}
+
+// Write out whatever is staged in the file's write buffer, and record the file's new length in its directory entry.
+// Returns 0, or EOF if the disk filled up (what did not fit is dropped).
+int myfflush(MyFILE *file)
+{
+  int ok = TRUE;
+  if(file->buflen > 0) {
+    size_t done = file_write(file, file->buffer, file->buflen);
+    ok = (done == (size_t) file->buflen);
+    file->buflen = 0;
+  }
+  if(file->changed) update_entry(file);
+  return ok ? 0 : EOF;
+}
+
+// Give a file a write buffer of size bytes (0 for none), flushing the old one first.
+// Files start with FILEBUFSIZE bytes; the size need not be a multiple of BLOCKSIZE.
+int myfsetbuf(MyFILE *file, int size)
+{
+  if(size < 0) return -1;
+  int ret = myfflush(file);
+  if(size > file->bufcap) { // the slot keeps its buffer between files, so this is rarely needed.
+    free(file->buffer);
+    file->buffer = malloc(size);
+    file->bufcap = size;
+  }
+  file->bufsize = size;
+  return ret;
+}
+
+// Make sure a file's chain index reaches at least its block count - 1 (or the end of the chain, if it
+// stops short). The index is built lazily, extended as the chain grows, and rebuilt if blocks have been
+// freed (or holes filled) since. Returns the number of blocks indexed.
+long chain_index(MyFILE *file, long count)
+{
+  if(file->chain == NULL || file->chaingen != chainGeneration) {
+    file->chainlen = 0;
+    file->chaingen = chainGeneration;
+  }
+  while(file->chainlen == 0 || file->chainpos[file->chainlen - 1] < count - 1) {
+    fatentry_t next;
+    long pos = 0;
+    if(file->chainlen > 0) {
+      fatentry_t prev = file->chain[file->chainlen - 1];
+      next = FAT[prev];
+      if(next == ENDOFCHAIN || next == UNUSED) break;
+      pos = file->chainpos[file->chainlen - 1] + 1;
+      if(ISHOLE(next)) pos += holeTable[HOLESLOT(next)].skip;
+      next = chain_next(prev);
+    }
+    else next = file->first_block;
+    if(file->chainlen == file->chaincap) {
+      file->chaincap = file->chaincap ? file->chaincap * 2 : 64;
+      file->chain = realloc(file->chain, file->chaincap * sizeof(fatentry_t));
+      file->chainpos = realloc(file->chainpos, file->chaincap * sizeof(long));
+    }
+    file->chain[file->chainlen] = next;
+    file->chainpos[file->chainlen++] = pos;
+  }
+  return file->chainlen;
+}
+
+// Find the block at index in a file, or the last one before it if index is in a hole (or past the chain).
+// Returns its place in the chain index.
+long chain_find(MyFILE *file, long index)
+{
+  long n = chain_index(file, index + 1);
+  long k = (index < n) ? index : n - 1;
+  if(file->chainpos[k] <= index) return k; // no holes before it.
+  long lo = 0, hi = k; // chainpos[lo] <= index < chainpos[hi]
+  while(hi - lo > 1) {
+    long mid = (lo + hi) / 2;
+    if(file->chainpos[mid] <= index) lo = mid;
+    else hi = mid;
+  }
+  return lo;
+}
+
+// Put a file's position at the start of the hole after prev (the file's block previndex).
+void hole_enter(MyFILE *file, fatentry_t prev, long previndex)
+{
+  fatentry_t after = FAT[prev];
+  file->holeprev = prev;
+  file->holestart = previndex + 1;
+  if(ISHOLE(after)) {
+    file->holeend = file->holestart + holeTable[HOLESLOT(after)].skip;
+    file->holenext = holeTable[HOLESLOT(after)].next;
+  }
+  else { // Past the end of the chain.
+    file->holeend = LONG_MAX;
+    file->holenext = 0;
+  }
+  file->blockno = 0;
+}
+
+// Give the block at a file's position, which is in a hole, a block of its own. The hole is split
+// around it; whatever is left either side stays a hole. Returns 0, or -1 if the disk is full.
+int fill_hole(MyFILE *file)
+{
+  if(block_shared(file->holeprev) && cow_chain(file, chain_find(file, file->holestart - 1)) < 0) return -1; // its FAT entry is about to change.
+  fatentry_t prev = file->holeprev;
+  long before = file->blockindex - file->holestart; // blocks of the hole left before the new one,
+  long after = file->holeend - file->blockindex - 1; // ... and after it.
+  long near = prev + before + 1; // (where it would be if the file had been written in order)
+  int got;
+  fatentry_t block = reserve_extent(near < MAXBLOCKS ? near : prev + 1, 1, &got);
+  if(block < 0) return -1;
+  init_block(pinblock_rw(block), TYPE_DATA);
+  unpinblock_rw(block);
+
+  fatentry_t hole = FAT[prev];
+  fatentry_t tail = ENDOFCHAIN;
+  if(ISHOLE(hole)) {
+    tail = holeTable[HOLESLOT(hole)].next;
+    hole_free(hole);
+  }
+  if(tail == ENDOFCHAIN) setFAT(block, ENDOFCHAIN);
+  else setFAT(block, (after > 0) ? hole_new(after, tail) : tail);
+  setFAT(prev, (before > 0) ? hole_new(before, block) : block);
+  updateFAT();
+
+  chainGeneration++; // chain indexes have a block to fit in.
+  if(tail == ENDOFCHAIN) file->lastblock = block;
+  file->allocblocks++;
+  file->blockno = block;
+  return 0;
+}
+
+// Move a file's position to offset bytes from the start (SEEK_SET), the current position (SEEK_CUR),
+// or the end of the file (SEEK_END), as fseek does. The block is found in the chain index,
+// not by walking the chain. The position may be past the end of the file: writing there leaves a
+// hole, which takes no blocks and reads as zeros.
+// Returns 0, or -1 if the position is invalid.
+int myfseek(MyFILE *file, long offset, int whence)
+{
+  if(myfflush(file) != 0) return -1;
+  readahead_cancel(file);
+  long base = 0;
+  if(whence == SEEK_CUR) base = myftell(file);
+  else if(whence == SEEK_END) base = file->length;
+  else if(whence != SEEK_SET) return -1;
+  long target = base + offset;
+  if(target < 0) return -1;
+
+  long index = target / BLOCKSIZE;
+  int pos = target % BLOCKSIZE;
+  if(file->inlined) { // No blocks to find.
+    file->blockindex = index;
+    file->pos = pos;
+    return 0;
+  }
+  long blocks = (target + BLOCKSIZE - 1) / BLOCKSIZE;
+  if(target == file->length && file->lastblock > 0 && FAT[file->lastblock] == ENDOFCHAIN
+     && file->allocblocks == (blocks > 0 ? blocks : 1)) {
+    // The end of the file is in its last block (there are no holes), which the directory entry records:
+    // no chain walk needed.
+    file->blockno = file->lastblock;
+    file->blockindex = (target > 0) ? (target - 1) / BLOCKSIZE : 0;
+    file->pos = target - file->blockindex * BLOCKSIZE;
+    return 0;
+  }
+  long k = chain_find(file, index);
+  if(file->chainpos[k] == index) file->blockno = file->chain[k];
+  else if(pos == 0 && file->chainpos[k] == index - 1) { // The start of a hole: stay at the end of the block before it.
+    file->blockno = file->chain[k];
+    index--;
+    pos = BLOCKSIZE;
+  }
+  else hole_enter(file, file->chain[k], file->chainpos[k]);
+  file->blockindex = index;
+  file->pos = pos;
+  return 0;
+}
+
+// The current position in a file, in bytes from the start (counting anything still in the write buffer).
+long myftell(MyFILE *file)
+{
+  return file->blockindex * BLOCKSIZE + file->pos + file->buflen;
+}
+
+// Removes a file at the given path.
+// Doesn't clear the blocks, but frees them and deletes the file's directory entry so the space can be re-used by the filesystem.
+void myremove(const char *path)
+{
+  if(strlen(path) > MAXPATHLENGTH) {
+    printf("(myremove) Pathname was too large (must be shorter than %d). Aborting.\n", MAXPATHLENGTH);
+    return;
+  }
+
+  // Find the directory the file is in.
+  char filename[MAXNAME];
+  fatentry_t dir = resolve_path(path, filename, FALSE);
+  if(dir < 0 || filename[0] == '\0') {
+    printf("(myremove) no such file or directory %s\n", path);
+    return;
+  }
+
+  // Delete the file's entry.
+  delete_file(dir, filename);
+  char **directories = parse_path((char *) path);
+  int num_dirs = get_path_dir_no(directories);
+  if(num_dirs == 1) printf("(myremove) deleted file %s in root.\n", filename);
+  else printf("(myremove) deleted file %s in %s.\n", filename, directories[num_dirs-2]);
+}
+
+// Add a block to the end of a file's chain, taking it from the file's reservation.
+// When the reservation runs out another contiguous run is reserved, just after the
+// file's last block if possible, and each run is twice the last (up to MAXEXTENT blocks),
+// so a file being appended to sequentially is laid out in long runs.
+// Returns the new block, or -1 if the disk is full.
+int extend_file(MyFILE *file)
+{
+  if(file->resv_count == 0) {
+    if(file->resv_next < MINEXTENT) file->resv_next = MINEXTENT;
+    file->resv_start = reserve_extent(file->blockno + 1, file->resv_next, &file->resv_count);
+    if(file->resv_start < 0) {
+      file->resv_count = 0;
+      return -1;
+    }
+    if(file->resv_next < MAXEXTENT) file->resv_next *= 2;
+  }
+
+  if(block_shared(file->blockno) && cow_chain(file, chain_find(file, file->blockindex)) < 0) return -1; // its FAT entry is about to change.
+  fatentry_t next = file->resv_start++;
+  file->resv_count--;
+  setFAT(next, ENDOFCHAIN);
+  setFAT(file->blockno, next);
+  file->allocblocks++;
+  return next;
+}
+
+// Cut a file's chain down to the blocks needed for length bytes (always at least one), freeing the
+// rest in a single pass (blocks still shared with a clone just lose a reference), along with any hole
+// after the last block kept. The FAT is written once. Returns the new last block.
+fatentry_t trim_chain(MyFILE *file, long length)
+{
+  if(file->inlined) return 0; // (no chain.)
+  long keep = (length + BLOCKSIZE - 1) / BLOCKSIZE;
+  if(keep < 1) keep = 1;
+  long k = chain_find(file, keep - 1);
+  fatentry_t last = file->chain[k];
+  if(FAT[last] != ENDOFCHAIN && FAT[last] != UNUSED) {
+    if(block_shared(last)) last = cow_chain(file, k); // its FAT entry is about to change.
+    if(last < 0) return file->chain[k];
+    fatentry_t rest = chain_next(last);
+    if(ISHOLE(FAT[last])) hole_free(FAT[last]);
+    file->allocblocks -= free_chain(rest);
+    setFAT(last, ENDOFCHAIN);
+    updateFAT();
+  }
+  return last;
+}
+
+// Zero the rest of the block a file's end falls in (all of it, for an empty file that keeps a block),
+// so the bytes past the end read as zeros when a later write leaves a gap there. The block is only
+// written (and, if a clone shares it, copied) if it is not clear already. Returns 0, or -1 if the
+// disk is full.
+int clear_tail(MyFILE *file, long length)
+{
+  if(file->inlined) {
+    memset(file->inlinedata + length, 0, INLINEMAX - length);
+    return 0;
+  }
+  long k = (length > 0) ? (length - 1) / BLOCKSIZE : 0;
+  int from = length - k * BLOCKSIZE;
+  if(from >= BLOCKSIZE) return 0;
+  long c = chain_find(file, k);
+  if(file->chainpos[c] != k) return 0; // (a hole is zeros already.)
+  fatentry_t block = file->chain[c];
+  const Byte *data = pinblock(block)->data;
+  int clear = TRUE;
+  for(int i=from; i<BLOCKSIZE && clear; i++) clear = (data[i] == 0);
+  unpinblock(block);
+  if(clear) return 0;
+  if(block_shared(block) && (block = cow_chain(file, c)) < 0) return -1;
+  memset(pinblock_rw(block)->data + from, 0, BLOCKSIZE - from);
+  unpinblock_rw(block);
+  return 0;
+}
+
+// Add count empty blocks to the end of a chain, reserving them as contiguously as possible,
+// linking them in one pass and writing the FAT once. Returns the new last block, or -1 if the
+// disk is full (nothing is added then).
+fatentry_t grow_chain(fatentry_t last, long count)
+{
+  if(count <= 0) return last;
+  if(count > free_block_count()) return -1;
+  fatentry_t first_new = 0, prev = last;
+  while(count > 0) {
+    int got;
+    fatentry_t start = reserve_extent(prev + 1, count < MAXEXTENT ? count : MAXEXTENT, &got);
+    if(start < 0) { // (can only happen if the free count was wrong) undo what was added.
+      if(first_new > 0) free_chain(first_new);
+      setFAT(last, ENDOFCHAIN);
+      updateFAT();
+      return -1;
+    }
+    for(fatentry_t b=start; b<start+got; b++) {
+      init_block(pinblock_rw(b), TYPE_DATA);
+      unpinblock_rw(b);
+      setFAT(prev, b);
+      if(first_new == 0) first_new = b;
+      prev = b;
+    }
+    count -= got;
+  }
+  setFAT(prev, ENDOFCHAIN);
+  updateFAT();
+  return prev;
+}
+
+// Set the length of the file at path to len bytes, as truncate does. A shorter file loses the
+// blocks past its new end; a longer one just has a hole past the old end, which takes no blocks
+// and reads as zeros. Other handles open on the file have their buffers written out first, and
+// then take the new length, keeping their positions (see file_entry_reload). Returns 0, or -1 if
+// there is no such file or the disk is full.
+int myftruncate(const char *path, long len)
+{
+  if(len < 0) return -1;
+  MyFILE *file = myfopen(path, "r");
+  if(file == NULL || file->dir_slot < 0) {
+    if(file) myfclose(file);
+    printf("(myftruncate) no such file %s\n", path);
+    return -1;
+  }
+  if(file_flush_others(file)) load_entry(file);
+
+  // An inline file is moved out to a block if it will no longer fit in its directory entry.
+  if(file->inlined && len > file->inlinecap && inline_promote(file) < 0) {
+    printf("(myftruncate) disk is full, %s not extended.\n", path);
+    myfclose(file);
+    return -1;
+  }
+
+  // An emptied file gives up its whole chain. Otherwise the rest of the block the (old or new) end is in
+  // is cleared, so whatever is later added past the end reads as zeros.
+  long end = (len < file->length) ? len : file->length;
+  if(len == 0) inline_reset(file);
+  else if(clear_tail(file, end) < 0) {
+    myfclose(file);
+    return -1;
+  }
+  else file->lastblock = trim_chain(file, len);
+  file->length = len;
+  update_entry(file);
+  file_entry_reload(file);
+  myfclose(file);
+  return 0;
+}
+
+// Set aside enough blocks for the file at path to hold len bytes, creating the file if need be.
+// Holes within the first len bytes are filled, and the chain is then extended in one contiguous
+// reservation where the disk allows. Like fallocate with FALLOC_FL_KEEP_SIZE, the file's length does
+// not change: a writer that then opens it ("w" or "a") and writes up to len bytes just follows the
+// chain, with no allocation or FAT writes along the way. Returns 0, or -1 if the disk is full.
+int myfallocate(const char *path, long len)
+{
+  if(len < 0) return -1;
+  MyFILE *file = myfopen(path, "a");
+  if(file == NULL) return -1;
+  long blocks = (len + BLOCKSIZE - 1) / BLOCKSIZE;
+  if(file->inlined && len <= file->inlinecap) blocks = 0; // there is room in the directory entry already.
+  int deferred = fatDeferred;
+  int ret = 0;
+  fatDeferred = TRUE; // the FAT is written once, at the end.
+  if(blocks > 0 && file->inlined && inline_promote(file) < 0) blocks = 0, ret = -1;
+
+  // Walk the file's blocks up to the end of its chain, giving any in holes blocks of their own.
+  readahead_cancel(file);
+  file->blockno = file->first_block;
+  file->blockindex = 0;
+  while(ret == 0 && file->blockindex < blocks) {
+    if(file->blockno == 0 && fill_hole(file) < 0) ret = -1;
+    else if(FAT[file->blockno] == ENDOFCHAIN || file->blockindex + 1 == blocks) break;
+    else file_next_block(file, TRUE);
+  }
+
+  // Then add whatever more is needed past the end of the chain.
+  long more = blocks - file->blockindex - 1;
+  if(ret == 0 && more > 0) {
+    fatentry_t last = file->blockno;
+    if(block_shared(last)) last = cow_chain(file, chain_find(file, file->blockindex)); // its FAT entry is about to change.
+    if(last < 0 || grow_chain(last, more) < 0) ret = -1;
+    else file->allocblocks += more;
+  }
+  if(ret < 0) printf("(myfallocate) disk is full, %s not extended.\n", path);
+  file->changed = TRUE; // (for the new block count.)
+  fatDeferred = deferred;
+  updateFAT();
+  myfclose(file);
+  return ret;
+}
+
+// Find a file's directory entry (in the current directory), so the file's length can be read from it
+// and written back to it. Returns the entry's slot, or -1 if the file is not there.
+int file_entry(const char *filename, fatentry_t *dir_block, int *slot)
+{
+  *slot = dir_find(currentDirIndex, filename, dir_block);
+  return *slot;
+}
+
+// Tie an open file to its directory entry, taking its length, last block and block count from it.
+void open_entry(MyFILE *file, const char *filename)
+{
+  if(file_entry(filename, &file->dir_block, &file->dir_slot) < 0) return;
+  load_entry(file);
+}
+
+// Take an open file's length, chain, block count and (inline) data from its directory entry.
+void load_entry(MyFILE *file)
+{
+  const direntry_t *entry = dir_entry(&pinblock(file->dir_block)->dir, file->dir_slot);
+  file->first_block = entry->firstblock;
+  file->length = entry->filelength;
+  file->lastblock = entry->lastblock;
+  file->allocblocks = entry->allocblocks;
+  file->inlined = entry->inlined;
+  if(file->inlined) {
+    file->inlinecap = INLINEMAX;
+    memset(file->inlinedata, 0, INLINEMAX);
+    if(file->length > file->inlinecap) file->length = file->inlinecap; // (a damaged entry.)
+    memcpy(file->inlinedata, entry->name + strlen(entry->name) + 1, file->length);
+  }
+  unpinblock(file->dir_block);
+}
+
+// Record a file's length, last block, block count and modification time in its directory entry
+// (and an inline file's data).
+void update_entry(MyFILE *file)
+{
+  file->changed = FALSE;
+  if(file->dir_slot < 0) return;
+  diskblock_t *dir = pinblock_rw(file->dir_block);
+  direntry_t *entry = dir_entry(&dir->dir, file->dir_slot);
+  if(entry && entry->firstblock == file->first_block && entry->inlined == file->inlined) { // (unless the file has since been deleted.)
+    if(file->inlined && dir_resize(&dir->dir, file->dir_slot, file->length) < 0) {
+      // The directory block has no room for the data to grow into, so it goes out to a block of its own.
+      unpinblock_rw(file->dir_block);
+      if(inline_promote(file) == 0) update_entry(file);
+      return;
+    }
+    entry = dir_entry(&dir->dir, file->dir_slot); // (it may have moved.)
+    entry->filelength = file->length;
+    entry->lastblock = file->lastblock;
+    entry->allocblocks = file->allocblocks;
+    entry->modtime = time(NULL);
+    if(file->inlined) memcpy(entry->name + strlen(entry->name) + 1, file->inlinedata, file->length);
+  }
+  unpinblock_rw(file->dir_block);
+}
+
+// Close the file descriptor and return its slot to the open file table.
+// The write buffer and any deferred FAT changes are written out here.
+void myfclose(MyFILE *file)
+{
+  if(file == NULL) return; // (myfopen() failed.)
+  myfflush(file);
+  if(file->mode[0] == 'w' && file->dir_slot >= 0) { // Free any of the old chain not written over.
+    file->lastblock = trim_chain(file, file->length);
+    clear_tail(file, file->length);
+    update_entry(file);
+  }
+  readahead_cancel(file);
+  release_extent(file->resv_start, file->resv_count); // hand back the unused reservation.
+  syncFAT();
+  file_release(file);
+}
+
+// Open a file as with myfopen, but return its descriptor (its slot in the open file table), or -1.
+int myopen(const char *path, const char *mode)
+{
+  MyFILE *file = myfopen(path, mode);
+  return file ? file->fd : -1;
+}
+
+// Close a file by descriptor. Returns 0, or -1 if the descriptor is not open.
+int myclose(int fd)
+{
+  MyFILE *file = myfdfile(fd);
+  if(file == NULL) return -1;
+  myfclose(file);
+  return 0;
+}
+
+// The open file with a given descriptor (NULL if there is none).
+MyFILE *myfdfile(int fd)
+{
+  if(fd < 0 || fd >= MAXOPENFILES || !fileTable[fd].inuse) return NULL;
+  return &fileTable[fd];
+}
+
+// The descriptor of an open file.
+int myfileno(MyFILE *file)
+{
+  return file->fd;
+}
+
+// Given a directory's block, and a filename, deletes that file's entry (and frees its chain) so the filesystem can reclaim the space.
+void delete_file(fatentry_t dir_index, const char *filename)
+{
+  fatentry_t block;
+  int slot = dir_find(dir_index, filename, &block);
+  if(slot < 0) return;
+  free_chain(dir_entry(&pinblock(block)->dir, slot)->firstblock);
+  unpinblock(block);
+  updateFAT();
+  dir_release_entry(dir_index, block, slot);
+}
+
+// Get index of the first block belonging to a file. (within the current directory).
+int file_index(const char *filename)
+{
+  fatentry_t block;
+  int slot = dir_find(currentDirIndex, filename, &block);
+  if(slot < 0) return -1; // file not found.
+  int index = dir_entry(&pinblock(block)->dir, slot)->firstblock;
+  unpinblock(block);
+  return index;
+}
+
+// Print contents of all the blocks belonging to a file in order (following its FAT chain).
+void print_file(const char *filename)
+{
+  int cur = file_index(filename);
+  for(int i=0; cur > 0; i++) {
+    if(i % PREFETCHBLOCKS == 0) prefetch_chain(cur, PREFETCHBLOCKS); // load the next stretch of the chain in one batch.
+    printBlock(cur, TYPE_DATA);
+    cur = chain_next(cur); // (holes are not printed.)
+  }
+}
+
+// Return number of blocks allocated to a file.
+int file_block_length(const char *filename) {
+  int count = 1;
+  int cur = file_index(filename);
+  if(cur <= 0) return 0; // no such file (yet), or one kept in its directory entry.
+  while((cur = chain_next(cur)) > 0) count++;
+
+  return count;
+}
+
+
+/* --------  OPEN FILE TABLE FUNCTIONS ---------------
+
+  Open files live in a fixed table of MAXOPENFILES slots, and a file's descriptor is its slot.
+  Free slots are kept on a stack, so opening and closing never goes to the allocator; a slot
+  also keeps its write buffer and chain index array for the next file to use it.
+  ------------------------------------
+*/
+
+// Take a free slot for a newly opened file, cleared apart from the buffers it keeps.
+// Returns NULL if every slot is in use.
+MyFILE *file_alloc()
+{
+  if(freeFileCount == 0) return NULL;
+  if(freeFileCount < 0) { // First use: every slot is free.
+    for(int i=0; i<MAXOPENFILES; i++) freeFiles[i] = MAXOPENFILES - 1 - i;
+    freeFileCount = MAXOPENFILES;
+  }
+  int fd = freeFiles[--freeFileCount];
+  MyFILE *file = &fileTable[fd];
+  Byte *buffer = file->buffer;
+  int bufcap = file->bufcap;
+  fatentry_t *chain = file->chain;
+  long *chainpos = file->chainpos;
+  long chaincap = file->chaincap;
+  memset(file, 0, sizeof(MyFILE));
+  file->buffer = buffer;
+  file->bufcap = bufcap;
+  file->chain = chain;
+  file->chainpos = chainpos;
+  file->chaincap = chaincap;
+  file->chaingen = -1; // the kept chain index belongs to another file.
+  file->fd = fd;
+  file->inuse = TRUE;
+
+  diskStats.opens++;
+  if(++openFiles > diskStats.peakopen) diskStats.peakopen = openFiles;
+  return file;
+}
+
+// Give a closed file's slot back to the table.
+void file_release(MyFILE *file)
+{
+  if(!file->inuse) return;
+  file->inuse = FALSE;
+  freeFiles[freeFileCount++] = file->fd;
+  openFiles--;
+}
+
+// Number of files currently open.
+int open_file_count()
+{
+  return openFiles;
+}
+
+// Write out the buffers of the other handles open on the same directory entry as file, so the
+// entry is up to date before the file is cut short. Returns TRUE if any had data to write.
+int file_flush_others(MyFILE *file)
+{
+  int flushed = FALSE;
+  if(file->dir_slot < 0) return flushed;
+  for(int fd=0; fd<MAXOPENFILES; fd++) {
+    MyFILE *other = &fileTable[fd];
+    if(!other->inuse || other == file || other->dir_slot != file->dir_slot || other->dir_block != file->dir_block) continue;
+    if(other->buflen > 0 || other->changed) flushed = TRUE;
+    myfflush(other);
   }
+  return flushed;
 }
 
-// Reads character from file at it's current pos pointer.
-char myfgetc(MyFILE *file)
+// Bring the other handles open on the same directory entry as file into line after file has been
+// cut short: blocks they knew of may have been freed (and taken by other files since), so they drop
+// their chain indexes, readahead and reservations, take the entry's new length and chain, and find
+// their positions again, which may now be past the end (a write there leaves a hole).
+void file_entry_reload(MyFILE *file)
 {
-  char c;
+  if(file->dir_slot < 0) return;
+  for(int fd=0; fd<MAXOPENFILES; fd++) {
+    MyFILE *other = &fileTable[fd];
+    if(!other->inuse || other == file || other->dir_slot != file->dir_slot || other->dir_block != file->dir_block) continue;
+    long at = myftell(other);
+    readahead_cancel(other);
+    release_extent(other->resv_start, other->resv_count);
+    other->resv_count = 0;
+    other->chaingen = -1;
+    load_entry(other);
+    other->changed = FALSE;
+    myfseek(other, at, SEEK_SET);
+  }
+}
 
-  if(file->pos >= BLOCKSIZE) { // If the position reaches end of block, get the next one.
-    if(FAT[file->blockno] == ENDOFCHAIN) { // Reached end of file.
-      return EOF;
-    }
-    else { // Load the next block in the FAT chain into the buffer.
-    file->buffer = virtualDisk[FAT[file->blockno]];
-    file->blockno = FAT[file->blockno];
-    file->pos = 0;
-    c = file->buffer.data[file->pos++];
+// Point open files whose directory entry was at slot in block to where it has moved (newslot is -1
+// if it has been deleted).
+void file_entry_moved(fatentry_t block, int slot, fatentry_t newblock, int newslot)
+{
+  for(int fd=0; fd<MAXOPENFILES; fd++) {
+    MyFILE *file = &fileTable[fd];
+    if(file->inuse && file->dir_slot == slot && file->dir_block == block) {
+      file->dir_block = newblock;
+      file->dir_slot = newslot;
     }
   }
-  else { // pos is still inside the buffer, so keep reading.
-    file->buffer = virtualDisk[file->blockno];
-    c = file->buffer.data[file->pos++];
-  }
+}
 
-  return c;
+
+/* --------  CLONE FUNCTIONS ---------------
+
+  myclone gives a file a second directory entry that shares its chain. Each block counts the
+  extra chains passing through it (refCount), and a shared block is copied before it is changed.
+  Because chains only ever join, the shared part of a chain is always a tail of it, so copying
+  on write means copying the blocks from the start of that tail up to the one being changed.
+  ------------------------------------
+*/
+
+// Is a block used by more than one file?
+int block_shared(fatentry_t block_address)
+{
+  return refCount != NULL && refCount[block_address] > 0;
 }
 
-// Writes character to file at it's current pos pointer.
-int myfputc(MyFILE *file, const char ch)
+// Rebuild the reference counts by walking every file in the directory tree.
+// Only needed if the superblock says the disk has clones; otherwise there are none to count.
+void build_refcounts()
 {
-  if(strcmp(file->mode, "r") == 0) {
-    printf("(myfputc) write rejected: file was in read mode.\n");
-    return 1;
-  }
-  if(file->pos >= BLOCKSIZE) { // If the pos has reached end of buffer.
-    if(FAT[file->blockno] == ENDOFCHAIN) { // If this is the end of chain, create new block and extend the chain.
-      //printf("Allocating new block\n");
+  free(refCount);
+  refCount = NULL;
+  if(!superBlock.clones) return;
+  refCount = calloc(MAXBLOCKS, sizeof(int32_t));
+  count_dir_refs(superBlock.rootdir);
+  for(fatentry_t i=0; i<MAXBLOCKS; i++) if(refCount[i] > 0) refCount[i]--; // one file through a block is no extra reference.
+}
 
-      diskblock_t block;
-      init_block(&block, TYPE_DATA);
+// Count the files through each block, for the directory at dir_index and those below it.
+void count_dir_refs(fatentry_t dir_index)
+{
+  for(fatentry_t blk = dir_index; blk > 0; blk = FAT[blk]) {
+    const diskblock_t *dir = pinblock(blk);
+    for(int i=0; i<dir->dir.nextEntry && dir->dir.level == 0; i++) { // (the tree's upper nodes hold only keys.)
+      const direntry_t *entry = dir_entry(&dir->dir, i);
+      if(entry == NULL) continue;
+      if(entry->isdir) {
+        if(strcmp(entry->name, "..") != 0) count_dir_refs(entry->firstblock);
+      }
+      else {
+        for(fatentry_t b = entry->firstblock; b > 0 && FAT[b] != UNUSED; b = chain_next(b)) refCount[b]++;
+      }
+    }
+    unpinblock(blk);
+    if(FAT[blk] == UNUSED) break;
+  }
+}
 
-      file->pos = 0;
-      int next = next_free_fat();
-      FAT[file->blockno] = next;
-      file->blockno = next;
-      file->buffer = block;
-      file->buffer.data[file->pos] = ch;
-      file->pos++;
-
-      writeblock(&file->buffer, file->blockno, TYPE_DATA);
-      FAT[file->blockno] = ENDOFCHAIN;
-      copyFAT(FAT);
+// Give the block at index in a file's chain index (and the shared blocks before it) blocks of its own,
+// copying them, so they can be changed without changing the file's clones.
+// The copies carry on into the rest of the shared chain (past a copy of any hole that follows).
+// Returns the block now at index, or -1 if the disk is full.
+fatentry_t cow_chain(MyFILE *file, long index)
+{
+  chain_index(file, index + 1);
+  long start = index;
+  while(start > 0 && block_shared(file->chain[start - 1])) start--;
+  long count = index - start + 1;
+  if(count > free_block_count()) return -1;
+
+  fatentry_t prev = (start > 0) ? file->chain[start - 1] : 0;
+  fatentry_t after = FAT[file->chain[index]];
+  if(ISHOLE(after)) after = hole_new(holeTable[HOLESLOT(after)].skip, holeTable[HOLESLOT(after)].next); // each block has its own.
+  fatentry_t newblock = 0;
+  for(long k = start; k <= index; k++) {
+    fatentry_t old = file->chain[k];
+    int got;
+    newblock = reserve_extent(prev + 1, 1, &got);
+    memcpy(pinblock_rw(newblock)->data, pinblock(old)->data, BLOCKSIZE);
+    unpinblock(old);
+    unpinblock_rw(newblock);
+    refCount[old]--;
+
+    if(prev > 0) { // (keeping any hole between the blocks.)
+      long gap = file->chainpos[k] - file->chainpos[k - 1] - 1;
+      if(ISHOLE(FAT[prev])) hole_free(FAT[prev]); // prev is the file's own, and so is its hole.
+      setFAT(prev, (gap > 0) ? hole_new(gap, newblock) : newblock);
     }
-    else { // There is still another block in the chain, so move to that one.
-      file->buffer = virtualDisk[FAT[file->blockno]];
-      file->pos = 0;
-      file->blockno = FAT[file->blockno];
+    else { // The file starts somewhere new, so its directory entry has to say so.
+      if(file->dir_slot >= 0) {
+        direntry_t *entry = dir_entry(&pinblock_rw(file->dir_block)->dir, file->dir_slot);
+        if(entry && entry->firstblock == file->first_block) entry->firstblock = newblock;
+        unpinblock_rw(file->dir_block);
+      }
+      file->first_block = newblock;
     }
+    if(file->blockno == old && file->blockindex == file->chainpos[k]) file->blockno = newblock;
+    if(file->blockno == 0 && file->holeprev == old) file->holeprev = newblock;
+    if(file->lastblock == old) file->lastblock = newblock;
+    file->chain[k] = newblock;
+    prev = newblock;
   }
-  else { // pos is still within buffer, so keep writing.
-    file->buffer.data[file->pos] = ch;
-    file->pos++;
+  setFAT(prev, after);
+  updateFAT();
+  diskStats.cowblocks += count;
+  return newblock;
+}
+
+// Make dst a copy of the file src without copying any data: dst gets a directory entry that shares
+// src's chain, and each block is only copied when one of them first changes it.
+// The chain is walked once to count the new references. Returns 0, or -1 if src does not exist,
+// dst already does, or dst could not be created.
+int myclone(const char *src, const char *dst)
+{
+  MyFILE *from = myfopen(src, "r");
+  if(from == NULL || from->dir_slot < 0) {
+    if(from) myfclose(from);
+    printf("(myclone) no such file %s\n", src);
+    return -1;
+  }
+  MyFILE *check = myfopen(dst, "r");
+  if(check != NULL) {
+    myfclose(check);
+    myfclose(from);
+    printf("(myclone) %s already exists\n", dst);
+    return -1;
+  }
+  MyFILE *to = myfopen(dst, "w");
+  if(to == NULL || to->dir_slot < 0) {
+    if(to) myfclose(to);
+    myfclose(from);
+    return -1;
+  }
+
+  // An inline file has no blocks to share, and is small enough to just copy.
+  if(from->inlined) {
+    myfwrite(from->inlinedata, 1, from->length, to);
+    myfclose(to);
+    myfclose(from);
+    return 0;
   }
 
-  // Write block to update the file.
-  // Update FAT if it's a new block.
-  if(FAT[file->blockno] == UNUSED){
-    init_block(&file->buffer, TYPE_DATA);
-    FAT[file->blockno] = ENDOFCHAIN;
-    copyFAT(FAT);
+  // Note on disk that there are clones, so the counts are rebuilt when it is next mounted.
+  if(!superBlock.clones) {
+    superBlock.clones = TRUE;
+    pinblock_rw(0)->super.clones = TRUE;
+    unpinblock_rw(0);
+    refCount = calloc(MAXBLOCKS, sizeof(int32_t));
   }
-  writeblock(&file->buffer, file->blockno, TYPE_DATA);
+  for(fatentry_t b = from->first_block; b > 0 && FAT[b] != UNUSED; b = chain_next(b)) refCount[b]++;
+
+  // Point dst's entry at src's chain, in place of the block it was created with.
+  free_chain(to->first_block);
+  updateFAT();
+  direntry_t *entry = dir_entry(&pinblock_rw(to->dir_block)->dir, to->dir_slot);
+  entry->inlined = FALSE;
+  entry->firstblock = from->first_block;
+  entry->lastblock = from->lastblock;
+  entry->allocblocks = from->allocblocks;
+  entry->filelength = from->length;
+  entry->modtime = time(NULL);
+  unpinblock_rw(to->dir_block);
+  to->dir_slot = -1; // (so closing it leaves the entry alone.)
+  to->changed = FALSE;
+  myfclose(to);
+  myfclose(from);
   return 0;
 }
 
-// Removes a file at the given path.
-// Doesn't clear the block immediately, but sets direntry.unused = TRUE so the block can be re-used by the filesystem.
-void myremove(const char *path)
-{
-  if(strlen(path) > MAXPATHLENGTH) {
-    printf("(myremove) Pathname was too large (must be shorter than %d). Aborting.\n", MAXPATHLENGTH);
-    return;
-  }
 
-  // Copy path to temp variables avoid segfaults.
-  char *temp_p = malloc(sizeof(char) * MAXPATHLENGTH);
-  char *temp_x = malloc(sizeof(char) * MAXPATHLENGTH);
-  strcpy(temp_x, ""); // avoid garbage text from somewhere...
-  strcpy(temp_p, path);
+/* --------  INLINE FUNCTIONS ---------------
 
-  // Break down the path into set of directories.
-  char *filename = malloc(sizeof(char) * MAXNAME);
-  strcpy(filename, ""); // avoid garbage text from somewhere...
-  char *dir_name = malloc(sizeof(char) * MAXNAME);
-  char **directories = parse_path(temp_p);
-  fatentry_t prev_dir_index = currentDirIndex;
+  A file starts out with no blocks at all. Until it outgrows INLINEMAX bytes its data is kept in the
+  entry, just past the name's terminating NUL, so opening and reading it costs only the directory
+  block. An open inline file works on a copy of the data, which update_entry writes back along with
+  the length, growing the entry to fit (or, if the directory block is too full for that, moving the
+  data out to a block after all).
+  ------------------------------------
+*/
 
-  // Cut filename, and call mymkdir to deal with the path (create any unexisting directories etc.).
-  int i = 0;
-  int num_dirs = get_path_dir_no(directories);
-  if(num_dirs == 1) {
-    strcpy(temp_x, "/"); // root folder.
-    strcpy(filename, directories[0]); // the filename.
+// Move an inline file's data out to a block of its own, which starts the file's chain.
+// Returns 0, or -1 if the disk is full.
+int inline_promote(MyFILE *file)
+{
+  fatentry_t block = next_free_fat();
+  if(block < 0) return -1;
+  diskblock_t *data = pinblock_rw(block);
+  init_block(data, TYPE_DATA);
+  memcpy(data->data, file->inlinedata, file->length);
+  unpinblock_rw(block);
+  updateFAT();
+
+  if(file->dir_slot >= 0) {
+    direntry_t *entry = dir_entry(&pinblock_rw(file->dir_block)->dir, file->dir_slot);
+    if(entry && entry->inlined) { // (unless the file has since been deleted.)
+      entry->inlined = FALSE;
+      entry->firstblock = block;
+      entry->lastblock = block;
+      entry->allocblocks = 1;
+    }
+    unpinblock_rw(file->dir_block);
   }
-  else {
-    // Check each directory, and make sure it exists.
-    while(1) {
-      if(strcmp(directories[i], "") == 0) break;
-      if(dir_index(directories[i]) == -1) {
-        printf("(myremove) no such file or directory %s\n", path);
-        return;
-      }
-      strcpy(filename, directories[i]);
-      if(i < num_dirs) {
-        strcat(temp_x, "/");
-        strcat(temp_x, directories[i]);
+  file->inlined = FALSE;
+  file->first_block = block;
+  file->lastblock = block;
+  file->allocblocks = 1;
+  file->changed = TRUE;
+  if(file->blockindex == 0) file->blockno = block;
+  else hole_enter(file, block, 0); // the position is past the end of the block.
+  return 0;
+}
+
+// Empty a file and keep it in its directory entry again, freeing its whole chain (blocks shared
+// with a clone just lose a reference).
+void inline_reset(MyFILE *file)
+{
+  if(!file->inlined) {
+    free_chain(file->first_block);
+    updateFAT();
+    if(file->dir_slot >= 0) {
+      direntry_t *entry = dir_entry(&pinblock_rw(file->dir_block)->dir, file->dir_slot);
+      if(entry && entry->firstblock == file->first_block) { // (unless the file has since been deleted.)
+        entry->inlined = TRUE;
+        entry->firstblock = 0;
+        entry->lastblock = 0;
+        entry->allocblocks = 0;
+        entry->filelength = 0;
       }
-      i++;
+      unpinblock_rw(file->dir_block);
     }
+    file->inlined = TRUE;
+    file->first_block = 0;
+    file->lastblock = 0;
+    file->allocblocks = 0;
+    file->chaingen = -1; // (its chain index is of the old chain.)
   }
+  file->inlinecap = INLINEMAX;
+  memset(file->inlinedata, 0, INLINEMAX);
+  file->length = 0;
+  file->blockno = 0;
+  file->blockindex = 0;
+  file->pos = 0;
+  file->changed = TRUE;
+}
 
-  if(strcmp(temp_x, "/") == 0) { // delete a file inside the root directory.
-    diskblock_t *block = malloc(sizeof(diskblock_t)); // delete_file needs a block to load the parent directory information.
-    delete_file(block, filename); // delete_file sets that files entry to unused.
-    printf("(myremove) deleted file %s in root.\n", filename);
-  }
-  else {
-    mymkdir(temp_x);
-  
-    // Get the last directory from the path and CD to it.
-    i = 0;
-    while(1) {
-      if(strcmp(directories[i], "") == 0) break;
-      strcpy(filename, directories[i]);
-      if(i>0) strcpy(dir_name, directories[i-1]);
-      i++;
-    }
 
-    // Set the file's entry to unused.
-    diskblock_t *block = malloc(sizeof(diskblock_t));
-    readblock(block, dir_index(dir_name), TYPE_DIR);
-    change_dir(dir_index(dir_name));
-    delete_file(block, filename);
-    printf("(myremove) deleted file %s in %s.\n", filename, dir_name);
-    change_dir(prev_dir_index);
-  }
+/* --------  HOLE FUNCTIONS ---------------
 
-}
+  A sparse file's chain skips the blocks that have never been written. Where it does, the FAT entry
+  of the block before the gap holds HOLE(slot) in place of the next block, and holeTable[slot] says
+  how many blocks are missing and which block comes after them. The table is kept in memory and
+  written to its own chain (superBlock.holetable) along with the FAT. A hole at the end of a file is
+  not recorded at all: the file's length just runs on past the end of its chain.
+  ------------------------------------
+*/
 
-// Close the file descriptor and free the pointer.
-void myfclose(MyFILE *file)
+// Record a hole of skip blocks, followed by block next. Returns the FAT entry that points to it.
+fatentry_t hole_new(fatentry_t skip, fatentry_t next)
 {
-  free(file);
+   int slot = holeFreeSlot;
+   if ( slot >= 0 ) holeFreeSlot = holeTable[slot].next;
+   else
+   {
+      if ( holeSlots == holeCap )
+      {
+         holeCap = holeCap ? holeCap * 2 : 64;
+         holeTable = realloc ( holeTable, holeCap * sizeof(hole_t) );
+      }
+      slot = holeSlots++;
+   }
+   holeTable[slot] = (hole_t) { skip, next };
+   if ( slot < holeDirtyFrom || holeDirtyFrom >= holeDirtyTo ) holeDirtyFrom = slot;
+   if ( slot >= holeDirtyTo ) holeDirtyTo = slot + 1;
+   return HOLE(slot);
 }
 
-// Given a dirblock, and a filename, sets that file's entry to be unused so the filesystem can reclaim the space.
-void delete_file(diskblock_t *directory, const char *filename)
+// Forget the hole a FAT entry points to.
+void hole_free(fatentry_t entry)
 {
-  for(int i=0; i<DIRENTRYCOUNT; i++) {
-    if(strcmp(directory->dir.entrylist[i].name, filename) == 0) {
-      directory->dir.entrylist[i].unused = TRUE;
-      //strcpy(directory->dir.entrylist[i].name, "[empty]");
-      FAT[directory->dir.entrylist[i].firstblock] = UNUSED;
-      writeblock(directory, currentDirIndex, TYPE_DIR);
-      return;
-    }
-  }
+   int slot = HOLESLOT(entry);
+   holeTable[slot] = (hole_t) { 0, holeFreeSlot };
+   holeFreeSlot = slot;
+   if ( slot < holeDirtyFrom || holeDirtyFrom >= holeDirtyTo ) holeDirtyFrom = slot;
+   if ( slot >= holeDirtyTo ) holeDirtyTo = slot + 1;
 }
 
-// Get index of the first block belonging to a file. (within the current directory).
-int file_index(const char *filename)
+// The block after block_address in its chain, skipping over any hole (ENDOFCHAIN at the end).
+fatentry_t chain_next(fatentry_t block_address)
 {
-  diskblock_t directory = virtualDisk[currentDirIndex];
-  for(int i=0; i<DIRENTRYCOUNT; i++) {
-    if(directory.dir.entrylist[i].unused == FALSE) {
-      if(memcmp(directory.dir.entrylist[i].name, filename, strlen(filename) + 1) == 0) {
-        return directory.dir.entrylist[i].firstblock;
-      }
-    }
-  }
-  return -1; // file not found.
+   fatentry_t next = FAT[block_address];
+   return ISHOLE(next) ? holeTable[HOLESLOT(next)].next : next;
 }
 
-// Print contents of all the blocks belonging to a file in order.
-void print_file(const char *filename)
+// Write the parts of the hole table that have changed, growing its chain first if it has outgrown it.
+// The superblock records where the table is and how big.
+void sync_holes()
 {
-  int start = file_index(filename);
-  int end = (start + (file_block_length(filename)));
-  for(int i=start; i<end; i++) printBlock(i, TYPE_DATA);
+   if ( holeDirtyFrom >= holeDirtyTo ) return;
+   int per = BLOCKSIZE / sizeof(hole_t);
+   fatentry_t start = superBlock.holetable;
+   fatentry_t prev = 0, blk = start;
+   for ( int first = 0; first < holeSlots; first += per )
+   {
+      if ( blk <= 0 ) // The table has grown into a new block.
+      {
+         blk = next_free_fat();
+         if ( blk < 0 )
+         {
+            printf("(sync_holes) disk is full, hole table not written.\n");
+            return;
+         }
+         if ( prev > 0 ) setFAT ( prev, blk );
+         else superBlock.holetable = blk;
+      }
+      if ( first + per > holeDirtyFrom && first < holeDirtyTo )
+      {
+         hole_t *out = (hole_t *) pinblock_rw(blk)->data;
+         for ( int x = 0; x < per; x++ )
+         {
+            out[x] = ( first + x < holeSlots ) ? holeTable[first + x] : (hole_t) { 0, -1 };
+         }
+         unpinblock_rw(blk);
+      }
+      prev = blk;
+      blk = FAT[blk];
+   }
+   holeDirtyFrom = holeDirtyTo = 0;
+   if ( superBlock.holeslots != holeSlots || superBlock.holetable != start )
+   {
+      superBlock.holeslots = holeSlots;
+      superblock_t *super = &pinblock_rw(0)->super;
+      super->holetable = superBlock.holetable;
+      super->holeslots = superBlock.holeslots;
+      unpinblock_rw(0);
+   }
 }
 
-// Return number of blocks allocated to a file.
-int file_block_length(const char *filename) {
-  int count = 1;
-  int cur = file_index(filename);
-  while((cur = FAT[cur]) != ENDOFCHAIN) count++;
-
-  return count;
+// Read the hole table back from its chain (on mount), or start an empty one (on format).
+void load_holes()
+{
+   int per = BLOCKSIZE / sizeof(hole_t);
+   holeSlots = superBlock.holeslots;
+   holeCap = ( holeSlots > 64 ) ? holeSlots : 64;
+   holeTable = realloc ( holeTable, holeCap * sizeof(hole_t) );
+   holeFreeSlot = -1;
+   holeDirtyFrom = holeDirtyTo = 0;
+   fatentry_t blk = superBlock.holetable;
+   for ( int first = 0; first < holeSlots; first += per )
+   {
+      if ( blk <= 0 ) { holeSlots = first; break; } // (a damaged table: keep what there is.)
+      const hole_t *in = (const hole_t *) pinblock(blk)->data;
+      for ( int x = 0; x < per && first + x < holeSlots; x++ ) holeTable[first + x] = in[x];
+      unpinblock(blk);
+      blk = FAT[blk];
+   }
+   for ( int slot = holeSlots - 1; slot >= 0; slot-- )
+   {
+      if ( holeTable[slot].skip != 0 ) continue;
+      holeTable[slot].next = holeFreeSlot;
+      holeFreeSlot = slot;
+   }
 }
 
 
@@ -610,144 +2851,379 @@ int file_block_length(const char *filename) {
 // Write the FAT to the virtual disk.
 void copyFAT(fatentry_t *FAT)
 {
-   diskblock_t block;
-   int y = 0;
-   for(int i=0; i<(MAXBLOCKS /(BLOCKSIZE / sizeof(fatentry_t))); i++) // in this case == 2 -> we need 2 blocks to store FAT.
+   fatentry_t y = 0;
+   for(fatentry_t i=0; i<superBlock.fatblocks; i++) // one block per FATENTRYCOUNT entries.
    {
-      // new block.
-      for(int x=0; x<(BLOCKSIZE / sizeof(fatentry_t)); x++) // in this case == 512 -> each block can store 512 FAT entries.
+      // fill the FAT block in place.
+      diskblock_t *block = pinblock_rw(superBlock.fatstart + i);
+      for(int x=0; x<FATENTRYCOUNT; x++) // each block can store BLOCKSIZE / 4 FAT entries.
       {
-         block.fat[x] = FAT[y++];
+         block->fat[x] = (y < MAXBLOCKS) ? FAT[y] : UNUSED; // the last block is padded out.
+         y++;
       }
-      writeblock(&block, i+1, 1);
+      unpinblock_rw(superBlock.fatstart + i);
    }
+   memset(fatDirty, 0, ((size_t) superBlock.fatblocks + 7) / 8);
 }
 
-// Return the next unused FAT position.
-int next_free_fat()
+// Change a FAT entry, noting which FAT block now needs writing.
+void setFAT(fatentry_t index, fatentry_t value)
 {
-  int i;
-  for(i=0; i<MAXBLOCKS; i++) {
-    if(FAT[i] == UNUSED) {
-      FAT[i] = ENDOFCHAIN;
-      return i;
-    }
-  }
-  return -1;
+   FAT[index] = value;
+   fatentry_t fatblock = index / FATENTRYCOUNT;
+   fatDirty[fatblock / 8] |= 1 << (fatblock % 8);
+}
+
+// Write only the FAT blocks that have changed.
+void syncFAT()
+{
+   if ( fatDirty == NULL ) return;
+   sync_holes(); // (first, as it may take or free blocks for the table.)
+   for(fatentry_t i=0; i<superBlock.fatblocks; i++)
+   {
+      if ( fatDirty[i / 8] == 0 ) { i |= 7; continue; } // skip 8 clean blocks at a time.
+      if ( !(fatDirty[i / 8] & (1 << (i % 8))) ) continue;
+      diskblock_t *block = pinblock_rw(superBlock.fatstart + i);
+      fatentry_t y = i * FATENTRYCOUNT;
+      for(int x=0; x<FATENTRYCOUNT; x++, y++)
+      {
+         block->fat[x] = (y < MAXBLOCKS) ? FAT[y] : UNUSED;
+      }
+      unpinblock_rw(superBlock.fatstart + i);
+      fatDirty[i / 8] &= ~(1 << (i % 8));
+   }
+}
+
+// Persist the FAT after a change, unless FAT writes are being deferred.
+void updateFAT()
+{
+   if ( !fatDeferred ) syncFAT();
+}
+
+// Turn deferred FAT writes on or off. While on, FAT changes are batched in memory and
+// written at myfclose(), writedisk(), syncdisk() or an explicit syncFAT().
+void deferFAT(int on)
+{
+   fatDeferred = on;
+   if ( !on ) syncFAT();
+}
+
+// Read the FAT back from the virtual disk (the reverse of copyFAT).
+void loadFAT(fatentry_t *FAT)
+{
+   fatentry_t y = 0;
+   for(fatentry_t i=0; i<superBlock.fatblocks; i++)
+   {
+      if(i % PREFETCHBLOCKS == 0) prefetch_range(superBlock.fatstart + i, PREFETCHBLOCKS); // read the FAT in batches.
+      const diskblock_t *block = pinblock(superBlock.fatstart + i);
+      for(int x=0; x<FATENTRYCOUNT && y<MAXBLOCKS; x++)
+      {
+         FAT[y++] = block->fat[x];
+      }
+      unpinblock(superBlock.fatstart + i);
+   }
+   memset(fatDirty, 0, ((size_t) superBlock.fatblocks + 7) / 8);
+   build_freemap();
+   load_holes();
+   build_refcounts();
 }
 
 // Print contents of FAT.
 void print_FAT()
 {
    printf("The FAT:\n");
-   for(int i=0; i<1024; i++) printf("%d", FAT[i]);
+   for(fatentry_t i=0; i<MAXBLOCKS; i++) printf("%d", FAT[i]);
    printf("\n");
 }
 
 
-/* --------  DIRECTORY FUNCTIONS ---------------
+/* --------  ALLOCATOR FUNCTIONS ---------------
 
-  Making, deleting, and filling directories.
-  ------------------------------------------
+  Free blocks are tracked in a bitmap alongside the FAT, so finding one does not mean
+  scanning the FAT. The bitmap is searched a 64-bit word at a time, regions with no free
+  blocks are skipped using their free counts, and the search starts from where the last
+  allocation left off (next-fit), wrapping round to the start of the disk.
+  ------------------------------------
 */
 
-// Add file to directory at the given index.
-void add_file(fatentry_t dir_index, direntry_t *entry, int type) {
-  if(type == TYPE_DATA) {
+// Set, clear and test a block's bit in the bitmap.
+#define MAP_SET(block)   (freeMap[(block) / 64] |= (uint64_t) 1 << ((block) % 64))
+#define MAP_CLEAR(block) (freeMap[(block) / 64] &= ~((uint64_t) 1 << ((block) % 64)))
+#define MAP_TEST(block)  ((freeMap[(block) / 64] >> ((block) % 64)) & 1)
 
-    // Get info about the directory and copy file into it's entrylist.
-    diskblock_t *temp_block = malloc(sizeof(diskblock_t));
-    readblock(temp_block, dir_index, type);
-    int next_free = next_free_dir_entry(&temp_block->dir);
-    temp_block->dir.entrylist[next_free] = *entry;
-    writeblock(temp_block, dir_index, type);
+// Rebuild the free-space bitmap and region counts from the FAT (on format and mount).
+void build_freemap()
+{
+   size_t words = ((size_t) MAXBLOCKS + 63) / 64;
+   size_t regions = ((size_t) MAXBLOCKS + FREEREGIONBLOCKS - 1) / FREEREGIONBLOCKS;
+   free ( freeMap );
+   free ( regionFree );
+   freeMap = calloc ( words, sizeof(uint64_t) );
+   regionFree = calloc ( regions, sizeof(int) );
+   freeBlocks = 0;
+   allocHint = 0;
+   for ( fatentry_t i = 0; i < MAXBLOCKS; i++ )
+   {
+      if ( FAT[i] != UNUSED ) continue;
+      MAP_SET(i);
+      regionFree[i / FREEREGIONBLOCKS]++;
+      freeBlocks++;
+   }
+}
 
-    //free(temp_block);
-    return;
-  }
-  else if(type == TYPE_FAT) {
-    return;
-  }
-  else if(type == TYPE_DIR) {
-    return;
-  }
-  else {
-    return;
-  }
+// Find a free block, searching from from onwards (not wrapping). Returns -1 if there is none.
+fatentry_t find_free(fatentry_t from)
+{
+   size_t words = ((size_t) MAXBLOCKS + 63) / 64;
+   size_t w = (size_t) from / 64;
+   uint64_t bits = freeMap[w] & (~(uint64_t) 0 << (from % 64)); // ignore the blocks before from.
+   while ( 1 )
+   {
+      if ( bits ) return (fatentry_t) (w * 64 + __builtin_ctzll(bits));
+      if ( ++w >= words ) return -1;
+
+      // Skip over whole regions that have nothing free.
+      if ( w % (FREEREGIONBLOCKS / 64) == 0 )
+      {
+         while ( w < words && regionFree[w / (FREEREGIONBLOCKS / 64)] == 0 ) w += FREEREGIONBLOCKS / 64;
+         if ( w >= words ) return -1;
+      }
+      bits = freeMap[w];
+   }
 }
 
-// Creates a directory at given path.
-void mymkdir(char *path)
+// Mark a particular free block as in use (the end of a chain).
+void take_block(fatentry_t block_address)
 {
-  if(strlen(path) > MAXPATHLENGTH) {
-    printf("(mymkdir) Pathname was too large. Returning.\n");
-    return;
-  }
+   if ( MAP_TEST(block_address) )
+   {
+      MAP_CLEAR(block_address);
+      regionFree[block_address / FREEREGIONBLOCKS]--;
+      freeBlocks--;
+   }
+   setFAT ( block_address, ENDOFCHAIN );
+}
 
-  // Break the path down into a list of directories.
-  char **dir_list = parse_path(path);
-  int index = 0;
-  int original_dir_index = currentDirIndex;
-  int num_dirs = 0;
+// Return a block to the free space.
+void free_block(fatentry_t block_address)
+{
+   if ( block_address <= 0 || block_address >= MAXBLOCKS ) return;
+   setFAT ( block_address, UNUSED );
+   chainGeneration++;
+   if ( !MAP_TEST(block_address) )
+   {
+      MAP_SET(block_address);
+      regionFree[block_address / FREEREGIONBLOCKS]++;
+      freeBlocks++;
+   }
+}
 
-  // Count how many directories are in the path.
-  int i=0;
-  while(1) {
-    if(strcmp(dir_list[i], "") == 0) break;
-    i++;
-    num_dirs++;
-  }
+// Free every block in the chain starting at block_address, and the holes in it (blocks shared with
+// clones just lose a reference). Returns the number of blocks the chain had.
+long free_chain(fatentry_t block_address)
+{
+   long count = 0;
+   while ( block_address > 0 && block_address < MAXBLOCKS && FAT[block_address] != UNUSED )
+   {
+      fatentry_t next = chain_next ( block_address );
+      if ( block_shared(block_address) ) refCount[block_address]--; // a clone still uses it.
+      else
+      {
+         if ( ISHOLE(FAT[block_address]) ) hole_free ( FAT[block_address] );
+         free_block ( block_address );
+      }
+      block_address = next;
+      count++;
+   }
+   return count;
+}
 
-  printf("(mymkdir) adding %s \n", path);
+// Reserve a run of up to want contiguous free blocks for a file, preferably starting at near.
+// Reserved blocks are out of the bitmap but still UNUSED in the FAT, so they are free again
+// after a remount. The first run of the full length found from the next-fit hint is taken;
+// failing that, the longest of the first few runs looked at.
+// Returns the first block, with the run's length in *got, or -1 if the disk is full.
+fatentry_t reserve_extent(fatentry_t near, int want, int *got)
+{
+   fatentry_t best = -1;
+   int bestlen = 0;
+   *got = 0;
+   if ( freeBlocks == 0 ) return -1;
+
+   fatentry_t from = ( near > 0 && near < MAXBLOCKS && MAP_TEST(near) ) ? near : allocHint;
+   int wrapped = FALSE;
+   for ( int tries = 0; tries < EXTENTTRIES; tries++ )
+   {
+      fatentry_t start = find_free ( from );
+      if ( start < 0 )
+      {
+         if ( wrapped ) break;
+         wrapped = TRUE;
+         start = find_free ( 0 );
+         if ( start < 0 ) break;
+      }
+      int len = 1;
+      while ( len < want && start + len < MAXBLOCKS && MAP_TEST(start + len) ) len++;
+      if ( len > bestlen )
+      {
+         best = start;
+         bestlen = len;
+      }
+      if ( len == want || start == near ) break; // a full run, or one that carries straight on from the file.
+      from = start + len;
+      if ( from >= MAXBLOCKS ) from = 0;
+   }
+   if ( best < 0 ) return -1;
+
+   for ( fatentry_t i = best; i < best + bestlen; i++ ) MAP_CLEAR(i);
+   for ( fatentry_t i = best; i < best + bestlen; i++ ) regionFree[i / FREEREGIONBLOCKS]--;
+   freeBlocks -= bestlen;
+   allocHint = ( best + bestlen < MAXBLOCKS ) ? best + bestlen : 0;
+   *got = bestlen;
+   return best;
+}
 
-  // Absolute path.
-  if(path[0] == '/') {
-    // Start at root.
-    currentDirIndex = rootDirIndex;
+// Reserve a run of exactly count contiguous free blocks, the first found from the next-fit hint
+// (wrapping round), for a structure that must not be split up, such as a directory's hash index.
+// Returns the first block, or -1 if there is no free run that long.
+fatentry_t reserve_run(int count)
+{
+   for ( int pass = 0; pass < 2; pass++ )
+   {
+      fatentry_t from = pass ? 0 : allocHint;
+      fatentry_t end = pass ? allocHint : MAXBLOCKS;
+      while ( from < end )
+      {
+         fatentry_t start = find_free ( from );
+         if ( start < 0 || start >= end ) break;
+         int len = 1;
+         while ( len < count && start + len < MAXBLOCKS && MAP_TEST(start + len) ) len++;
+         if ( len == count )
+         {
+            for ( fatentry_t i = start; i < start + count; i++ ) MAP_CLEAR(i);
+            for ( fatentry_t i = start; i < start + count; i++ ) regionFree[i / FREEREGIONBLOCKS]--;
+            freeBlocks -= count;
+            allocHint = ( start + count < MAXBLOCKS ) ? start + count : 0;
+            return start;
+         }
+         from = start + len;
+      }
+   }
+   return -1;
+}
 
-    // Iterate through the path.
-    for(int i=0; i<num_dirs; i++) {
-      index = dir_index(dir_list[i]);
+// Hand back count reserved blocks from start on.
+void release_extent(fatentry_t start, int count)
+{
+   for ( fatentry_t i = start; i < start + count; i++ )
+   {
+      if ( i <= 0 || i >= MAXBLOCKS || MAP_TEST(i) || FAT[i] != UNUSED ) continue;
+      MAP_SET(i);
+      regionFree[i / FREEREGIONBLOCKS]++;
+      freeBlocks++;
+   }
+}
 
-      // Check if directory exists (create if not).
-      if(index == -1) {
-        add_dir(dir_list[i]);
+// Describe a chain as runs of consecutive blocks, so it can be read or copied a run at a time.
+// A hole in the chain is an extent of its own, starting at block 0 (which no file has), so the
+// extents' lengths add up to the blocks the chain covers. Fills in up to max extents and returns
+// how many the whole chain has.
+int chain_extents(fatentry_t block_address, extent_t *extents, int max)
+{
+   int n = 0;
+   fatentry_t start = 0, length = 0;
+   while ( block_address > 0 && block_address < MAXBLOCKS )
+   {
+      if ( length > 0 && start + length == block_address ) length++;
+      else
+      {
+         if ( length > 0 && n++ < max ) extents[n-1] = (extent_t) { start, length };
+         start = block_address;
+         length = 1;
       }
-      else {
-        // it was found.
+      fatentry_t next = FAT[block_address];
+      if ( next == UNUSED ) break;
+      if ( ISHOLE(next) )
+      {
+         if ( n++ < max ) extents[n-1] = (extent_t) { start, length };
+         if ( n++ < max ) extents[n-1] = (extent_t) { 0, holeTable[HOLESLOT(next)].skip };
+         length = 0;
       }
+      block_address = chain_next ( block_address );
+   }
+   if ( length > 0 && n++ < max ) extents[n-1] = (extent_t) { start, length };
+   return n;
+}
 
-      // Then change currentDirIndex to it and continue.
-      currentDirIndex = dir_index(dir_list[i]);
-    }
-  }
+// The extents of a file in the current directory (see chain_extents).
+int file_extents(const char *filename, extent_t *extents, int max)
+{
+   return chain_extents ( file_index(filename), extents, max );
+}
 
-  // Relative path.
-  else {
-    // do the same as above, but starting at currentDirIndex not root...
+// Number of free blocks on the disk.
+fatentry_t free_block_count()
+{
+   return freeBlocks;
+}
+
+// Return the next unused FAT position, marked as the end of a chain (-1 if the disk is full).
+int next_free_fat()
+{
+   if ( freeBlocks == 0 ) return -1;
+   fatentry_t i = find_free ( allocHint );
+   if ( i < 0 ) i = find_free ( 0 ); // wrap round.
+   if ( i < 0 ) return -1;
+   take_block ( i );
+   allocHint = ( i + 1 < MAXBLOCKS ) ? i + 1 : 0;
+   return i;
+}
 
-    // Iterate through the path.
-    for(int i=0; i<num_dirs; i++) {
-      index = dir_index(dir_list[i]);
 
-      // Check if directory exists (create if not).
-      if(index == -1) {
-        add_dir(dir_list[i]);
-      }
-      else {
-        // it was found.
-      }
+/* --------  DIRECTORY FUNCTIONS ---------------
+
+  Making, deleting, and filling directories.
+  ------------------------------------------
+*/
+
+// Add file to directory at the given index.
+void add_file(fatentry_t dir_index, direntry_t *entry, int type) {
+  if(type == TYPE_DATA) {
+
+    // Copy the file's entry into the directory, in the leaf for its name.
+    fatentry_t block;
+    int slot = dir_add(dir_index, entry, 0, &block);
+    if(slot < 0) {
+      printf("(add_file) disk is full, %s not added.\n", entry->name);
+      return;
+    }
+    dcache_forget(dir_index, entry->name);
+    dirindex_add(dir_index, entry->name, block, slot);
+    return;
+  }
+  else if(type == TYPE_FAT) {
+    return;
+  }
+  else if(type == TYPE_DIR) {
+    return;
+  }
+  else {
+    return;
+  }
+}
 
-      // Then change currentDirIndex to it and continue.
-      currentDirIndex = dir_index(dir_list[i]);
-    }
+// Creates a directory at given path.
+void mymkdir(char *path)
+{
+  if(strlen(path) > MAXPATHLENGTH) {
+    printf("(mymkdir) Pathname was too large. Returning.\n");
+    return;
   }
 
-  // Set currentDirIndex back to original value.
-  currentDirIndex = original_dir_index;
-  //free(dir_list);
-  //free(parent);
-  return;
+  printf("(mymkdir) adding %s \n", path);
+
+  // Walk the path, creating each directory that doesn't exist yet.
+  resolve_path(path, NULL, TRUE);
 }
 
 // Scans a pathname and tokenizes into a list of directories.
@@ -772,127 +3248,175 @@ char ** parse_path(char *path)
 char ** mylistdir(char *path)
 {
   int original_dir_index = currentDirIndex;
-  char **file_list = alloc_2d_char_array(MAXDIRCONTENTS, MAXNAME);
-  diskblock_t temp;
-  
-  if(strcmp(path, "/") == 0) {
-    readblock(&temp, rootDirIndex, TYPE_DIR);
-    for(int i=0; i<DIRENTRYCOUNT; i++) {
-      file_list[i] = temp.dir.entrylist[i].name; 
-    }
+
+  // Find the directory, and copy out the names of its entries in order, ending the list with "".
+  fatentry_t index = resolve_path(path, NULL, FALSE);
+  long count = (index >= 0) ? dir_count(index) : 0;
+  char **file_list = alloc_2d_char_array(count + 1, MAXNAME);
+  long n = 0;
+  for(fatentry_t leaf = (index >= 0) ? dir_first_leaf(index) : 0; leaf > 0; ) {
+    const diskblock_t *temp = pinblock(leaf);
+    for(int pos=0; pos<temp->dir.entryCount; pos++) strcpy(file_list[n++], dir_nth(&temp->dir, pos)->name);
+    fatentry_t next = temp->dir.nextLeaf;
+    unpinblock(leaf);
+    leaf = next;
   }
-  else {
-    char **directories = parse_path(path);
-    // loop through each entry, find the index, load that block, and load it's entrylist.
-    char *name = malloc(sizeof(char) * MAXNAME);
-    int i = 0;
-    
-    // Get the last dir.
-    while(1) {
-      if(strcmp(directories[i], "") == 0) break;
-      strcpy(name, directories[i++]);
-    }
 
-    // If the directory doesn't exist.
-    if(dir_index(name) == -1) {
+  // Set currentDirIndex back to original.
+  currentDirIndex = original_dir_index;
+  return file_list;
+}
+
+// Open the directory at path, to read its entries one at a time, in name order, with myreaddir().
+// Returns NULL if there is no such directory.
+MYDIR *myopendir(const char *path)
+{
+  fatentry_t index = resolve_path(path, NULL, FALSE);
+  if(index < 0) return NULL;
+  MYDIR *dir = calloc(1, sizeof(MYDIR));
+  dir->dir = index;
+  dir->leaf = dir_first_leaf(index);
+  return dir;
+}
+
+// Pin the leaf holding the next entry to be read from a directory opened with myopendir(), with
+// the entry's position in its name order in *pos. The place is found again by the name of the
+// last entry read if the leaf has changed since. Returns NULL (with nothing pinned) after the last.
+const diskblock_t *readdir_leaf(MYDIR *dir, int *pos)
+{
+  while(dir->leaf > 0) {
+    const diskblock_t *leaf = pinblock(dir->leaf);
+    if(leaf->dir.level > 0) { // It was the root, and its entries have moved down (see dir_push_root).
+      unpinblock(dir->leaf);
+      dir->leaf = dir_descend(dir->dir, dir->entry.name, 0);
+      continue;
     }
+    *pos = dir->pos;
+    if(*pos == 0 || *pos > leaf->dir.entryCount || strcmp(dir_nth(&leaf->dir, *pos - 1)->name, dir->entry.name) != 0) {
+      *pos = dir_search(&leaf->dir, dir->entry.name);
+      if(*pos < leaf->dir.entryCount && strcmp(dir_nth(&leaf->dir, *pos)->name, dir->entry.name) == 0) (*pos)++;
+    }
+    if(*pos < leaf->dir.entryCount) return leaf;
+    fatentry_t next = leaf->dir.nextLeaf;
+    unpinblock(dir->leaf);
+    dir->leaf = next;
+    dir->pos = 0;
+  }
+  return NULL;
+}
 
-    // If it does exist, retrieve it.
-    else {
-      readblock(&temp, dir_index(name), TYPE_DIR);
-      for(int i=0; i<DIRENTRYCOUNT; i++) {
-        strcpy(file_list[i], temp.dir.entrylist[i].name);
+// Returns the next entry of a directory opened with myopendir(), read straight from its block,
+// or NULL after the last. The entry is overwritten by the next call. Entries added or deleted
+// while the directory is being read may or may not be returned, but none of the others is missed.
+mydirent_t *myreaddir(MYDIR *dir)
+{
+  int pos;
+  const diskblock_t *leaf = (dir != NULL) ? readdir_leaf(dir, &pos) : NULL;
+  if(leaf == NULL) return NULL;
+  const direntry_t *entry = dir_nth(&leaf->dir, pos);
+  size_t len = dir_namelen(entry);
+  memcpy(dir->entry.name, entry->name, len);
+  dir->entry.name[len] = '\0';
+  dir->entry.isdir = entry->isdir;
+  dir->entry.size = entry->isdir ? 0 : entry->filelength;
+  dir->entry.firstblock = entry->firstblock;
+  dir->pos = pos + 1;
+  unpinblock(dir->leaf);
+  return &dir->entry;
+}
+
+// Read up to max entries of a directory opened with myopendir() into buf, with what a listing
+// would stat each one for, taken from the entries themselves: a whole leaf is copied out at a
+// time, and no file's chain is walked. Sizes are as of the files' last flush. Carries on from
+// where the last call (or myreaddir) left off; returns the number of entries read, 0 after the last.
+int myreaddirplus(MYDIR *dir, mystat_t *buf, int max)
+{
+  int n = 0, pos;
+  const diskblock_t *leaf;
+  while(n < max && dir != NULL && (leaf = readdir_leaf(dir, &pos)) != NULL) {
+    for( ; pos < leaf->dir.entryCount && n < max; pos++, n++) {
+      const direntry_t *entry = dir_nth(&leaf->dir, pos);
+      mystat_t *st = &buf[n];
+      size_t len = dir_namelen(entry);
+      memcpy(st->name, entry->name, len);
+      st->name[len] = '\0';
+      st->isdir = entry->isdir;
+      st->size = entry->isdir ? 0 : entry->filelength;
+      st->blocks = entry->isdir ? 0 : entry->allocblocks;
+      if(entry->isdir) { // (a directory's blocks are counted along its chain, in the FAT.)
+        for(fatentry_t b = entry->firstblock; b > 0 && FAT[b] != UNUSED; b = FAT[b]) st->blocks++;
       }
+      st->mtime = entry->modtime;
+      st->firstblock = entry->firstblock;
     }
-    //free(name);
-    //free(directories);
+    strcpy(dir->entry.name, buf[n-1].name); // (so the next call knows where to carry on.)
+    dir->pos = pos;
+    unpinblock(dir->leaf);
   }
+  return n;
+}
 
-  // Set currentDirIndex back to original.
-  currentDirIndex = original_dir_index;
-  return file_list;
+// Finish reading a directory opened with myopendir().
+void myclosedir(MYDIR *dir)
+{
+  free(dir);
 }
 
 // Add a new directory to the current dir.
 void add_dir(const char *folder_name) {
 
-  // Get parent dir.
-  diskblock_t *parent = malloc(sizeof(diskblock_t));
-  readblock(parent, currentDirIndex, TYPE_DIR);
-
-  // Check for free entrylist slot.
-  int free_entry_index = next_free_dir_entry(&parent->dir);
   int next_index = next_free_fat();
+  if(next_index < 0) {
+    printf("(add_dir) disk is full, %s not added.\n", folder_name);
+    return;
+  }
+  updateFAT();
 
-  // Create the new directory block.
-  diskblock_t *newDir = malloc(sizeof(diskblock_t));
+  // Create the new directory block, with its parent's entry.
+  diskblock_t *newDir = pinblock_rw(next_index);
   init_block(newDir, TYPE_DIR);
-  
-  // Create the new dir's entry, for adding to parent.
-  //direntry_t *newEntry = malloc(sizeof(direntry_t));
-  direntry_t *newEntry = malloc(sizeof(direntry_t));
+  direntry_t *newEntry = calloc(1, DIRENTRYMAX); // (zeroed: a directory is never inline.)
   newEntry->isdir = TRUE;
-  newEntry->unused = FALSE;
+  newEntry->modtime = time(NULL);
+  newEntry->firstblock = currentDirIndex;
+  strcpy(newEntry->name, "..");
+  dir_insert(&newDir->dir, newEntry);
+  unpinblock_rw(next_index);
+
+  // Add the new dir's entry to the parent, if there is room.
   newEntry->firstblock = next_index;
   strcpy(newEntry->name, folder_name);
-
-  // Unless root, add parent info to the new dir's entrylist.
-  direntry_t *parentEntry = malloc(sizeof(direntry_t));
-  parentEntry->isdir = TRUE;
-  parentEntry->unused = FALSE;
-  parentEntry->firstblock = currentDirIndex;
-  strcpy(parentEntry->name, "..");
-  newDir->dir.entrylist[0] = *parentEntry;
-
-  // Add the entry to the parent and write to disk.
-  parent->dir.entrylist[free_entry_index] = *newEntry;
-  writeblock(parent, currentDirIndex, TYPE_DIR);
-  writeblock(newDir, next_index, TYPE_DIR);
-}
-
-// Returns index of the first block belonging to a directory (-1 if not found).
-int dir_index(const char *dirname)
-{
-  int found = FALSE;
-  int index = -1;
-  diskblock_t *temp = malloc(sizeof(diskblock_t));
-
-  // Search the virtual disk for the folder.
-  // Load in each block as a directory, and search it's entrylist.
-  for(int y=0; y<MAXBLOCKS; y++) {
-    readblock(temp, y, TYPE_DIR);
-    if(temp->dir.isDir == TRUE) {
-      for(int i=0; i<DIRENTRYCOUNT; i++) {
-        if(temp->dir.entrylist[i].unused == FALSE) {
-          if(strcmp(temp->dir.entrylist[i].name, dirname) == 0) { // found it.
-            found = TRUE; // temp now points to the first dir in the path.
-            index = temp->dir.entrylist[i].firstblock;
-          }
-        }
-      }
-    }
-    if(found == TRUE) break;
+  fatentry_t block;
+  int slot = dir_add(currentDirIndex, newEntry, 0, &block);
+  free(newEntry);
+  if(slot < 0) {
+    printf("(add_dir) disk is full, %s not added.\n", folder_name);
+    free_block(next_index);
+    updateFAT();
+    return;
   }
-
-  //free(name);
-  //free(temp);
-  return index;
+  dcache_forget(currentDirIndex, folder_name);
+  dirindex_add(currentDirIndex, folder_name, block, slot);
 }
 
 // Returns the name of the directory at given index.
 char *get_dir_name(int dir_index)
 {
-  diskblock_t *temp = malloc(sizeof(diskblock_t));
+  static char name[MAXNAME]; // the block is only borrowed, so the name is copied out.
   char *ch = "None";
-  for(int i=0; i<MAXBLOCKS; i++) {
-    readblock(temp, i, TYPE_DIR);
-    if(temp->dir.isDir == TRUE) {
-      for(int y=0; y<DIRENTRYCOUNT; y++) {
-        if(temp->dir.entrylist[y].firstblock == dir_index) {
-          return temp->dir.entrylist[y].name;
+  for(fatentry_t i=0; i<MAXBLOCKS; i++) {
+    const diskblock_t *temp = pinblock(i);
+    if(temp->dir.isDir == TRUE && temp->dir.level == 0) {
+      for(int y=0; y<temp->dir.nextEntry && y<MAXDIRSLOTS; y++) {
+        const direntry_t *entry = dir_entry(&temp->dir, y);
+        if(entry && entry->firstblock == dir_index) {
+          strcpy(name, entry->name);
+          unpinblock(i);
+          return name;
         }
       }
     }
+    unpinblock(i);
   }
   return ch;
 }
@@ -908,49 +3432,21 @@ int get_path_dir_no(char **dirs)
   return i;
 }
 
-// Returns the next free entry in a directory's entrylist.
-// If there are no free entries, then it allocates another dirblock_t to the directory
-// and updates the FAT accordingly.
-int next_free_dir_entry(dirblock_t *folder) {
-  int free_index = -1;
-  for(int i=0; i<DIRENTRYCOUNT; i++) {
-    if(folder->entrylist[i].unused == TRUE) {
-      free_index = i;
-      break;
-    }
-  }
-
-  if(free_index == -1) {
-    // run out of space, so allocate new dirblock to the directory.
-    free_index = next_free_fat();
-    diskblock_t new_block;
-    init_block(&new_block, TYPE_DIR);
-    writeblock(&new_block, free_index, TYPE_DIR);
-    FAT[currentDirIndex] = free_index;
-    //free_index = 0; // pos 0 of the new dirblock's entrylist.
-  }
-
-  return free_index;
-}
-
-// Prints the entrylist of a given directory.
+// Prints the entries of a given directory.
 void print_dir_contents(fatentry_t dir_index) {
-  diskblock_t temp;
-  readblock(&temp, dir_index, TYPE_DIR);
   printf("Current directory contents:\n");
-  for(int i=0; i<DIRENTRYCOUNT; i++) {
-    printf("%s\n", temp.dir.entrylist[i].name);
+  for(fatentry_t leaf = dir_first_leaf(dir_index); leaf > 0; ) {
+    const diskblock_t *temp = pinblock(leaf);
+    for(int pos=0; pos<temp->dir.entryCount; pos++) printf("%s\n", dir_nth(&temp->dir, pos)->name);
+    fatentry_t next = temp->dir.nextLeaf;
+    unpinblock(leaf);
+    leaf = next;
   }
 }
 
-// Prints the entrylist of the current directory.
+// Prints the entries of the current directory.
 void ls_current_dir() {
-  diskblock_t temp;
-  readblock(&temp, currentDirIndex, TYPE_DIR);
-  printf("Current directory contents:\n");
-  for(int i=0; i<DIRENTRYCOUNT; i++) {
-    printf("%s\n", temp.dir.entrylist[i].name);
-  }
+  print_dir_contents(currentDirIndex);
 }
 
 // Sets currentDirIndex to given index.
@@ -980,46 +3476,41 @@ void mychdir(const char *path)
   }
   else {
     // Detect if any of the directories in the path are missing.
-    int i = 0;
-    while(1) {
-      if(strcmp(directories[i], "") == 0) break;
-      strcpy(dir_name, directories[i]);
-      if(dir_index(dir_name) == -1) {
-        printf("(mychdir) no such directory %s\n", path);
-        return;
-      }
-      i++;
+    fatentry_t dir = resolve_path(path, NULL, FALSE);
+    if(dir < 0) {
+      printf("(mychdir) no such directory %s\n", path);
+      return;
     }
 
     // Get the last directory from the path.
-    i = 0;
+    int i = 0;
     while(1) {
       if(strcmp(directories[i], "") == 0) break;
       strcpy(dir_name, directories[i]);
       i++;
     }
     printf("(mychdir) changed directory to %s\n", dir_name);
-    change_dir(dir_index(dir_name));
+    change_dir(dir);
     //printf("currentDirIndex is now at %d (%s)\n", currentDirIndex, dir_name);
   }
 }
 
-// Delete the directory with given name, by setting it's entry to unused.
+// Delete the directory with given name, by deleting its entry (and freeing its block).
 void delete_dir(const char *dirname)
 {
-  diskblock_t *temp_b = malloc(sizeof(diskblock_t));
-  readblock(temp_b, currentDirIndex, TYPE_DIR);
-  for(int i=0; i<DIRENTRYCOUNT; i++) {
-    if(temp_b->dir.entrylist[i].unused == FALSE) {
-      if(temp_b->dir.entrylist[i].isdir == TRUE && (strcmp(temp_b->dir.entrylist[i].name, dirname) == 0)) {
-        temp_b->dir.entrylist[i].unused = TRUE;
-        //strcpy(temp_b->dir.entrylist[i].name, "[empty]");
-        FAT[temp_b->dir.entrylist[i].firstblock] = UNUSED;
-        writeblock(temp_b, currentDirIndex, TYPE_DIR);
-        return;
-      }
-    }
-  }
+  fatentry_t block;
+  int slot = dir_find(currentDirIndex, dirname, &block);
+  if(slot < 0) return;
+  const direntry_t *entry = dir_entry(&pinblock(block)->dir, slot);
+  int isdir = entry->isdir;
+  fatentry_t first = entry->firstblock;
+  unpinblock(block);
+  if(isdir != TRUE) return;
+  dcache_forget_dir(first);
+  dirindex_free(first);
+  free_chain(first);
+  updateFAT();
+  dir_release_entry(currentDirIndex, block, slot);
 }
 
 // Removes a directory, if it is empty.
@@ -1030,11 +3521,7 @@ void myrmdir(const char *path)
     return;
   }
 
-  // Break down the path.
-  char *dir_name = malloc(sizeof(char) * MAXNAME);
-  char *temp_p = malloc(sizeof(char) * MAXNAME); // to preserve const path from parse_path(), which uses strtok().
-  strcpy(temp_p, path);
-  char **directories = parse_path(temp_p);
+  char dir_name[MAXNAME];
   fatentry_t prev_dir_index = currentDirIndex;
 
   // Check if root.
@@ -1042,35 +3529,665 @@ void myrmdir(const char *path)
     change_dir(rootDirIndex);
   }
   else {
-    // Detect if any of the directories in the path are missing.
-    int i = 0;
-    while(1) {
-      if(strcmp(directories[i], "") == 0) break;
-      strcpy(dir_name, directories[i]);
-      if(dir_index(dir_name) == -1) {
-        printf("(myrmdir) no such directory %s\n", path);
-        return;
-      }
-      i++;
+    // Find the directory holding the one to delete, and check that it's there.
+    fatentry_t parent = resolve_path(path, dir_name, FALSE);
+    if(parent < 0 || strcmp(dir_name, ".") == 0 || strcmp(dir_name, "..") == 0 || dir_lookup(parent, dir_name) < 0) {
+      printf("(myrmdir) no such directory %s\n", path);
+      return;
     }
 
-    // Get the last directory from the path.
-    i = 0;
-    while(1) {
-      if(strcmp(directories[i], "") == 0) break;
-      strcpy(dir_name, directories[i]);
-      i++;
-    }
-    // Delete it by setting unused to true.
+    // Delete it.
     printf("(myrmdir) deleted directory %s\n", path);
-    diskblock_t *current = malloc(sizeof(diskblock_t));
-    readblock(current, dir_index(dir_name), TYPE_DIR);
-    change_dir(current->dir.entrylist[0].firstblock);
+    change_dir(parent);
     delete_dir(dir_name);
     change_dir(prev_dir_index);
   }
 }
 
+/* --------  DIRECTORY ENTRY FUNCTIONS ---------------
+
+  A directory block holds variable-length entries (see direntry_t), so it is laid out as a slotted
+  page: the slots, after the header, locate the entries, which are packed down from the end of the
+  block. A deleted entry's slot goes on a list for reuse and its space is reclaimed by compacting
+  the block, which moves entries but never renumbers slots, so a slot (as kept by open files and
+  the hash index) names its entry for as long as the block holds it. The block also keeps its
+  slots in name order, so it can be searched by halving and read out sorted.
+  ------------------------------------------
+*/
+
+// Returns the entry in a slot of a directory block, or NULL if the slot is free.
+direntry_t *dir_entry(const dirblock_t *dir, int slot)
+{
+  if(slot < 0 || slot >= dir->nextEntry || (dir->slots[slot].entry & DIRSLOTFREE)) return NULL;
+  return (direntry_t *) ((Byte *) dir + dir->slots[slot].entry * DIRENTRYALIGN);
+}
+
+// The length of an entry's name, read no further than the entry itself.
+size_t dir_namelen(const direntry_t *entry)
+{
+  return strnlen(entry->name, entry->entrylength - offsetof(direntry_t, name));
+}
+
+// Returns a directory block's pos'th entry in name order.
+direntry_t *dir_nth(const dirblock_t *dir, int pos)
+{
+  return dir_entry(dir, dir->slots[pos].order);
+}
+
+// Returns the position, in a directory block's name order, of the first entry whose name is not
+// less than name (entryCount if there is none).
+int dir_search(const dirblock_t *dir, const char *name)
+{
+  int low = 0, high = dir->entryCount;
+  while(low < high) {
+    int mid = (low + high) / 2;
+    if(strcmp(dir_nth(dir, mid)->name, name) < 0) low = mid + 1;
+    else high = mid;
+  }
+  return low;
+}
+
+// Pack a directory block's entries up against the end of the block, so the space of deleted
+// entries joins the gap between them and the slots.
+void dir_compact(dirblock_t *dir)
+{
+  Byte *copy = malloc(BLOCKSIZE);
+  memcpy(copy, dir, BLOCKSIZE);
+  int start = BLOCKSIZE;
+  for(int slot=0; slot<dir->nextEntry; slot++) {
+    if(dir->slots[slot].entry & DIRSLOTFREE) continue;
+    const direntry_t *entry = (const direntry_t *) (copy + dir->slots[slot].entry * DIRENTRYALIGN);
+    start -= entry->entrylength;
+    memcpy((Byte *) dir + start, entry, entry->entrylength);
+    dir->slots[slot].entry = start / DIRENTRYALIGN;
+  }
+  dir->entryStart = start;
+  dir->freeBytes = 0;
+  free(copy);
+}
+
+// Add a copy of an entry (its name, and its data if it is an inline file) to a directory block,
+// compacting the block if need be. Returns its slot, or -1 if the block has no room for it.
+int dir_insert(dirblock_t *dir, const direntry_t *entry)
+{
+  int datalen = entry->inlined ? (int) entry->filelength : 0;
+  int used = offsetof(direntry_t, name) + strlen(entry->name) + 1 + datalen;
+  int size = DIRENTRY_SIZE(strlen(entry->name), datalen);
+  int newslot = (dir->freeEntry == 0); // (otherwise a freed slot is reused.)
+  int gap = dir->entryStart - (int) DIRHEADERSIZE - (dir->nextEntry + newslot) * (int) sizeof(dirslot_t);
+  if(gap < size) {
+    if(gap + dir->freeBytes < size) return -1;
+    dir_compact(dir);
+  }
+
+  int pos = dir_search(dir, entry->name);
+  int slot;
+  if(newslot) slot = dir->nextEntry++;
+  else {
+    slot = dir->freeEntry - 1;
+    dir->freeEntry = dir->slots[slot].entry & ~DIRSLOTFREE;
+  }
+  dir->entryStart -= size;
+  direntry_t *copy = (direntry_t *) ((Byte *) dir + dir->entryStart);
+  memset(copy, 0, size);
+  memcpy(copy, entry, used);
+  copy->entrylength = size;
+  dir->slots[slot].entry = dir->entryStart / DIRENTRYALIGN;
+  for(int i = dir->entryCount; i > pos; i--) dir->slots[i].order = dir->slots[i-1].order;
+  dir->slots[pos].order = slot;
+  dir->entryCount++;
+  return slot;
+}
+
+// Delete the entry in a slot of a directory block, putting the slot on the block's list of freed ones.
+void dir_remove(dirblock_t *dir, int slot)
+{
+  const direntry_t *entry = dir_entry(dir, slot);
+  if(entry == NULL) return;
+  int pos = dir_search(dir, entry->name);
+  while(dir->slots[pos].order != slot) pos++; // (past any others of the same name.)
+  dir->entryCount--;
+  for(int i = pos; i < dir->entryCount; i++) dir->slots[i].order = dir->slots[i+1].order;
+  if((const Byte *) entry - (const Byte *) dir == dir->entryStart) dir->entryStart += entry->entrylength; // (the lowest entry's space is just part of the gap again.)
+  else dir->freeBytes += entry->entrylength;
+  dir->slots[slot].entry = DIRSLOTFREE | dir->freeEntry;
+  dir->freeEntry = slot + 1;
+}
+
+// Make room in the entry in a slot of a directory block for datalen bytes of inline data, moving
+// the entry (and compacting the block) if it has to grow. Returns 0, or -1 if the block has no room
+// for it, in which case the entry is left as it was.
+int dir_resize(dirblock_t *dir, int slot, int datalen)
+{
+  direntry_t *entry = dir_entry(dir, slot);
+  int size = DIRENTRY_SIZE(strlen(entry->name), datalen);
+  int oldsize = entry->entrylength;
+  if(size <= oldsize) return 0; // (a shrinking entry keeps its room.)
+  int gap = dir->entryStart - (int) DIRHEADERSIZE - dir->nextEntry * (int) sizeof(dirslot_t);
+  if(gap + dir->freeBytes + oldsize < size) return -1;
+
+  // Take the entry out, keeping its slot, and put it back in a space of the new size.
+  Byte old[DIRENTRYMAX];
+  memcpy(old, entry, oldsize);
+  if((Byte *) entry - (Byte *) dir == dir->entryStart) dir->entryStart += oldsize;
+  else dir->freeBytes += oldsize;
+  dir->slots[slot].entry = DIRSLOTFREE; // (so compacting passes it over.)
+  gap = dir->entryStart - (int) DIRHEADERSIZE - dir->nextEntry * (int) sizeof(dirslot_t);
+  if(gap < size) dir_compact(dir);
+  dir->entryStart -= size;
+  entry = (direntry_t *) ((Byte *) dir + dir->entryStart);
+  memset(entry, 0, size);
+  memcpy(entry, old, oldsize);
+  entry->entrylength = size;
+  dir->slots[slot].entry = dir->entryStart / DIRENTRYALIGN;
+  return 0;
+}
+
+/* --------  DIRECTORY TREE FUNCTIONS ---------------
+
+  A directory is a B+tree of directory blocks keyed by name (see dirblock_t). Its first block is
+  always the root, since that is what names the directory, so when the root fills its entries move
+  down into a new block beneath it. Any other full block is split in two by name, the new block
+  taking the upper half and getting a key in the parent. Blocks are not merged when entries are
+  deleted; a block left empty stays in the tree until the directory goes. Every block of the tree
+  is kept in the directory's FAT chain (the tree gives their order), so freeing the chain frees
+  the directory and walking it visits every entry.
+  ------------------------------------------
+*/
+
+// The node at a level of a directory's tree whose names take in name (its leaf, at level 0).
+fatentry_t dir_descend(fatentry_t dir_index, const char *name, int level)
+{
+  fatentry_t node = dir_index;
+  for(;;) {
+    const diskblock_t *dir = pinblock(node);
+    if(dir->dir.level <= level) {
+      unpinblock(node);
+      return node;
+    }
+    int pos = dir_search(&dir->dir, name);
+    const direntry_t *key = (pos < dir->dir.entryCount) ? dir_nth(&dir->dir, pos) : NULL;
+    if(key == NULL || strncmp(key->name, name, dir_namelen(key) + 1) != 0) pos--; // (the leftmost key is "", so pos stays >= 0.)
+    fatentry_t child = dir_nth(&dir->dir, pos)->firstblock;
+    unpinblock(node);
+    node = child;
+  }
+}
+
+// The first of a directory's leaves in name order.
+fatentry_t dir_first_leaf(fatentry_t dir_index)
+{
+  return dir_descend(dir_index, "", 0);
+}
+
+// Number of entries in a directory.
+long dir_count(fatentry_t dir_index)
+{
+  long count = 0;
+  for(fatentry_t leaf = dir_first_leaf(dir_index); leaf > 0; ) {
+    const diskblock_t *dir = pinblock(leaf);
+    count += dir->dir.entryCount;
+    fatentry_t next = dir->dir.nextLeaf;
+    unpinblock(leaf);
+    leaf = next;
+  }
+  return count;
+}
+
+// Add a copy of an entry to a directory, in the node at the given level (0 for the entries
+// themselves) whose names take in its name, splitting full nodes to make room. Returns its slot,
+// with its block in *block, or -1 if the disk is full.
+int dir_add(fatentry_t dir_index, const direntry_t *entry, int level, fatentry_t *block)
+{
+  for(;;) {
+    fatentry_t node = dir_descend(dir_index, entry->name, level);
+    diskblock_t *dir = pinblock_rw(node);
+    int slot = dir_insert(&dir->dir, entry);
+    if(slot >= 0) {
+      unpinblock_rw(node);
+      *block = node;
+      return slot;
+    }
+    unpinblock(node);
+
+    // The node is full: make sure the blocks for a split at every level, and a new root, are there.
+    int height = pinblock(dir_index)->dir.level;
+    unpinblock(dir_index);
+    if(free_block_count() < height + 2) return -1;
+    if(node == dir_index) {
+      dir_push_root(dir_index);
+      continue;
+    }
+    direntry_t *key = calloc(1, DIRENTRYMAX);
+    key->firstblock = dir_split(dir_index, node, key->name);
+    fatentry_t parent;
+    dir_add(dir_index, key, level + 1, &parent);
+    free(key);
+  }
+}
+
+// Split a full directory block other than the root, moving the upper half of its entries (by name,
+// and about half their bytes) to a new block, after it in the directory's chain and, for a leaf,
+// among the leaves. Returns the new block, with the name of its first entry (its key) in key.
+fatentry_t dir_split(fatentry_t dir_index, fatentry_t block, char *key)
+{
+  fatentry_t right = next_free_fat();
+  diskblock_t *left = pinblock_rw(block);
+  diskblock_t *dir = pinblock_rw(right);
+  init_block(dir, TYPE_DIR);
+  dir->dir.level = left->dir.level;
+
+  // Take entries from the top of the order until about half the bytes in use are going.
+  int inuse = BLOCKSIZE - left->dir.entryStart - left->dir.freeBytes;
+  int first = left->dir.entryCount, moving = 0;
+  while(first > 1 && moving < inuse / 2) moving += dir_nth(&left->dir, --first)->entrylength;
+
+  for(int pos = first; pos < left->dir.entryCount; pos++) {
+    int slot = left->dir.slots[pos].order;
+    const direntry_t *entry = dir_entry(&left->dir, slot);
+    int newslot = dir_insert(&dir->dir, entry);
+    if(left->dir.level == 0) {
+      dirindex_move(dir_index, entry->name, block, slot, right, newslot);
+      file_entry_moved(block, slot, right, newslot);
+    }
+  }
+  while(left->dir.entryCount > first) dir_remove(&left->dir, left->dir.slots[left->dir.entryCount - 1].order);
+  strcpy(key, dir_nth(&dir->dir, 0)->name);
+
+  if(dir->dir.level == 0) {
+    dir->dir.nextLeaf = left->dir.nextLeaf;
+    left->dir.nextLeaf = right;
+  }
+  unpinblock_rw(block);
+  unpinblock_rw(right);
+  setFAT(right, FAT[dir_index]);
+  setFAT(dir_index, right);
+  updateFAT();
+  return right;
+}
+
+// Move everything in a directory's root down into a new block, its only child, leaving the root
+// a level higher with room for the keys of that block and those it will be split into.
+// Returns the new block, or -1 if the disk is full.
+fatentry_t dir_push_root(fatentry_t dir_index)
+{
+  fatentry_t child = next_free_fat();
+  if(child < 0) return -1;
+  diskblock_t *root = pinblock_rw(dir_index);
+  diskblock_t *dir = pinblock_rw(child);
+  memcpy(dir, root, BLOCKSIZE);
+  dir->dir.index = 0; // (the hash index stays with the root.)
+  dir->dir.indexslots = 0;
+  dir->dir.indexused = 0;
+
+  fatentry_t index = root->dir.index, indexslots = root->dir.indexslots, indexused = root->dir.indexused;
+  int level = root->dir.level;
+  init_block(root, TYPE_DIR);
+  root->dir.level = level + 1;
+  root->dir.index = index;
+  root->dir.indexslots = indexslots;
+  root->dir.indexused = indexused;
+  direntry_t *key = calloc(1, DIRENTRYMAX); // (named "", as the leftmost.)
+  key->firstblock = child;
+  dir_insert(&root->dir, key);
+  free(key);
+  unpinblock_rw(dir_index);
+
+  if(level == 0) { // The entries keep their slots, in another block.
+    for(int slot=0; slot<dir->dir.nextEntry; slot++) {
+      const direntry_t *entry = dir_entry(&dir->dir, slot);
+      if(entry == NULL) continue;
+      dirindex_move(dir_index, entry->name, dir_index, slot, child, slot);
+      file_entry_moved(dir_index, slot, child, slot);
+    }
+  }
+  unpinblock_rw(child);
+  setFAT(child, FAT[dir_index]);
+  setFAT(dir_index, child);
+  updateFAT();
+  return child;
+}
+
+/* --------  DIRECTORY INDEX FUNCTIONS ---------------
+
+  Once a directory has used DIRINDEXMIN entries, or outgrown its first block, it is given a hash
+  index: an open-addressed table of dirhash_t slots, in a run of contiguous blocks so slot i is
+  found without walking a chain. A lookup hashes the name and goes straight to the entry, where
+  the tree would take a block per level. The table is rebuilt twice the size when it is
+  three-quarters full (tombstones included), and a big directory found without one has it built
+  on first use. Entries moved by splitting a block are moved in the index too. Smaller
+  directories are simply searched.
+  ------------------------------------------
+*/
+
+// FNV-1a hash of a name.
+uint32_t name_hash(const char *name)
+{
+  uint32_t hash = 2166136261u;
+  for(const unsigned char *c = (const unsigned char *) name; *c; c++) hash = (hash ^ *c) * 16777619u;
+  return hash;
+}
+
+// Find the entry called name in the directory at dir_index, through its hash index if it has one
+// (otherwise down its tree). Returns the entry's slot, with its block in *block, or -1.
+int dir_find(fatentry_t dir_index, const char *name, fatentry_t *block)
+{
+  size_t len = strlen(name) + 1;
+  const diskblock_t *dir = pinblock(dir_index);
+  fatentry_t index = dir->dir.index, slots = dir->dir.indexslots;
+  int big = (dir->dir.level > 0 || dir->dir.nextEntry >= DIRINDEXMIN);
+  unpinblock(dir_index);
+  if(index == 0) {
+    *block = dir_descend(dir_index, name, 0);
+    const diskblock_t *leaf = pinblock(*block);
+    int pos = dir_search(&leaf->dir, name), found = -1;
+    if(pos < leaf->dir.entryCount && strcmp(dir_nth(&leaf->dir, pos)->name, name) == 0) found = leaf->dir.slots[pos].order;
+    unpinblock(*block);
+    if(big && slots == 0) dirindex_build(dir_index); // it should have an index, but has lost it (rather than failed to get one).
+    return found;
+  }
+
+  uint32_t hash = name_hash(name);
+  for(fatentry_t i = hash % slots, n = 0; n < slots; i = (i + 1) % slots, n++) {
+    fatentry_t hashblock = index + i / DIRHASHCOUNT;
+    dirhash_t h = ((const dirhash_t *) pinblock(hashblock)->data)[i % DIRHASHCOUNT];
+    unpinblock(hashblock);
+    if(h.block == 0) break; // an empty slot ends the search.
+    if(h.block == UNUSED || h.hash != hash) continue;
+    const direntry_t *entry = dir_entry(&pinblock(h.block)->dir, h.slot);
+    int match = (entry && memcmp(entry->name, name, len) == 0);
+    unpinblock(h.block);
+    if(match) {
+      *block = h.block;
+      return h.slot;
+    }
+  }
+  return -1;
+}
+
+// Free the entry at slot in a directory block: it is taken out of the hash index and the dentry
+// cache, and deleted from the block (see dir_remove). Files still open on it are cut loose from it,
+// since the slot may be given to another entry.
+void dir_release_entry(fatentry_t dir_index, fatentry_t block, int slot)
+{
+  diskblock_t *dir = pinblock_rw(block);
+  const direntry_t *entry = dir_entry(&dir->dir, slot);
+  dcache_forget(dir_index, entry->name);
+  dirindex_remove(dir_index, entry->name, block, slot);
+  dir_remove(&dir->dir, slot);
+  unpinblock_rw(block);
+  file_entry_moved(block, slot, block, -1);
+}
+
+// Add an entry, already written at slot in block, to its directory's hash index. A directory that
+// has grown big enough is given an index, and one whose index is getting full a bigger one.
+void dirindex_add(fatentry_t dir_index, const char *name, fatentry_t block, int slot)
+{
+  const diskblock_t *dir = pinblock(dir_index);
+  fatentry_t index = dir->dir.index, slots = dir->dir.indexslots, used = dir->dir.indexused;
+  int big = (dir->dir.level > 0 || dir->dir.nextEntry >= DIRINDEXMIN);
+  unpinblock(dir_index);
+  if(index == 0 && slots < 0) { // Its index could not be built: try again once it has grown by as much again.
+    int retry = (++pinblock_rw(dir_index)->dir.indexused >= -slots);
+    unpinblock_rw(dir_index);
+    if(retry) dirindex_build(dir_index);
+    return;
+  }
+  if(index == 0 || (used + 1) * 4 > slots * 3) {
+    if(index != 0 || big) dirindex_build(dir_index); // (which takes in the new entry.)
+    return;
+  }
+
+  uint32_t hash = name_hash(name);
+  for(fatentry_t i = hash % slots; ; i = (i + 1) % slots) {
+    fatentry_t hashblock = index + i / DIRHASHCOUNT;
+    dirhash_t *h = &((dirhash_t *) pinblock_rw(hashblock)->data)[i % DIRHASHCOUNT];
+    if(h->block > 0) {
+      unpinblock(hashblock);
+      continue;
+    }
+    int fresh = (h->block == 0); // (rather than a tombstone.)
+    *h = (dirhash_t) { hash, block, slot };
+    unpinblock_rw(hashblock);
+    if(fresh) {
+      pinblock_rw(dir_index)->dir.indexused++;
+      unpinblock_rw(dir_index);
+    }
+    return;
+  }
+}
+
+// Take the entry at slot in block out of its directory's hash index, leaving a tombstone.
+void dirindex_remove(fatentry_t dir_index, const char *name, fatentry_t block, int slot)
+{
+  const diskblock_t *dir = pinblock(dir_index);
+  fatentry_t index = dir->dir.index, slots = dir->dir.indexslots;
+  unpinblock(dir_index);
+  if(index == 0) return;
+
+  uint32_t hash = name_hash(name);
+  for(fatentry_t i = hash % slots, n = 0; n < slots; i = (i + 1) % slots, n++) {
+    fatentry_t hashblock = index + i / DIRHASHCOUNT;
+    dirhash_t *h = &((dirhash_t *) pinblock_rw(hashblock)->data)[i % DIRHASHCOUNT];
+    if(h->block == block && h->slot == slot) {
+      h->block = UNUSED;
+      unpinblock_rw(hashblock);
+      return;
+    }
+    int end = (h->block == 0);
+    unpinblock(hashblock);
+    if(end) return;
+  }
+}
+
+// Point a directory's hash index at the new place of an entry that has moved from slot in block.
+void dirindex_move(fatentry_t dir_index, const char *name, fatentry_t block, int slot, fatentry_t newblock, int newslot)
+{
+  const diskblock_t *dir = pinblock(dir_index);
+  fatentry_t index = dir->dir.index, slots = dir->dir.indexslots;
+  unpinblock(dir_index);
+  if(index == 0) return;
+
+  uint32_t hash = name_hash(name);
+  for(fatentry_t i = hash % slots, n = 0; n < slots; i = (i + 1) % slots, n++) {
+    fatentry_t hashblock = index + i / DIRHASHCOUNT;
+    dirhash_t *h = &((dirhash_t *) pinblock_rw(hashblock)->data)[i % DIRHASHCOUNT];
+    if(h->block == block && h->slot == slot) {
+      h->block = newblock;
+      h->slot = newslot;
+      unpinblock_rw(hashblock);
+      return;
+    }
+    int end = (h->block == 0);
+    unpinblock(hashblock);
+    if(end) return;
+  }
+}
+
+// Build a directory's hash index afresh, with room for twice its entries, in place of any it had.
+// Returns 0, or -1 if there is no run of free blocks for it. The directory is then searched down its
+// tree, and records the failure so that the build is only tried again once it has grown (see dirindex_add).
+int dirindex_build(fatentry_t dir_index)
+{
+  diskblock_t *dir = pinblock_rw(dir_index);
+  fatentry_t live = dir_count(dir_index);
+  fatentry_t blocks = (2 * live + DIRHASHCOUNT - 1) / DIRHASHCOUNT;
+  if(blocks < 1) blocks = 1;
+  fatentry_t start = reserve_run(blocks); // (it has to be contiguous.)
+  if(dir->dir.index > 0) free_chain(dir->dir.index);
+  dir->dir.index = 0;
+  dir->dir.indexslots = 0;
+  dir->dir.indexused = 0;
+  if(start < 0) {
+    dir->dir.indexslots = -(live > 0 ? live : 1); // (so it is not tried again on every lookup.)
+    unpinblock_rw(dir_index);
+    updateFAT();
+    return -1;
+  }
+
+  for(fatentry_t b = start; b < start + blocks; b++) {
+    init_block(pinblock_rw(b), TYPE_DATA);
+    unpinblock_rw(b);
+    setFAT(b, (b + 1 < start + blocks) ? b + 1 : ENDOFCHAIN);
+  }
+  fatentry_t slots = blocks * DIRHASHCOUNT;
+  for(fatentry_t leaf = dir_first_leaf(dir_index); leaf > 0; ) {
+    const diskblock_t *entries = pinblock(leaf);
+    for(int i=0; i<entries->dir.nextEntry; i++) {
+      const direntry_t *entry = dir_entry(&entries->dir, i);
+      if(entry == NULL) continue;
+      uint32_t hash = name_hash(entry->name);
+      for(fatentry_t s = hash % slots; ; s = (s + 1) % slots) {
+        fatentry_t hashblock = start + s / DIRHASHCOUNT;
+        dirhash_t *h = &((dirhash_t *) pinblock_rw(hashblock)->data)[s % DIRHASHCOUNT];
+        int empty = (h->block == 0);
+        if(empty) *h = (dirhash_t) { hash, leaf, i };
+        unpinblock_rw(hashblock);
+        if(empty) break;
+      }
+    }
+    fatentry_t next = entries->dir.nextLeaf;
+    unpinblock(leaf);
+    leaf = next;
+  }
+  dir->dir.index = start;
+  dir->dir.indexslots = slots;
+  dir->dir.indexused = live;
+  unpinblock_rw(dir_index);
+  updateFAT();
+  return 0;
+}
+
+// Free a directory's hash index (when the directory is deleted).
+void dirindex_free(fatentry_t dir_index)
+{
+  diskblock_t *dir = pinblock_rw(dir_index);
+  if(dir->dir.index > 0) free_chain(dir->dir.index);
+  dir->dir.index = 0;
+  dir->dir.indexslots = 0;
+  dir->dir.indexused = 0;
+  unpinblock_rw(dir_index);
+}
+
+/* --------  PATH FUNCTIONS ---------------
+
+  Paths are resolved a component at a time, from the root directory for an absolute path and from
+  the current directory otherwise, with "." and ".." understood. Each step looks the name up in its
+  parent through the dentry cache, a fixed table of (parent block, name) -> directory entries that
+  also remembers names with no directory behind them, so walking a path costs a cache hit per
+  component. An entry is dropped when its name is added to or removed from its directory, and all
+  those in or for a directory when it is deleted; the whole cache goes when another disk is loaded.
+  ------------------------------------------
+*/
+
+dentry_t dentryCache[DENTRYCACHESIZE];
+
+// Empty the dentry cache.
+void dcache_clear(void)
+{
+  memset(dentryCache, 0, sizeof(dentryCache));
+}
+
+// The dentry cache slot for a name in the directory at parent.
+int dentry_slot(fatentry_t parent, const char *name)
+{
+  return (name_hash(name) ^ (uint32_t) parent * 2654435761u) % DENTRYCACHESIZE;
+}
+
+// Drop the cached answer, if any, for a name in the directory at parent.
+void dcache_forget(fatentry_t parent, const char *name)
+{
+  dentry_t *d = &dentryCache[dentry_slot(parent, name)];
+  if(d->parent == parent && strcmp(d->name, name) == 0) d->parent = 0;
+}
+
+// Drop every cached answer for names in, or leading to, the directory at dir (which is being deleted).
+void dcache_forget_dir(fatentry_t dir)
+{
+  for(int i=0; i<DENTRYCACHESIZE; i++) {
+    if(dentryCache[i].parent == dir || dentryCache[i].block == dir) dentryCache[i].parent = 0;
+  }
+}
+
+// Returns the first block of the directory called name in the directory at parent (-1 if there is none).
+fatentry_t dir_lookup(fatentry_t parent, const char *name)
+{
+  if(strcmp(name, ".") == 0) return parent;
+  if(strcmp(name, "..") == 0 && parent == rootDirIndex) return parent; // (the root has no ".." entry.)
+
+  dentry_t *d = &dentryCache[dentry_slot(parent, name)];
+  if(d->parent == parent && strcmp(d->name, name) == 0) {
+    diskStats.dentryhits++;
+    return d->block;
+  }
+  diskStats.dentrymisses++;
+
+  fatentry_t block, found = -1;
+  int slot = dir_find(parent, name, &block);
+  if(slot >= 0) {
+    const direntry_t *entry = dir_entry(&pinblock(block)->dir, slot);
+    if(entry->isdir == TRUE) found = entry->firstblock;
+    unpinblock(block);
+  }
+  d->parent = parent;
+  d->block = found;
+  strcpy(d->name, name);
+  return found;
+}
+
+// Copy the next component of a path into name, moving *path past it.
+// Returns its length, 0 if there are no more, or -1 if it is too long for a name.
+int path_next(const char **path, char *name)
+{
+  const char *p = *path;
+  while(*p == '/') p++;
+  int len = 0;
+  while(p[len] != '/' && p[len] != '\0') len++;
+  *path = p + len;
+  if(len >= MAXNAME) return -1;
+  memcpy(name, p, len);
+  name[len] = '\0';
+  return len;
+}
+
+// Resolve a path to the first block of the directory it names. If last is given, the final
+// component is copied into it rather than resolved, and the directory holding it is returned
+// (last is "" if the path has no components). Missing directories are made on the way if create
+// is set (as mymkdir does). Returns -1 if a directory on the path doesn't exist (or, when creating,
+// if one of its names is taken by a file).
+fatentry_t resolve_path(const char *path, char *last, int create)
+{
+  fatentry_t dir = (path[0] == '/') ? rootDirIndex : currentDirIndex;
+  char name[MAXNAME], next[MAXNAME];
+  int len = path_next(&path, name);
+  if(last) last[0] = '\0';
+  while(len > 0) {
+    int nextlen = path_next(&path, next);
+    if(nextlen == 0 && last) {
+      strcpy(last, name);
+      return dir;
+    }
+    fatentry_t child = dir_lookup(dir, name);
+    fatentry_t block;
+    if(child < 0 && create && dir_find(dir, name, &block) >= 0) { // (the name is taken by a file.)
+      printf("(resolve_path) %s is not a directory.\n", name);
+      return -1;
+    }
+    if(child < 0 && create) {
+      fatentry_t original_dir_index = currentDirIndex;
+      currentDirIndex = dir; // add_dir() adds to the current directory.
+      add_dir(name);
+      currentDirIndex = original_dir_index;
+      child = dir_lookup(dir, name);
+    }
+    if(child < 0) return -1;
+    dir = child;
+    strcpy(name, next);
+    len = nextlen;
+  }
+  return (len < 0) ? -1 : dir;
+}
+
 /* --------  UTILITY FUNCTIONS ---------------
 
   Misc. utility functions for tidier code.
@@ -1080,7 +4197,7 @@ void myrmdir(const char *path)
 // Allocates a 2-D array of strings, with given dimensions.
 char **alloc_2d_char_array(int max_x, int max_y)
 {
-  char **file_list = malloc(max_x * max_y * sizeof(char));
+  char **file_list = malloc(max_x * sizeof(char *));
   
   // malloc.
   for(int i=0; i<max_x; i++) {
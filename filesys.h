@@ -9,6 +9,9 @@
 #define FILESYS_H
 
 #include <time.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
 
 #ifndef TRUE
 #define TRUE 1
@@ -17,18 +20,48 @@
 #define FALSE 0
 #endif
 
-#define MAXBLOCKS     1024
-#define BLOCKSIZE     1024
+// The disk geometry is chosen by format_disk() and recorded in the superblock (block 0),
+// so MAXBLOCKS and BLOCKSIZE describe the disk currently in use.
+#define MAXBLOCKS     (superBlock.blockcount)
+#define BLOCKSIZE     (superBlock.blocksize)
 #define FATENTRYCOUNT (BLOCKSIZE / sizeof(fatentry_t))
-#define DIRENTRYCOUNT ((BLOCKSIZE - (2*sizeof(int)) ) / sizeof(direntry_t))
+#define DIRHEADERSIZE (7*sizeof(int) + 4*sizeof(fatentry_t)) // the fields of dirblock_t before slots
+#define DIRHASHCOUNT  (BLOCKSIZE / sizeof(dirhash_t))
+#define DISKSIZE      ((size_t) MAXBLOCKS * BLOCKSIZE)
+
+#define DEFAULTBLOCKS    1024   // geometry used by format()
+#define DEFAULTBLOCKSIZE 1024
+#define MINBLOCKSIZE     1024   // block sizes must be a power of two in this range
+#define MAXBLOCKSIZE     65536  // the block types below are sized for the largest block
+#define MAXFATENTRYCOUNT (MAXBLOCKSIZE / sizeof(fatentry_t))
+#define MAXDIRSLOTS      ((MAXBLOCKSIZE - DIRHEADERSIZE) / sizeof(dirslot_t))
+
+#define FSMAGIC       0x31534644 // "DFS1" on disk.
+#define FSVERSION     6         // 2: directory entries hold exact byte lengths; 3: sparse files (holes); 4: directory hash indexes; 5: variable-length directory entries; 6: B+tree directories
+#define MAXVOLNAME    64
 #define MAXNAME       256
 #define MAXPATHLENGTH 1024
-#define MAXDIRCONTENTS 50 // added by me - directories cannot hold more than 50 items...
+#define FREEREGIONBLOCKS 4096 // blocks per region of the free-space bitmap (a multiple of 64)
+#define MAXOPENFILES  64    // slots in the open file table
+#define FILEBUFSIZE   16384 // write buffer given to each file opened for writing
+#define MINEXTENT     8     // blocks reserved for a growing file the first time; doubled each time after
+#define MAXEXTENT     1024  // ... up to this
+#define EXTENTTRIES   8     // free runs looked at for a full-length reservation
+#define INLINEMAX     128   // files up to this many bytes are kept in their directory entry (see direntry_t)
+#define DIRENTRYALIGN 8     // directory entries start at, and are padded to, a multiple of this many bytes
+#define DIRSLOTFREE   0x8000 // marks a free slot in a directory block (see dirblock_t)
+#define DENTRYCACHESIZE 256 // (parent, name) lookups remembered by the path resolver
+#define DIRINDEXMIN   16    // a directory is given a hash index once this many of its entries have been used
 
 #define UNUSED        -1
 #define ENDOFCHAIN     0
 #define EOF           -1
 
+// A FAT entry below UNUSED marks a hole: the chain skips some blocks, as recorded in holeTable[HOLESLOT(entry)].
+#define HOLE(slot)      (-2 - (slot))
+#define HOLESLOT(entry) (-2 - (entry))
+#define ISHOLE(entry)   ((entry) < UNUSED)
+
 #define TYPE_DATA 0
 #define TYPE_FAT  1
 #define TYPE_DIR  2
@@ -36,112 +69,470 @@
 
 typedef unsigned char Byte;
 
-/* create a type fatentry_t, we set this currently to short (16-bit)
+/* create a type fatentry_t, we set this to int32_t (32-bit), so disks can have up to 2^31 blocks
  */
-typedef short fatentry_t;
+typedef int32_t fatentry_t;
 
 
-// a FAT block is a list of 16-bit entries that form a chain of disk addresses
+// a FAT block is a list of 32-bit entries that form a chain of disk addresses
 
 //const int   fatentrycount = (blocksize / sizeof(fatentry_t));
 
-typedef fatentry_t fatblock_t [ FATENTRYCOUNT ];
+typedef fatentry_t fatblock_t [ MAXFATENTRYCOUNT ];
+
+
+/* the superblock lives in block 0 and records the disk's geometry and layout.
+ * the volume name comes first, where the drive name was always kept.
+ */
+
+typedef struct superblock {
+  char        name [MAXVOLNAME];
+  uint32_t    magic;      // FSMAGIC, so images can be recognised when mounted.
+  int         version;
+  int         blocksize;  // bytes per block.
+  fatentry_t  blockcount; // blocks on the disk.
+  fatentry_t  fatstart;   // first FAT block.
+  fatentry_t  fatblocks;  // number of FAT blocks.
+  fatentry_t  rootdir;    // first block of the root directory.
+  int         clones;     // TRUE once files share blocks (see myclone), so reference counts are needed.
+  fatentry_t  holetable;  // first block of the hole table (0 if it has never been written).
+  int         holeslots;  // entries in the hole table.
+} superblock_t;
+
+extern superblock_t superBlock;
 
 
 /* create a type direntry_t
  */
 
+// Entries are variable-length: the name follows these fields, an inline file's data follows the
+// name's NUL, and the whole is padded to a multiple of DIRENTRYALIGN (see DIRENTRY_SIZE).
+
 typedef struct direntry {
-  int         entrylength; // length of this entry. Can be used with a variable-length name member to determine this entry's size. (which would differ depending on the size of 'name').
-  Byte        isdir; // This is actually redundant - dirblock_t will already tell you it's a directory.
-  Byte        unused;
-  time_t      modtime;
-  int         filelength;
-  fatentry_t  firstblock;
-  char   name [MAXNAME];
+  int64_t     filelength; // exact length of the file in bytes.
+  uint32_t    modtime;
+  fatentry_t  firstblock; // (0 for an inline file)
+  fatentry_t  lastblock;  // the end of the chain, so appending need not walk it.
+  fatentry_t  allocblocks; // blocks in the chain (fewer than the length needs if the file has holes).
+  uint16_t    entrylength; // bytes in this entry (it may have room to spare, if its inline data has shrunk).
+  Byte        isdir;
+  Byte        inlined; // TRUE: the file has no blocks; its data follows the end of its name.
+  char        name [];
 } direntry_t;
 
-// a directory block is an array of directory entries
+#define DIRENTRYMAX (sizeof(direntry_t) + MAXNAME + INLINEMAX) // room for any entry, when building one
+#define DIRENTRY_SIZE(namelen, datalen) \
+  ((offsetof(direntry_t, name) + (namelen) + 1 + (datalen) + DIRENTRYALIGN - 1) / DIRENTRYALIGN * DIRENTRYALIGN)
+
+// a directory block is a slotted page: an array of slots after the header, growing up, and the
+// entries they locate, packed down from the end of the block. An entry keeps its slot when it is
+// moved (so the block can be compacted, and an entry grown), and a free slot is reused before
+// a new one is taken. Alongside the slots is the block's order: its live slots sorted by name.
 
-//const int   direntrycount = (blocksize - (2*sizeof(int)) ) / sizeof(direntry_t);
+typedef struct dirslot {
+  uint16_t entry; // the entry in this slot, in DIRENTRYALIGN units from the start of the block, or DIRSLOTFREE | the next freeEntry.
+  uint16_t order; // the slot of the block's order'th entry by name (for the first entryCount slots).
+} dirslot_t;
+
+// A directory is a B+tree of these blocks, keyed by name, whose root is its first block. Leaves
+// (level 0) hold the entries and are linked in name order; a node above them holds one entry per
+// child, with the child in firstblock and, as its name, a key no greater than any name under the
+// child (the leftmost child's key is "").
 
 typedef struct dirblock {
   int isDir;
-  int nextEntry; // the next unused index in the entrylist.
-  direntry_t entrylist [ DIRENTRYCOUNT ]; // the first two integer are marker and endpos
+  int level;      // 0 for a leaf; one more than its children's for a node above.
+  int nextEntry;  // slots used so far.
+  int freeEntry;  // 1 + a slot freed since it was used (0 if none); each freed slot holds the next one's freeEntry.
+  int entryCount; // live entries.
+  int entryStart; // where the lowest entry starts (BLOCKSIZE if there are none).
+  int freeBytes;  // bytes of deleted entries among the rest, to be reclaimed by compacting the block.
+  fatentry_t nextLeaf;   // the leaf after this one in name order (0 for the last)
+  fatentry_t index;      // first of the contiguous blocks of the directory's hash index (0 if it has none)
+  fatentry_t indexslots; // slots in the hash index (or, if one could not be built, minus the entries then),
+  fatentry_t indexused;  // ... and those holding an entry or a tombstone (or the entries added since)
+  dirslot_t slots [ MAXDIRSLOTS ];
 } dirblock_t;
 
 
+// a slot of a directory's hash index: a name's hash and where its entry is.
+// The index is open-addressed (linear probing), so a deleted entry leaves a tombstone.
+
+typedef struct dirhash {
+  uint32_t    hash;
+  fatentry_t  block; // directory block holding the entry (0 for an empty slot, UNUSED for a tombstone)
+  int32_t     slot;  // ... and the entry's slot there
+} dirhash_t;
+
+// A dentry cache entry: what a name in a directory resolves to.
+typedef struct dentry {
+  fatentry_t parent; // first block of the directory holding the name (0 if the entry is empty)
+  fatentry_t block;  // first block of the directory it names, or -1 if there is no such directory
+  char name[MAXNAME];
+} dentry_t;
+
+
 
 // a data block holds the actual data of a filelength, it is an array of 8-bit (byte) elements
 
-typedef Byte datablock_t [ BLOCKSIZE ];
+typedef Byte datablock_t [ MAXBLOCKSIZE ];
 
 
-// a diskblock can be either a directory block, a FAT block or actual data
+// a diskblock can be either a directory block, a FAT block, the superblock or actual data
+// it is sized for the largest block, but only the first BLOCKSIZE bytes are used
 
 typedef union block {
-  datablock_t data;
-  dirblock_t  dir ;
-  fatblock_t  fat ;
+  datablock_t  data;
+  dirblock_t   dir ;
+  fatblock_t   fat ;
+  superblock_t super;
 } diskblock_t;
 
-// finally, this is the disk: a list of diskblocks
+// finally, this is the disk: MAXBLOCKS blocks of BLOCKSIZE bytes each
 // the disk is declared as extern, as it is shared in the program
 // it has to be defined in the main program filelength
-
-extern diskblock_t virtualDisk [ MAXBLOCKS ];
+// virtualDisk is a view: it points at an in-memory disk by default, or at
+// an mmap'ed image file while a disk is mounted with mountdisk().
+
+extern Byte *virtualDisk;
+
+
+// counters kept by writedisk/flushdisk/syncdisk, to see how much checkpointing costs
+
+typedef struct diskstats {
+  long fullwrites;   // whole-image writes
+  long flushes;      // incremental flushes and syncs
+  long runsflushed;  // runs of adjacent dirty blocks written by those
+  long bytesflushed; // total bytes written to image files
+  long cachehits;    // block cache lookups that found the block
+  long cachemisses;  // ... and that had to load it
+  long evictions;    // blocks pushed out of the cache
+  long writebacks;   // dirty blocks written from the cache to the image
+  long prefetched;   // blocks loaded into the cache ahead of use
+  long ioreqs;       // block I/O requests queued
+  long iobatches;    // ... and the batches they were submitted in
+  long rahits;       // blocks reached by a reader after being read ahead for it
+  long rawasted;     // ... and read ahead but never reached (the reader seeked or closed first)
+  long opens;        // files opened
+  long peakopen;     // most files open at once
+  long cowblocks;    // shared blocks copied on write
+  long dentryhits;   // path components found in the dentry cache
+  long dentrymisses; // ... and looked up in their directory
+} diskstats_t;
+
+extern diskstats_t diskStats;
+
+
+// a frame of the block cache used by mountdisk_cached()
+
+#define CACHE_LRU      0   // evict the least recently used block
+#define CACHE_CLOCK    1   // evict with the CLOCK (second chance) sweep
+#define CACHEMINFRAMES 16  // a few blocks can be pinned at once, so the cache is never smaller than this
+
+typedef struct cacheframe {
+  fatentry_t block;      // block held in this frame (UNUSED if empty)
+  int        pins;       // a pinned frame is never evicted
+  Byte       dirty;      // changed since it was read from, or written to, the image
+  Byte       referenced; // CLOCK: used since the hand last passed
+  int        prev, next; // LRU list, most recently used first
+  int        hnext;      // next frame in the same hash bucket
+} cacheframe_t;
+
+
+// asynchronous block I/O underneath the cache: requests are queued, submitted in batches,
+// and completed through callbacks
+
+#define BLOCKIO_SYNC   0   // plain preadv/pwritev, done at submit time
+#define BLOCKIO_URING  1   // io_uring, with many requests in flight
+#define BLOCKIO_READ   0
+#define BLOCKIO_WRITE  1
+#define BLOCKIODEPTH   32  // default queue depth
+#define BLOCKIOMAXVEC  64  // most blocks a single request can carry
+#define PREFETCHBLOCKS 16  // blocks fetched per batch when walking the FAT or a chain
+#define READAHEADSTART 2   // blocks read in order before a file is read ahead
+#define READAHEADMIN   4   // first readahead window, in blocks
+#define READAHEADMAX   64  // largest readahead window
+
+#define IO_FREE     0
+#define IO_QUEUED   1
+#define IO_INFLIGHT 2
+#define IO_DONE     3
+
+typedef void (*blockio_callback)(fatentry_t block_address, int count, int result, void *arg);
+
+typedef struct blockio_request {
+  int              op;      // BLOCKIO_READ or BLOCKIO_WRITE
+  int              fd;
+  fatentry_t       block;   // first block; the request covers count consecutive blocks
+  int              count;
+  struct iovec     iov [BLOCKIOMAXVEC]; // one buffer per block
+  int              result;  // bytes transferred, or -errno
+  int              state;   // IO_FREE, IO_QUEUED, IO_INFLIGHT or IO_DONE
+  blockio_callback callback;
+  void            *arg;
+} blockio_request_t;
 
 
 // when a file is opened on this disk, a file handle has to be
 // created in the opening program
 
 typedef struct filedescriptor {
+  int         fd;            // slot in the open file table
+  Byte        inuse;
   int         pos;           // byte within a block
   char        mode[3];
   Byte        writing;
-  fatentry_t  blockno;
+  fatentry_t  blockno;       // (0 while the position is in a hole)
   fatentry_t  first_block;
-  diskblock_t buffer;
+  fatentry_t  resv_start;    // contiguous blocks reserved for the file to grow into
+  int         resv_count;
+  int         resv_next;     // size of the next reservation
+  long        blockindex;    // the position's block within the file (0 for first_block)
+  long        holestart;     // while in a hole: the first block of the file in it,
+  long        holeend;       // ... the block after it (LONG_MAX if it runs on past the chain),
+  fatentry_t  holeprev;      // ... the block before it,
+  fatentry_t  holenext;      // ... and the block after it (0 if none)
+  fatentry_t *chain;         // chain index: the file's blocks in order, built on first seek
+  long       *chainpos;      // ... and where each one is in the file (they differ after a hole)
+  long        chainlen, chaincap;
+  long        chaingen;      // chainGeneration the index was built under
+  Byte       *buffer;        // write buffer: bytes written at the position but not yet in the blocks
+  int         bufsize, buflen;
+  int         bufcap;        // bytes allocated for buffer (kept when the slot is reused)
+  long        ra_streak;     // blocks read in order since the last seek
+  int         ra_window;     // size of the last readahead window
+  long        ra_end;        // chain index just past the blocks read ahead so far
+  fatentry_t  ra_block;      // ... and the last of those blocks
+  long        length;        // exact length of the file in bytes
+  fatentry_t  lastblock;     // last block of the chain
+  long        allocblocks;   // blocks in the chain
+  Byte        inlined;       // TRUE while the file's data is kept in its directory entry (first_block is 0)
+  int         inlinecap;     // ... where there is room for this much of it
+  Byte        inlinedata[INLINEMAX]; // ... and the data itself, while the file is open
+  Byte        changed;       // length not yet written back to the directory entry
+  fatentry_t  dir_block;     // where the file's directory entry is
+  int         dir_slot;      // (-1 if it has none)
 } MyFILE;
 
 
+// a directory opened with myopendir(): a cursor over its leaves, in name order
+
+typedef struct mydirent {
+  char        name[MAXNAME];
+  Byte        isdir;
+  long        size;       // exact length in bytes (0 for a directory)
+  fatentry_t  firstblock; // (0 for an inline or empty file)
+} mydirent_t;
+
+// what myreaddirplus() gives for each entry, as an ls -l style listing wants it
+
+typedef struct mystat {
+  char        name[MAXNAME];
+  Byte        isdir;
+  long        size;       // exact length in bytes (0 for a directory)
+  long        blocks;     // blocks allocated to it (fewer than the size needs if it is sparse or inline)
+  time_t      mtime;      // last modified
+  fatentry_t  firstblock;
+} mystat_t;
+
+typedef struct mydir {
+  fatentry_t  dir;   // first block of the directory
+  fatentry_t  leaf;  // leaf being read (0 once past the last)
+  int         pos;   // position in the leaf's name order of the entry after the last one returned
+  mydirent_t  entry; // the last entry returned by myreaddir()
+} MYDIR;
+
+
+// a hole in a sparse file's chain: skip blocks that were never written, then the chain carries on at next
+
+typedef struct hole {
+  fatentry_t  skip;  // (0 for a free slot, whose next is the next free slot)
+  fatentry_t  next;
+} hole_t;
+
+
+// a run of consecutive blocks in a chain
+
+typedef struct extent {
+  fatentry_t  start;
+  fatentry_t  length;
+} extent_t;
+
+
 
 void copyFAT(fatentry_t *FAT);
+void setFAT(fatentry_t index, fatentry_t value);
+void syncFAT();
+void updateFAT();
+void deferFAT(int on);
 void format();
+int format_disk(fatentry_t blockcount, int blocksize);
+int set_geometry(const superblock_t *super);
+int read_superblock(int fd, superblock_t *super);
 void writedisk ( const char *filename);
+void readdisk ( const char *filename);
+int mountdisk(const char *filename);
+void syncdisk();
+void unmountdisk();
+int flushdisk(const char *filename);
+int copy_image(int fd, int dest);
+int load_image(int fd, Byte *disk, size_t size);
+int mountdisk_cached(const char *filename, int capacity, int policy);
+int attach_image(const char *filename, int capacity, int policy);
+int cache_init(int capacity, int policy, int blocksize);
+void cache_free();
+int cache_find(fatentry_t block_address);
+void cache_touch(int frame);
+int cache_victim();
+int cache_writeback(int frame);
+void cache_unhash(int frame);
+int cache_get(fatentry_t block_address, int fill);
+int cache_claim(fatentry_t block_address);
+int cache_prefetch(const fatentry_t *blocks, int n);
+void cache_read_done(fatentry_t block_address, int count, int result, void *arg);
+void cache_write_done(fatentry_t block_address, int count, int result, void *arg);
+void prefetch_range(fatentry_t block_address, int count);
+fatentry_t prefetch_chain(fatentry_t block_address, int count);
+int blockio_init(int backend, int depth);
+void blockio_shutdown();
+int blockio_queue(int op, int fd, fatentry_t block_address, int count, Byte **bufs, blockio_callback callback, void *arg);
+int blockio_submit();
+void blockio_complete(int slot, int result);
+int blockio_wait(int min);
+int blockio_drain();
+int cache_frame_cmp(const void *a, const void *b);
+int cache_sync();
+void print_diskstats();
+void mark_dirty(int block_address);
+int is_dirty(int block_address);
+fatentry_t next_dirty(fatentry_t from);
+void clear_dirty();
+void loadFAT(fatentry_t *FAT);
 void printBlock(int blockIndex, int type);
-void writeblock ( diskblock_t *block, int block_address, int type);
-void readblock(diskblock_t *block, int block_address, int type);
+int writeblock ( diskblock_t *block, int block_address, int type);
+int readblock(diskblock_t *block, int block_address, int type);
+const diskblock_t *pinblock(fatentry_t block_address);
+diskblock_t *pinblock_rw(fatentry_t block_address);
+void unpinblock(fatentry_t block_address);
+void unpinblock_rw(fatentry_t block_address);
 MyFILE * myfopen(const char *filename, const char *mode);
 void init_block(diskblock_t *block, int type);
 int next_free_fat();
+void build_freemap();
+fatentry_t find_free(fatentry_t from);
+void take_block(fatentry_t block_address);
+void free_block(fatentry_t block_address);
+long free_chain(fatentry_t block_address);
+fatentry_t free_block_count();
+fatentry_t reserve_extent(fatentry_t near, int want, int *got);
+fatentry_t reserve_run(int count);
+void release_extent(fatentry_t start, int count);
+int chain_extents(fatentry_t block_address, extent_t *extents, int max);
+int file_extents(const char *filename, extent_t *extents, int max);
+int extend_file(MyFILE *file);
 int file_index(const char *filename);
-char myfgetc(MyFILE *file);
+int myfgetc(MyFILE *file);
 int myfputc(MyFILE *file, const char ch);
+int file_next_block(MyFILE *file, int extend);
+void readahead(MyFILE *file);
+void readahead_cancel(MyFILE *file);
+size_t myfread(void *buf, size_t size, size_t n, MyFILE *file);
+size_t myfwrite(const void *buf, size_t size, size_t n, MyFILE *file);
+size_t file_write(MyFILE *file, const Byte *src, size_t len);
+int myfflush(MyFILE *file);
+int myfsetbuf(MyFILE *file, int size);
+long chain_index(MyFILE *file, long count);
+long chain_find(MyFILE *file, long index);
+void hole_enter(MyFILE *file, fatentry_t prev, long previndex);
+int fill_hole(MyFILE *file);
+int myfseek(MyFILE *file, long offset, int whence);
+long myftell(MyFILE *file);
 void myfclose(MyFILE *file);
+int myopen(const char *path, const char *mode);
+int myclose(int fd);
+MyFILE *myfdfile(int fd);
+int myfileno(MyFILE *file);
+MyFILE *file_alloc();
+void file_release(MyFILE *file);
+int open_file_count();
+void file_entry_moved(fatentry_t block, int slot, fatentry_t newblock, int newslot);
+int file_flush_others(MyFILE *file);
+void file_entry_reload(MyFILE *file);
+fatentry_t trim_chain(MyFILE *file, long length);
+int clear_tail(MyFILE *file, long length);
+fatentry_t grow_chain(fatentry_t last, long count);
+int myftruncate(const char *path, long len);
+int myfallocate(const char *path, long len);
+int block_shared(fatentry_t block_address);
+void build_refcounts();
+void count_dir_refs(fatentry_t dir_index);
+fatentry_t cow_chain(MyFILE *file, long index);
+int myclone(const char *src, const char *dst);
+int inline_promote(MyFILE *file);
+void inline_reset(MyFILE *file);
+fatentry_t hole_new(fatentry_t skip, fatentry_t next);
+void hole_free(fatentry_t entry);
+fatentry_t chain_next(fatentry_t block_address);
+void sync_holes();
+void load_holes();
+int file_entry(const char *filename, fatentry_t *dir_block, int *slot);
+void open_entry(MyFILE *file, const char *filename);
+void load_entry(MyFILE *file);
+void update_entry(MyFILE *file);
 int file_block_length(const char *filename);
 void print_FAT();
 void add_file(fatentry_t dir_index, direntry_t *entry, int type);
+int dir_add(fatentry_t dir_index, const direntry_t *entry, int level, fatentry_t *block);
+fatentry_t dir_descend(fatentry_t dir_index, const char *name, int level);
+fatentry_t dir_split(fatentry_t dir_index, fatentry_t block, char *key);
+fatentry_t dir_push_root(fatentry_t dir_index);
+fatentry_t dir_first_leaf(fatentry_t dir_index);
+long dir_count(fatentry_t dir_index);
+uint32_t name_hash(const char *name);
+int dir_find(fatentry_t dir_index, const char *name, fatentry_t *block);
+void dir_release_entry(fatentry_t dir_index, fatentry_t block, int slot);
+void dirindex_add(fatentry_t dir_index, const char *name, fatentry_t block, int slot);
+void dirindex_remove(fatentry_t dir_index, const char *name, fatentry_t block, int slot);
+void dirindex_move(fatentry_t dir_index, const char *name, fatentry_t block, int slot, fatentry_t newblock, int newslot);
+int dirindex_build(fatentry_t dir_index);
+void dirindex_free(fatentry_t dir_index);
 void add_dir(const char *folder_name);
 void print_dir_contents(fatentry_t dir_index);
 void ls_current_dir();
-int next_free_dir_entry(dirblock_t *folder);
-int dir_index(const char *filename);
+direntry_t *dir_entry(const dirblock_t *dir, int slot);
+size_t dir_namelen(const direntry_t *entry);
+direntry_t *dir_nth(const dirblock_t *dir, int pos);
+int dir_search(const dirblock_t *dir, const char *name);
+void dir_compact(dirblock_t *dir);
+int dir_insert(dirblock_t *dir, const direntry_t *entry);
+void dir_remove(dirblock_t *dir, int slot);
+int dir_resize(dirblock_t *dir, int slot, int datalen);
 void print_file(const char *filename);
 void cd_dir(const char *dirname);
 void mymkdir(char *path);
 void change_dir(int dir_index);
 void mychdir(const char *path);
 void myremove(const char *path);
-void delete_file(diskblock_t *directory, const char *filename);
+void delete_file(fatentry_t dir_index, const char *filename);
 char ** parse_path(char *path);
 char ** mylistdir(char *path);
+MYDIR *myopendir(const char *path);
+const diskblock_t *readdir_leaf(MYDIR *dir, int *pos);
+mydirent_t *myreaddir(MYDIR *dir);
+int myreaddirplus(MYDIR *dir, mystat_t *buf, int max);
+void myclosedir(MYDIR *dir);
 char **alloc_2d_char_array(int max_x, int max_y);
 int get_path_dir_no(char **dirs);
 void delete_dir(const char *dirname);
 void myrmdir(const char *path);
 char *get_dir_name(int dir_index);
+void dcache_clear(void);
+int dentry_slot(fatentry_t parent, const char *name);
+void dcache_forget(fatentry_t parent, const char *name);
+void dcache_forget_dir(fatentry_t dir);
+fatentry_t dir_lookup(fatentry_t parent, const char *name);
+int path_next(const char **path, char *name);
+fatentry_t resolve_path(const char *path, char *last, int create);
 
 
 #endif
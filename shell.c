@@ -13,10 +13,11 @@ void cgs_d()
   // call format() to format the virtualdisk.
   format();
 
-  // Name the disk.
+  // Name the disk (the name is kept at the start of the superblock in block 0).
   diskblock_t block;
-  for(int i=0; i<BLOCKSIZE; i++) block.data[i] = '\0';
-  memcpy(block.data, "Dylan Filesystem", sizeof("Dylan Filesystem"));
+  readblock(&block, 0, TYPE_DATA);
+  memset(block.super.name, '\0', MAXVOLNAME);
+  memcpy(block.super.name, "Dylan Filesystem", sizeof("Dylan Filesystem"));
   writeblock(&block, 0, 0);
 
   // write the virtual disk to a file (call it "virtualdiskD3_D1").
@@ -27,6 +28,7 @@ void cgs_c()
 {
   // Create test file.
   MyFILE * fp = myfopen("testfile.txt", "w");
+  myfclose(fp);
 
   // Write character to test file.
   fp = myfopen("testfile.txt", "a");
@@ -41,6 +43,7 @@ void cgs_c()
   for(int i=0; i<(4*BLOCKSIZE); i++) {
     myfputc(fp, ch[i]);
   }
+  myfclose(fp); // writes are buffered, so close before reading back.
   printf("\n");
 
   // Read out file.
@@ -55,7 +58,6 @@ void cgs_c()
   fp = myfopen("testfile.txt", "r");
   
   if(fp) {
-    fp->blockno++;
     FILE *file = fopen("testfileC3_C1_copy.txt", "w");
     char content;
     while(1) {
@@ -79,21 +81,19 @@ void cgs_c()
 void cgs_b()
 {
   // create a directory "/myfirstdir/myseconddir/mythirddir" in the virtual disk.
-  char *pathname = malloc(sizeof(char) * strlen("/myfirstdir/myseconddir/mythirddir"));
+  char *pathname = malloc(sizeof(char) * (strlen("/myfirstdir/myseconddir/mythirddir") + 1));
   strcpy(pathname, "/myfirstdir/myseconddir/mythirddir"); // otherwise mymkdir segfaults.
   mymkdir(pathname);
 
-  // call mylistdir("/myfirstdir/myseconddir"): print out the list of strings returned by this function.
-  char **file_list = alloc_2d_char_array(MAXDIRCONTENTS, MAXNAME);
+  // list "/myfirstdir/myseconddir": print out each entry myreaddir() returns.
   printf("Contents of '/myfirstdir/myseconddir':\n");
-  file_list = mylistdir("/myfirstdir/myseconddir"); // was "/"
+  MYDIR *dir = myopendir("/myfirstdir/myseconddir"); // was "/"
   
-  // print the results of mylistdir().
-  for(int i=0; i<MAXDIRCONTENTS; i++) {
-    if(strcmp(file_list[i], "") == 0) break;
-    printf("\t> %s\n", file_list[i]);
+  // print the results of myreaddir().
+  for(mydirent_t *entry = myreaddir(dir); entry != NULL; entry = myreaddir(dir)) {
+    printf("\t> %s\n", entry->name);
   }
-  free(file_list);
+  myclosedir(dir);
 
   // write out virtual disk to "virtualdiskB3_B1_a".
   writedisk("virtualdiskB3_B1_a");
@@ -102,15 +102,13 @@ void cgs_b()
   MyFILE *file = myfopen("/myfirstdir/myseconddir/testfile.txt", "w");
   myfclose(file);
 
-  // call mylistdir("/myfirstdir/myseconddir"): print out the list of strings returned by this function.
-  file_list = alloc_2d_char_array(MAXDIRCONTENTS, MAXNAME);
+  // list "/myfirstdir/myseconddir": print out each entry myreaddir() returns.
   printf("Contents of '/myfirstdir/myseconddir':\n");
-  file_list = mylistdir("/myfirstdir/myseconddir"); // was "/"
-  for(int i=0; i<MAXDIRCONTENTS; i++) {
-    if(strcmp(file_list[i], "") == 0) break;
-    printf("\t> %s\n", file_list[i]);
+  dir = myopendir("/myfirstdir/myseconddir"); // was "/"
+  for(mydirent_t *entry = myreaddir(dir); entry != NULL; entry = myreaddir(dir)) {
+    printf("\t> %s\n", entry->name);
   }
-  free(file_list);
+  myclosedir(dir);
 
   // write out virtual disk to "virtualdiskB3_B1_b".
   writedisk("virtualdiskB3_B1_b");
@@ -136,30 +134,27 @@ void cgs_a()
   // close the file.
   myfclose(file);
 
-  // call mylistdir("/firstdir/seconddir"): print out the list of strings returned by this function.
-  char **file_list = alloc_2d_char_array(MAXDIRCONTENTS, MAXNAME);
-  file_list = mylistdir("/firstdir/seconddir");
+  // list "/firstdir/seconddir": print out each entry myreaddir() returns.
+  MYDIR *dir = myopendir("/firstdir/seconddir");
   printf("Contents of '/firstdir/seconddir':\n");
-  // print the results of mylistdir().
-  for(int i=0; i<MAXDIRCONTENTS; i++) {
-    if(strcmp(file_list[i], "") == 0) break;
-    printf("\t> %s\n", file_list[i]);
+  // print the results of myreaddir().
+  for(mydirent_t *entry = myreaddir(dir); entry != NULL; entry = myreaddir(dir)) {
+    printf("\t> %s\n", entry->name);
   }
-  free(file_list);
+  myclosedir(dir);
 
   // change to directory "/firstdir/seconddir".
   mychdir("/firstdir/seconddir");
 
-  // call mylistdir("/firstdir/seconddir") or mylistdir(".") to list the current dir, 
-  //print the list of strings returned by this function.
-  file_list = mylistdir("/firstdir/seconddir");
+  // list "/firstdir/seconddir" or "." to list the current dir, 
+  //print each entry myreaddir() returns.
+  dir = myopendir("/firstdir/seconddir");
   printf("Contents of '/firstdir/seconddir':\n");
-  // print the results of mylistdir().
-  for(int i=0; i<MAXDIRCONTENTS; i++) {
-    if(strcmp(file_list[i], "") == 0) break;
-    printf("\t> %s\n", file_list[i]);
+  // print the results of myreaddir().
+  for(mydirent_t *entry = myreaddir(dir); entry != NULL; entry = myreaddir(dir)) {
+    printf("\t> %s\n", entry->name);
   }
-  free(file_list);
+  myclosedir(dir);
 
   // call myfopen("testfile2.txt", "w");
   file = myfopen("testfile2.txt", "w");
@@ -0,0 +1,46 @@
+/* check.h
+ *
+ * what the test programs in tests/ share: a CHECK that counts failures, and names for the disk
+ * images they write, which go in /tmp and are removed by the test.
+ */
+
+#ifndef CHECK_H
+#define CHECK_H
+
+#include "filesys.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static int failures = 0;
+
+#define CHECK(cond) do { \
+    if(!(cond)) { \
+      fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+      failures++; \
+    } \
+  } while(0)
+
+// Prints the test's result; returns main's exit status.
+#define CHECK_DONE() (fprintf(stderr, "%s: %s\n", __FILE__, failures ? "FAILED" : "ok"), failures != 0)
+
+// A disk image name for this test run.
+static inline const char *test_image(const char *name)
+{
+  static char path[256];
+  snprintf(path, sizeof(path), "/tmp/dfs_test_%d_%s", (int) getpid(), name);
+  return path;
+}
+
+// Read a whole file into buf (up to max bytes). Returns the bytes read, or -1 if it can't be opened.
+static inline long read_file(const char *path, Byte *buf, long max)
+{
+  MyFILE *file = myfopen(path, "r");
+  if(file == NULL) return -1;
+  long n = myfread(buf, 1, max, file);
+  myfclose(file);
+  return n;
+}
+
+#endif
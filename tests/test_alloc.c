@@ -0,0 +1,80 @@
+/* test_alloc.c
+ *
+ * The free-space bitmap: its count of free blocks always agrees with the FAT, through files being
+ * written, removed and the disk filled to the last block, blocks are handed out in order from
+ * wherever the search starts, and the bitmap is rebuilt when an image is read back.
+ */
+
+#include "check.h"
+
+extern fatentry_t *FAT;
+
+// Free blocks counted the slow way, from the FAT.
+fatentry_t fat_free()
+{
+  fatentry_t n = 0;
+  for(fatentry_t i=0; i<MAXBLOCKS; i++) if(FAT[i] == UNUSED) n++;
+  return n;
+}
+
+// Write len bytes to a new file, stopping if the disk fills up.
+void write_len(const char *path, long len)
+{
+  MyFILE *file = myfopen(path, "w");
+  for(long done=0; done<len; done++) if(myfputc(file, 'x') != 0) break;
+  myfclose(file);
+}
+
+int main()
+{
+  format_disk(3 * FREEREGIONBLOCKS + 100, 1024); // (regions, and a partial one at the end.)
+  CHECK(free_block_count() == fat_free());
+
+  // Files written and removed in between one another.
+  char path[32];
+  for(int i=0; i<20; i++) {
+    snprintf(path, sizeof(path), "/f%02d", i);
+    write_len(path, 1000L * (i * 37 % 101) + 1);
+  }
+  for(int i=0; i<20; i+=3) {
+    snprintf(path, sizeof(path), "/f%02d", i);
+    myremove(path);
+  }
+  CHECK(free_block_count() == fat_free());
+
+  // The search finds the first free block from where it starts, and none past the end.
+  fatentry_t first = find_free(0);
+  CHECK(first > 0 && FAT[first] == UNUSED);
+  fatentry_t skipped = 0;
+  for(fatentry_t b=0; b<first; b++) if(FAT[b] == UNUSED) skipped++;
+  CHECK(skipped == 0);
+  fatentry_t later = find_free(MAXBLOCKS - 50);
+  CHECK(later >= MAXBLOCKS - 50 && FAT[later] == UNUSED);
+  take_block(later);
+  CHECK(FAT[later] != UNUSED);
+  CHECK(free_block_count() == fat_free());
+  free_block(later);
+  CHECK(free_block_count() == fat_free());
+
+  // Filled to the last block, then emptied again.
+  fatentry_t before = free_block_count();
+  write_len("/fill", (long) (before + 10) * BLOCKSIZE);
+  CHECK(free_block_count() == 0);
+  CHECK(fat_free() == 0);
+  CHECK(next_free_fat() < 0);
+  CHECK(find_free(0) < 0);
+  myremove("/fill");
+  CHECK(free_block_count() == before);
+  CHECK(free_block_count() == fat_free());
+
+  // Read back from an image, the bitmap is rebuilt to match.
+  const char *image = test_image("alloc");
+  writedisk(image);
+  format();
+  readdisk(image);
+  unlink(image);
+  CHECK(free_block_count() == before);
+  CHECK(free_block_count() == fat_free());
+
+  return CHECK_DONE();
+}
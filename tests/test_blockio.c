@@ -0,0 +1,84 @@
+/* test_blockio.c
+ *
+ * Block I/O: with either backend (io_uring where the kernel has it, else plain preadv/pwritev),
+ * queued writes and reads of runs of blocks land where they should, more requests than the queue
+ * is deep are taken in turn, every callback runs once with the bytes moved, and a read past the
+ * end of the file comes back short.
+ */
+
+#include "check.h"
+#include <fcntl.h>
+
+#define RUNS   20
+#define RUNLEN 4
+
+Byte *out[RUNS * RUNLEN], *in[RUNS * RUNLEN];
+int calls;
+long moved;
+
+void done(fatentry_t block_address, int count, int result, void *arg)
+{
+  (void) block_address;
+  (void) count;
+  calls++;
+  if(result > 0) moved += result;
+  if(arg != NULL) *(int *) arg = result;
+}
+
+void run(int backend)
+{
+  const char *image = test_image("blockio");
+  int fd = open(image, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  CHECK(fd >= 0);
+  int depth = 4;
+  int got = blockio_init(backend, depth);
+  CHECK(got == BLOCKIO_SYNC || got == backend);
+
+  // Runs written out of order, more of them than the queue holds.
+  calls = 0;
+  moved = 0;
+  for(int r=RUNS - 1; r>=0; r--) blockio_queue(BLOCKIO_WRITE, fd, r * RUNLEN, RUNLEN, &out[r * RUNLEN], done, NULL);
+  blockio_drain();
+  CHECK(calls == RUNS);
+  CHECK(moved == (long) RUNS * RUNLEN * BLOCKSIZE);
+
+  // Read back into other buffers.
+  calls = 0;
+  moved = 0;
+  for(int r=0; r<RUNS; r++) blockio_queue(BLOCKIO_READ, fd, r * RUNLEN, RUNLEN, &in[r * RUNLEN], done, NULL);
+  CHECK(blockio_submit() >= 0);
+  blockio_drain();
+  CHECK(calls == RUNS);
+  int same = 1;
+  for(int i=0; i<RUNS * RUNLEN; i++) if(memcmp(in[i], out[i], BLOCKSIZE) != 0) same = 0;
+  CHECK(same);
+
+  // Past the end of the file there is nothing to read.
+  int result = -1;
+  blockio_queue(BLOCKIO_READ, fd, RUNS * RUNLEN - 1, 2, &in[0], done, &result);
+  blockio_drain();
+  CHECK(result == BLOCKSIZE);
+
+  blockio_shutdown();
+  close(fd);
+  unlink(image);
+}
+
+int main()
+{
+  format_disk(256, 4096);
+  for(int i=0; i<RUNS * RUNLEN; i++) {
+    out[i] = malloc(BLOCKSIZE);
+    in[i] = malloc(BLOCKSIZE);
+    memset(out[i], 'A' + i % 26, BLOCKSIZE);
+    memcpy(out[i], &i, sizeof(i));
+  }
+  run(BLOCKIO_SYNC);
+  run(BLOCKIO_URING);
+  for(int i=0; i<RUNS * RUNLEN; i++) {
+    free(out[i]);
+    free(in[i]);
+  }
+
+  return CHECK_DONE();
+}
@@ -0,0 +1,55 @@
+/* test_buffer.c
+ *
+ * Write buffering: with any buffer size (none, a byte, odd sizes, bigger than a block) characters
+ * and blocks written, overwritten after a seek and read back through the same file come out as
+ * written; myftell counts what is still buffered; and other readers see the data once it is
+ * flushed.
+ */
+
+#include "check.h"
+
+#define FILELEN 100000
+
+Byte want[FILELEN], got[FILELEN + 1];
+
+int main()
+{
+  format_disk(1 << 14, 1024);
+  int sizes[] = { 0, 1, 3000, FILEBUFSIZE, 100000 };
+  for(int s=0; s<5; s++) {
+    MyFILE *file = myfopen("/x", "w");
+    CHECK(myfsetbuf(file, sizes[s]) == 0);
+    for(int i=0; i<FILELEN; i++) {
+      want[i] = 'a' + i % 26;
+      myfputc(file, want[i]);
+    }
+    CHECK(myftell(file) == FILELEN);
+
+    // Overwrite inside what was written, and read it back before closing.
+    long at[] = { 5, 1023, 50000, FILELEN - 3 };
+    for(int k=0; k<4; k++) {
+      CHECK(myfseek(file, at[k], SEEK_SET) == 0);
+      CHECK(myfwrite("HEL", 1, 3, file) == 3);
+      memcpy(want + at[k], "HEL", 3);
+      CHECK(myftell(file) == at[k] + 3);
+    }
+    CHECK(myfseek(file, 0, SEEK_SET) == 0);
+    CHECK(myfread(got, 1, 12, file) == 12);
+    CHECK(memcmp(got, want, 12) == 0);
+    myfclose(file);
+    CHECK(read_file("/x", got, sizeof(got)) == FILELEN);
+    CHECK(memcmp(got, want, FILELEN) == 0);
+  }
+
+  // Buffered data is out of sight of other readers until it is flushed.
+  MyFILE *file = myfopen("/y", "w");
+  myfwrite("buffered", 1, 8, file);
+  CHECK(read_file("/y", got, sizeof(got)) == 0);
+  CHECK(myfflush(file) == 0);
+  CHECK(read_file("/y", got, sizeof(got)) == 8);
+  CHECK(memcmp(got, "buffered", 8) == 0);
+  CHECK(myfsetbuf(file, -1) < 0);
+  myfclose(file);
+
+  return CHECK_DONE();
+}
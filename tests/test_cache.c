@@ -0,0 +1,109 @@
+/* test_cache.c
+ *
+ * The block cache: a file much bigger than the cache reads back intact through either eviction
+ * policy, dirty blocks reach the image, repeated reads are hits, a cache with every frame pinned
+ * refuses more blocks without stopping the program, and a mount that fails part way leaves nothing
+ * open.
+ */
+
+#define _DEFAULT_SOURCE // for setrlimit and SIGXFSZ under -std=c99.
+#include "check.h"
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/resource.h>
+
+#define BIGLEN 200000
+
+Byte want[BIGLEN], got[BIGLEN + 1];
+
+// The lowest free descriptor, which is where a leaked one would show.
+int next_fd()
+{
+  int fd = open("/dev/null", O_RDONLY);
+  close(fd);
+  return fd;
+}
+
+void write_big(const char *path)
+{
+  MyFILE *file = myfopen(path, "w");
+  CHECK(myfwrite(want, 1, BIGLEN, file) == BIGLEN);
+  myfclose(file);
+}
+
+int main()
+{
+  for(int i=0; i<BIGLEN; i++) want[i] = 'a' + i % 26;
+  const char *image = test_image("cache");
+  int policies[] = { CACHE_LRU, CACHE_CLOCK };
+
+  for(int p=0; p<2; p++) {
+    unlink(image);
+    CHECK(mountdisk_cached(image, CACHEMINFRAMES, policies[p]) == 0);
+    format_disk(4096, 4096);
+    write_big("/d/big");
+
+    // Far more blocks than frames: they are evicted, written back and read in again.
+    long misses = diskStats.cachemisses, evictions = diskStats.evictions;
+    CHECK(read_file("/d/big", got, sizeof(got)) == BIGLEN);
+    CHECK(memcmp(got, want, BIGLEN) == 0);
+    CHECK(diskStats.cachemisses > misses);
+    CHECK(diskStats.evictions > evictions);
+
+    // A small file read again and again stays in the cache.
+    MyFILE *file = myfopen("/d/small", "w");
+    myfwrite(want, 1, 5000, file);
+    myfclose(file);
+    read_file("/d/small", got, sizeof(got));
+    misses = diskStats.cachemisses;
+    long hits = diskStats.cachehits;
+    for(int i=0; i<10; i++) CHECK(read_file("/d/small", got, sizeof(got)) == 5000);
+    CHECK(diskStats.cachemisses == misses);
+    CHECK(diskStats.cachehits > hits);
+    unmountdisk();
+
+    // The image holds everything, whether it is mounted through the cache or mapped.
+    CHECK(mountdisk_cached(image, 2 * CACHEMINFRAMES, policies[1 - p]) == 0);
+    CHECK(read_file("/d/big", got, sizeof(got)) == BIGLEN);
+    CHECK(memcmp(got, want, BIGLEN) == 0);
+    unmountdisk();
+    CHECK(mountdisk(image) == 0);
+    CHECK(read_file("/d/big", got, sizeof(got)) == BIGLEN);
+    CHECK(memcmp(got, want, BIGLEN) == 0);
+    unmountdisk();
+  }
+  unlink(image);
+
+  // With every frame pinned there is no room for another block: the calls say so rather than
+  // stopping the program, and once the pins are released the cache carries on.
+  CHECK(mountdisk_cached(image, CACHEMINFRAMES, CACHE_LRU) == 0);
+  format_disk(4096, 4096);
+  for(int i=0; i<CACHEMINFRAMES; i++) CHECK(pinblock(100 + i) != NULL);
+  diskblock_t block;
+  memset(block.data, 'p', BLOCKSIZE);
+  CHECK(pinblock(200) == NULL);
+  CHECK(pinblock_rw(200) == NULL);
+  CHECK(readblock(&block, 200, TYPE_DATA) < 0);
+  CHECK(writeblock(&block, 200, TYPE_DATA) < 0);
+  for(int i=0; i<CACHEMINFRAMES; i++) unpinblock(100 + i);
+  CHECK(writeblock(&block, 200, TYPE_DATA) == 0);
+  CHECK(pinblock(200) != NULL && pinblock(200)->data[0] == 'p');
+  unpinblock(200);
+  unpinblock(200);
+  CHECK(read_file("/d/none", got, sizeof(got)) < 0);
+  unmountdisk();
+  unlink(image);
+
+  // A mount whose image can't be grown fails, and closes the image again.
+  struct rlimit limit = { 4096, 4096 };
+  signal(SIGXFSZ, SIG_IGN);
+  CHECK(setrlimit(RLIMIT_FSIZE, &limit) == 0);
+  int fd = next_fd();
+  CHECK(mountdisk_cached(image, CACHEMINFRAMES, CACHE_LRU) < 0);
+  CHECK(next_fd() == fd);
+  CHECK(mountdisk(image) < 0);
+  CHECK(next_fd() == fd);
+  unlink(image);
+
+  return CHECK_DONE();
+}
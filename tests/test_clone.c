@@ -0,0 +1,79 @@
+/* test_clone.c
+ *
+ * Cloned files: a clone shares its source's blocks instead of copying them, a write to either one
+ * copies only the blocks up to the one it touches, sharing survives a reload, and removing,
+ * truncating or overwriting one leaves the other intact and frees a block only once nothing refers
+ * to it.
+ */
+
+#include "check.h"
+
+#define FILELEN 50000
+
+Byte want[FILELEN], got[2 * FILELEN];
+
+int main()
+{
+  for(int i=0; i<FILELEN; i++) want[i] = 'A' + i % 26;
+  format_disk(8192, 1024);
+  MyFILE *file = myfopen("/t", "w");
+  myfwrite(want, 1, FILELEN, file);
+  myfclose(file);
+
+  // A clone takes no blocks, and reads the same.
+  CHECK(myclone("/t", "/u") == 0);
+  fatentry_t free0 = free_block_count();
+  CHECK(read_file("/u", got, sizeof(got)) == FILELEN);
+  CHECK(memcmp(got, want, FILELEN) == 0);
+  CHECK(myclone("/t", "/u") < 0);
+  CHECK(myclone("/nope", "/w") < 0);
+
+  // A write copies the chain as far as the block it lands in (the FAT links before it are shared
+  // too), and only the file written sees it.
+  long copied = diskStats.cowblocks;
+  file = myfopen("/u", "a");
+  myfseek(file, 2500, SEEK_SET);
+  myfwrite("XYZ", 1, 3, file);
+  myfclose(file);
+  long blocks = 2500 / BLOCKSIZE + 1;
+  CHECK(diskStats.cowblocks - copied == blocks);
+  CHECK(free0 - free_block_count() <= blocks + 2); // (the copies, and the reference counts' own blocks.)
+  CHECK(read_file("/t", got, sizeof(got)) == FILELEN);
+  CHECK(memcmp(got, want, FILELEN) == 0);
+  CHECK(read_file("/u", got, sizeof(got)) == FILELEN);
+  CHECK(memcmp(got + 2500, "XYZ", 3) == 0);
+  CHECK(memcmp(got, want, 2500) == 0 && memcmp(got + 2503, want + 2503, FILELEN - 2503) == 0);
+
+  // Sharing is kept across a reload: removing the source frees only the blocks it no longer shares.
+  const char *image = test_image("clone");
+  writedisk(image);
+  readdisk(image);
+  unlink(image);
+  fatentry_t before = free_block_count();
+  myremove("/t");
+  CHECK(free_block_count() - before == blocks);
+  CHECK(read_file("/u", got, sizeof(got)) == FILELEN);
+  CHECK(memcmp(got + 2503, want + 2503, FILELEN - 2503) == 0 && got[2500] == 'X');
+
+  // Truncating or overwriting one clone leaves the other alone.
+  CHECK(myclone("/u", "/v") == 0);
+  CHECK(myclone("/u", "/w") == 0);
+  CHECK(myftruncate("/v", 100) == 0);
+  CHECK(myftruncate("/u", 2 * FILELEN) == 0);
+  file = myfopen("/w", "w");
+  myfwrite("short", 1, 5, file);
+  myfclose(file);
+  CHECK(read_file("/v", got, sizeof(got)) == 100);
+  CHECK(memcmp(got, want, 100) == 0);
+  CHECK(read_file("/u", got, sizeof(got)) == 2 * FILELEN);
+  CHECK(got[2500] == 'X' && got[FILELEN] == 0 && got[2 * FILELEN - 1] == 0);
+  CHECK(read_file("/w", got, sizeof(got)) == 5);
+
+  // Once every clone is gone, so are all their blocks.
+  myremove("/u");
+  myremove("/v");
+  myremove("/w");
+  CHECK(free_block_count() >= free0 + FILELEN / BLOCKSIZE - 3);
+
+  return CHECK_DONE();
+}
@@ -0,0 +1,86 @@
+/* test_direntries.c
+ *
+ * Variable-length directory entries: short names pack a score or more to a block, long names and inline
+ * data still fit, space freed by deleted entries is reused, and an image of another format
+ * version is refused rather than misread.
+ */
+
+#define _DEFAULT_SOURCE // for pread/pwrite under -std=c99.
+#include "check.h"
+#include <fcntl.h>
+
+char name[MAXNAME + 8];
+
+const char *entry_name(int i, int len)
+{
+  snprintf(name, sizeof(name), "/d/%03d", i);
+  memset(name + 6, 'x', len - 3);
+  name[3 + len] = '\0';
+  return name;
+}
+
+// The root block of a directory, which is all of it while it is a single leaf.
+void dir_shape(const char *path, int *level, int *entries)
+{
+  fatentry_t dir_index = resolve_path(path, NULL, FALSE);
+  const diskblock_t *dir = pinblock(dir_index);
+  *level = dir->dir.level;
+  *entries = dir->dir.entryCount;
+  unpinblock(dir_index);
+}
+
+int main()
+{
+  format_disk(4096, 1024);
+  mymkdir("/d");
+  int level, entries, empty;
+  dir_shape("/d", &level, &empty); // (just its "..")
+
+  // Typical names: 20 or more to a 1K block (a fixed-size entry only fitted 3).
+  for(int i=0; i<20; i++) myfclose(myfopen(entry_name(i, 8), "w"));
+  dir_shape("/d", &level, &entries);
+  CHECK(level == 0);
+  CHECK(entries == empty + 20);
+  for(int i=0; i<20; i++) myremove(entry_name(i, 8));
+
+  // The longest name, with inline data after it.
+  MyFILE *file = myfopen(entry_name(0, MAXNAME - 1), "w");
+  CHECK(file != NULL);
+  myfwrite("inline", 1, 6, file);
+  myfclose(file);
+  Byte buf[16];
+  CHECK(read_file(entry_name(0, MAXNAME - 1), buf, sizeof(buf)) == 6);
+  CHECK(memcmp(buf, "inline", 6) == 0);
+  char **list = mylistdir("/d");
+  int n, longest = 0;
+  for(n=0; list[n][0] != '\0'; n++) if(strlen(list[n]) == MAXNAME - 1) longest++; // (the list ends with "".)
+  CHECK(n == empty + 1 && longest == 1);
+  myremove(entry_name(0, MAXNAME - 1));
+
+  // Deleting and adding entries over and over reuses their space rather than growing the directory.
+  fatentry_t free0 = free_block_count();
+  for(int round=0; round<20; round++) {
+    for(int i=0; i<10; i++) myfclose(myfopen(entry_name(i, 8 + round), "w"));
+    for(int i=0; i<10; i++) myremove(entry_name(i, 8 + round));
+  }
+  CHECK(free_block_count() == free0);
+  dir_shape("/d", &level, &entries);
+  CHECK(level == 0 && entries == empty);
+
+  // An image of another format version is refused, whether read or mounted.
+  const char *image = test_image("direntries");
+  writedisk(image);
+  superblock_t super;
+  int fd = open(image, O_RDWR);
+  CHECK(pread(fd, &super, sizeof(super), 0) == sizeof(super));
+  super.version = FSVERSION - 1;
+  CHECK(pwrite(fd, &super, sizeof(super), 0) == sizeof(super));
+  close(fd);
+  fd = open(image, O_RDONLY);
+  CHECK(read_superblock(fd, &super) < 0);
+  close(fd);
+  CHECK(mountdisk(image) < 0);
+  unlink(image);
+
+  return CHECK_DONE();
+}
@@ -0,0 +1,93 @@
+/* test_dirindex.c
+ *
+ * Directory hash indexes: a directory is given one once it is big enough, finds its entries through
+ * it before and after a reload, and when the disk has no room for one the failure is remembered,
+ * lookups go down the tree, and the build is tried again once the directory has grown.
+ */
+
+#include "check.h"
+
+char name[64];
+
+const char *entry_name(const char *dir, int i)
+{
+  snprintf(name, sizeof(name), "%s/file%04d", dir, i);
+  return name;
+}
+
+void make_files(const char *dir, int from, int to)
+{
+  for(int i=from; i<to; i++) myfclose(myfopen(entry_name(dir, i), "w"));
+}
+
+int found(const char *dir, int i)
+{
+  MyFILE *file = myfopen(entry_name(dir, i), "r");
+  if(file == NULL) return 0;
+  myfclose(file);
+  return 1;
+}
+
+// The index fields of a directory's root block.
+fatentry_t index_block(const char *dir, fatentry_t *slots)
+{
+  fatentry_t dir_index = resolve_path(dir, NULL, FALSE);
+  const diskblock_t *root = pinblock(dir_index);
+  fatentry_t index = root->dir.index;
+  if(slots) *slots = root->dir.indexslots;
+  unpinblock(dir_index);
+  return index;
+}
+
+int main()
+{
+  format_disk(2048, 4096);
+
+  // Small directories are just searched; big ones get an index.
+  mymkdir("/big");
+  make_files("/big", 0, 4);
+  CHECK(index_block("/big", NULL) == 0);
+  make_files("/big", 4, 500);
+  fatentry_t slots;
+  CHECK(index_block("/big", &slots) > 0);
+  CHECK(slots >= 500);
+  for(int i=0; i<500; i++) CHECK(found("/big", i));
+  CHECK(!found("/big", 500));
+
+  // Removed entries are no longer found, and the rest still are.
+  for(int i=0; i<500; i+=2) myremove(entry_name("/big", i));
+  for(int i=0; i<500; i++) CHECK(found("/big", i) == (i % 2));
+
+  // The index survives a reload.
+  const char *image = test_image("dirindex");
+  writedisk(image);
+  CHECK(mountdisk(image) == 0);
+  CHECK(index_block("/big", NULL) > 0);
+  for(int i=0; i<500; i++) CHECK(found("/big", i) == (i % 2));
+  unmountdisk();
+  unlink(image);
+
+  // With no free blocks the index can't be built: the failure is recorded, not retried on lookup.
+  format_disk(256, 4096);
+  mymkdir("/d");
+  make_files("/d", 0, DIRINDEXMIN / 2);
+  CHECK(myfallocate("/fill", (long) free_block_count() * BLOCKSIZE) == 0);
+  CHECK(free_block_count() == 0);
+  make_files("/d", DIRINDEXMIN / 2, 40);
+  CHECK(index_block("/d", &slots) == 0);
+  CHECK(slots < 0);
+  for(int i=0; i<40; i++) CHECK(found("/d", i));
+  CHECK(!found("/d", 40));
+  CHECK(index_block("/d", &slots) == 0);
+  CHECK(slots < 0);
+
+  // Once there is room again, it is built after the directory has grown by as much again.
+  myremove("/fill");
+  make_files("/d", 40, 41);
+  CHECK(index_block("/d", NULL) == 0);
+  make_files("/d", 41, 100);
+  CHECK(index_block("/d", NULL) > 0);
+  for(int i=0; i<100; i++) CHECK(found("/d", i));
+
+  return CHECK_DONE();
+}
@@ -0,0 +1,122 @@
+/* test_dirtree.c
+ *
+ * B+tree directories: a directory of many thousands of entries splits into a tree of leaves,
+ * every entry is found both down the tree and through the hash index, files held open across
+ * splits still write to the right entry, listings come out in name order, and deleting entries
+ * and reloading the disk keep the tree whole until it is empty and its blocks are all returned.
+ */
+
+#include "check.h"
+
+#define HELDOPEN 32
+
+char name[64];
+
+// Whether name is found by descending the directory's tree alone.
+int tree_find(fatentry_t dir, const char *name)
+{
+  fatentry_t leaf = dir_descend(dir, name, 0);
+  const diskblock_t *block = pinblock(leaf);
+  int pos = dir_search(&block->dir, name);
+  int found = (pos < block->dir.entryCount && strcmp(dir_nth(&block->dir, pos)->name, name) == 0);
+  unpinblock(leaf);
+  return found;
+}
+
+const char *entry_name(int i)
+{
+  snprintf(name, sizeof(name), "n%07d", i);
+  return name;
+}
+
+void run(fatentry_t blocks, int blocksize, int count, int height)
+{
+  format_disk(blocks, blocksize);
+  fatentry_t free0 = free_block_count();
+  mymkdir("/big");
+  fatentry_t big = resolve_path("/big", NULL, FALSE);
+  long empty = dir_count(big); // (just its "..")
+  mychdir("/big");
+
+  // Files held open while the directory splits under them, and entries added out of order.
+  MyFILE *held[HELDOPEN];
+  for(int i=0; i<HELDOPEN; i++) {
+    snprintf(name, sizeof(name), "open%05d", i * 3000);
+    held[i] = myfopen(name, "w");
+  }
+  for(int i=0; i<count; i++) {
+    MyFILE *file = myfopen(entry_name((int) ((i * 7919L) % count)), "w");
+    CHECK(file != NULL);
+    if(file != NULL) myfclose(file);
+  }
+  for(int i=0; i<HELDOPEN; i++) {
+    snprintf(name, sizeof(name), "open%05d", i * 3000);
+    myfwrite(name, 1, strlen(name), held[i]);
+    myfclose(held[i]);
+  }
+  const diskblock_t *root = pinblock(big);
+  CHECK(root->dir.level >= height);
+  unpinblock(big);
+  CHECK(dir_count(big) == empty + count + HELDOPEN);
+
+  // Every entry is found both ways, and the held files have what was written to them.
+  int bad = 0;
+  for(int i=0; i<count; i++) {
+    if(!tree_find(big, entry_name(i))) bad++;
+    if(file_index(entry_name(i)) < 0) bad++;
+  }
+  CHECK(bad == 0);
+  for(int i=0; i<HELDOPEN; i++) {
+    char got[64] = { 0 };
+    snprintf(name, sizeof(name), "open%05d", i * 3000);
+    read_file(name, (Byte *) got, sizeof(got) - 1);
+    CHECK(strcmp(got, name) == 0);
+  }
+
+  // A listing is in name order.
+  char **list = mylistdir("/big");
+  long n;
+  int sorted = 1;
+  for(n=0; list[n][0] != '\0'; n++) if(n > 0 && strcmp(list[n - 1], list[n]) >= 0) sorted = 0;
+  CHECK(n == empty + count + HELDOPEN);
+  CHECK(sorted);
+  for(long i=0; i<=n; i++) free(list[i]);
+  free(list);
+
+  // After deleting every other entry the rest are still found both ways, and entries added
+  // back survive a reload.
+  for(int i=0; i<count; i+=2) delete_file(big, entry_name(i));
+  bad = 0;
+  for(int i=0; i<count; i++) {
+    if((file_index(entry_name(i)) >= 0) != (i % 2)) bad++;
+    if(tree_find(big, entry_name(i)) != (i % 2)) bad++;
+  }
+  CHECK(bad == 0);
+  for(int i=0; i<count; i+=4) myfclose(myfopen(entry_name(i), "w"));
+  const char *image = test_image("dirtree");
+  writedisk(image);
+  readdisk(image);
+  unlink(image);
+  mychdir("/big");
+  bad = 0;
+  for(int i=0; i<count; i++) if((file_index(entry_name(i)) >= 0) != ((i % 2) || (i % 4 == 0))) bad++;
+  CHECK(bad == 0);
+
+  // Emptied, the directory can be removed, and gives back every block it took.
+  mychdir("/");
+  for(int i=0; i<count; i++) delete_file(big, entry_name(i));
+  for(int i=0; i<HELDOPEN; i++) {
+    snprintf(name, sizeof(name), "open%05d", i * 3000);
+    delete_file(big, name);
+  }
+  CHECK(dir_count(big) == empty);
+  myrmdir("/big");
+  CHECK(free_block_count() == free0);
+}
+
+int main()
+{
+  run(16384, 4096, 100000, 2);
+  run(40000, 1024, 30000, 3);
+  return CHECK_DONE();
+}
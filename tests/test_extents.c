@@ -0,0 +1,58 @@
+/* test_extents.c
+ *
+ * Extent allocation: two files growing side by side each get a few long runs of blocks rather
+ * than taking turns block by block, the blocks reserved ahead of a file and not used are given
+ * back when it is closed, and the runs are the same after a reload.
+ */
+
+#include "check.h"
+
+#define FILELEN 2000000
+#define MAXRUNS 64
+
+int main()
+{
+  format_disk(65536, 1024);
+  fatentry_t free0 = free_block_count();
+
+  // Interleaved writers.
+  MyFILE *a = myfopen("/a.txt", "w"), *b = myfopen("/b.txt", "w");
+  for(long i=0; i<FILELEN; i++) {
+    myfputc(a, 'a');
+    myfputc(b, 'b');
+  }
+  fatentry_t reserved = free_block_count();
+  myfclose(a);
+  myfclose(b);
+
+  // Reservations not used are returned, leaving just the blocks the files hold.
+  long blocks = (FILELEN + BLOCKSIZE - 1) / BLOCKSIZE;
+  CHECK(free_block_count() > reserved);
+  CHECK(free0 - free_block_count() == 2 * blocks);
+
+  // Each file is a few runs that together cover it.
+  extent_t extents[MAXRUNS];
+  const char *names[] = { "a.txt", "b.txt" };
+  int counts[2];
+  for(int f=0; f<2; f++) {
+    int n = file_extents(names[f], extents, MAXRUNS);
+    counts[f] = n;
+    CHECK(n > 0 && n <= 16);
+    long covered = 0;
+    for(int i=0; i<n && i<MAXRUNS; i++) covered += extents[i].length;
+    CHECK(covered == blocks);
+  }
+
+  // Read back, the files are whole and laid out the same.
+  const char *image = test_image("extents");
+  writedisk(image);
+  readdisk(image);
+  unlink(image);
+  CHECK(file_extents("a.txt", extents, MAXRUNS) == counts[0]);
+  Byte *got = malloc(FILELEN + 1);
+  CHECK(read_file("/b.txt", got, FILELEN + 1) == FILELEN);
+  CHECK(got[0] == 'b' && got[FILELEN - 1] == 'b');
+  free(got);
+
+  return CHECK_DONE();
+}
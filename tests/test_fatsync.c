@@ -0,0 +1,71 @@
+/* test_fatsync.c
+ *
+ * FAT persistence: each change marks just its own FAT block, syncFAT writes only the blocks marked,
+ * deferred writes reach the disk at myfclose, and the FAT read back from the disk always matches
+ * the one in memory once it has been synced.
+ */
+
+#include "check.h"
+
+extern fatentry_t *FAT;
+
+// The FAT entry as the disk holds it.
+fatentry_t disk_fat(fatentry_t index)
+{
+  fatentry_t block = superBlock.fatstart + index / FATENTRYCOUNT;
+  const diskblock_t *fat = pinblock(block);
+  fatentry_t value = fat->fat[index % FATENTRYCOUNT];
+  unpinblock(block);
+  return value;
+}
+
+// Entries whose disk copy differs from memory.
+fatentry_t fat_differences()
+{
+  fatentry_t n = 0;
+  for(fatentry_t i=0; i<MAXBLOCKS; i++) if(disk_fat(i) != FAT[i]) n++;
+  return n;
+}
+
+int main()
+{
+  format_disk(8192, 1024);
+  CHECK(fat_differences() == 0);
+
+  // A change to one entry dirties its FAT block and no other.
+  clear_dirty();
+  fatentry_t far = MAXBLOCKS - 3;
+  take_block(far);
+  CHECK(disk_fat(far) != FAT[far]);
+  syncFAT();
+  CHECK(disk_fat(far) == FAT[far]);
+  fatentry_t dirty = 0;
+  for(fatentry_t b=0; b<MAXBLOCKS; b++) if(is_dirty(b)) dirty++;
+  CHECK(dirty == 1);
+  CHECK(is_dirty(superBlock.fatstart + far / FATENTRYCOUNT));
+  free_block(far);
+  syncFAT();
+
+  // Deferred, a file's chain reaches the disk's FAT only when it is closed.
+  deferFAT(TRUE);
+  MyFILE *file = myfopen("/a.txt", "w");
+  for(long i=0; i<300000; i++) myfputc(file, 'a' + i % 26);
+  CHECK(fat_differences() > 0);
+  myfclose(file);
+  CHECK(fat_differences() == 0);
+  deferFAT(FALSE);
+
+  // Removing it is synced straight away, and the FAT read back is the same.
+  myremove("/a.txt");
+  CHECK(fat_differences() == 0);
+  fatentry_t freeblocks = free_block_count();
+  const char *image = test_image("fatsync");
+  writedisk(image);
+  format();
+  readdisk(image);
+  unlink(image);
+  CHECK(free_block_count() == freeblocks);
+  CHECK(fat_differences() == 0);
+
+  return CHECK_DONE();
+}
@@ -0,0 +1,59 @@
+/* test_files.c
+ *
+ * The open file table: up to MAXOPENFILES files are open at once and one more is refused,
+ * descriptors name their files and are handed out again once closed, bad descriptors are
+ * rejected, and opening and closing over and over takes no more slots than are in use.
+ */
+
+#include "check.h"
+
+int main()
+{
+  format_disk(4096, 1024);
+  int fds[MAXOPENFILES + 5], opened = 0;
+  char path[32];
+  for(int i=0; i<MAXOPENFILES + 5; i++) {
+    snprintf(path, sizeof(path), "/f%d", i % 20);
+    fds[i] = myopen(path, "a");
+    if(fds[i] >= 0) opened++;
+  }
+  CHECK(opened == MAXOPENFILES);
+  CHECK(open_file_count() == MAXOPENFILES);
+  CHECK(myfopen("/another", "w") == NULL);
+
+  // Descriptors and files map to each other, and each one is distinct.
+  int distinct = 1;
+  for(int i=0; i<MAXOPENFILES; i++) {
+    CHECK(myfdfile(fds[i]) != NULL);
+    CHECK(myfileno(myfdfile(fds[i])) == fds[i]);
+    for(int j=0; j<i; j++) if(fds[i] == fds[j]) distinct = 0;
+  }
+  CHECK(distinct);
+  for(int i=0; i<MAXOPENFILES; i++) {
+    myfwrite("hi", 1, 2, myfdfile(fds[i]));
+    CHECK(myclose(fds[i]) == 0);
+  }
+  CHECK(open_file_count() == 0);
+
+  // Closed or made-up descriptors are rejected.
+  CHECK(myclose(fds[0]) < 0);
+  CHECK(myfdfile(fds[0]) == NULL);
+  CHECK(myclose(-1) < 0);
+  CHECK(myclose(MAXOPENFILES) < 0);
+  CHECK(myfdfile(MAXOPENFILES) == NULL);
+
+  // The writes landed (a file open several times at once was written at the same end by each).
+  Byte got[64];
+  CHECK(read_file("/f1", got, sizeof(got)) == 2);
+  CHECK(memcmp(got, "hi", 2) == 0);
+
+  // Reopening reuses slots rather than taking new ones.
+  long peak = diskStats.peakopen;
+  for(int k=0; k<10000; k++) myfclose(myfopen("/f1", "r"));
+  CHECK(diskStats.peakopen == peak);
+  int fd = myopen("/f1", "r");
+  CHECK(fd >= 0 && fd < MAXOPENFILES);
+  myclose(fd);
+
+  return CHECK_DONE();
+}
@@ -0,0 +1,72 @@
+/* test_flush.c
+ *
+ * Incremental writedisk: the first write of an image is whole, later writes to the same image
+ * write only the blocks changed since (in runs), the result is the same as a full write, and a
+ * write to another image is whole again.
+ */
+
+#include "check.h"
+
+Byte full[1 << 20], incremental[1 << 20];
+
+// Read an image file into buf. Returns its length.
+long read_image(const char *path, Byte *buf, long max)
+{
+  FILE *file = fopen(path, "r");
+  if(file == NULL) return -1;
+  long n = fread(buf, 1, max, file);
+  fclose(file);
+  return n;
+}
+
+int main()
+{
+  char image[256], other[256]; // (test_image's buffer is reused.)
+  strcpy(image, test_image("flush"));
+  strcpy(other, test_image("flush_full"));
+  format();
+  long disksize = (long) MAXBLOCKS * BLOCKSIZE;
+
+  // The first write is whole.
+  long fullwrites = diskStats.fullwrites, flushes = diskStats.flushes;
+  writedisk(image);
+  CHECK(diskStats.fullwrites == fullwrites + 1);
+
+  // Then only what changed, in a few runs.
+  MyFILE *file = myfopen("/hello.txt", "w");
+  for(int i=0; i<3000; i++) myfputc(file, 'x');
+  myfclose(file);
+  long bytes = diskStats.bytesflushed, runs = diskStats.runsflushed;
+  writedisk(image);
+  CHECK(diskStats.fullwrites == fullwrites + 1);
+  CHECK(diskStats.flushes == flushes + 1);
+  CHECK(diskStats.bytesflushed - bytes < disksize / 10);
+  CHECK(diskStats.runsflushed - runs <= 8);
+
+  // Nothing changed, nothing written.
+  bytes = diskStats.bytesflushed;
+  writedisk(image);
+  CHECK(diskStats.bytesflushed == bytes);
+
+  // The image ends up just as a full write of the disk would leave it.
+  writedisk(other);
+  CHECK(diskStats.fullwrites == fullwrites + 2);
+  CHECK(read_image(image, incremental, sizeof(incremental)) == disksize);
+  CHECK(read_image(other, full, sizeof(full)) == disksize);
+  CHECK(memcmp(full, incremental, disksize) == 0);
+
+  // Writing to the first image again is incremental from the last image written, so whole.
+  file = myfopen("/hello.txt", "a");
+  myfputc(file, 'y');
+  myfclose(file);
+  writedisk(image);
+  CHECK(diskStats.fullwrites == fullwrites + 3);
+  readdisk(image);
+  Byte got[4000];
+  CHECK(read_file("/hello.txt", got, sizeof(got)) == 3001);
+  CHECK(got[3000] == 'y');
+  unlink(image);
+  unlink(other);
+
+  return CHECK_DONE();
+}
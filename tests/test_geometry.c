@@ -0,0 +1,86 @@
+/* test_geometry.c
+ *
+ * Disk geometry: disks of any power-of-two block size and of more blocks than a 16-bit FAT could
+ * address work, unsupported geometries are refused, an image brings its own geometry with it
+ * when it is read or mounted, and takes a new one when it is written again.
+ */
+
+#include "check.h"
+
+#define FILELEN 100000
+
+Byte want[FILELEN], got[FILELEN + 1];
+
+void write_read(const char *path)
+{
+  MyFILE *file = myfopen(path, "w");
+  CHECK(myfwrite(want, 1, FILELEN, file) == FILELEN);
+  myfclose(file);
+  CHECK(read_file(path, got, sizeof(got)) == FILELEN);
+  CHECK(memcmp(got, want, FILELEN) == 0);
+}
+
+int main()
+{
+  for(int i=0; i<FILELEN; i++) want[i] = 'a' + i % 26;
+  int sizes[] = { MINBLOCKSIZE, 2048, 4096, MAXBLOCKSIZE };
+  for(int i=0; i<4; i++) {
+    CHECK(format_disk(2048, sizes[i]) == 0);
+    CHECK(BLOCKSIZE == sizes[i]);
+    CHECK(MAXBLOCKS == 2048);
+    write_read("/d/file");
+  }
+
+  // More blocks than 16 bits can count, with a file placed past the first 65536.
+  CHECK(format_disk(1 << 18, 1024) == 0);
+  CHECK(MAXBLOCKS == 1 << 18);
+  MyFILE *file = myfopen("/filler", "w");
+  Byte chunk[1024] = { 0 };
+  for(int i=0; i<70000; i++) myfwrite(chunk, 1, sizeof(chunk), file);
+  myfclose(file);
+  write_read("/far");
+  extent_t extents[4];
+  CHECK(file_extents("far", extents, 4) >= 1);
+  CHECK(extents[0].start > 65536);
+
+  // Unsupported geometries are refused, and leave the disk as it was.
+  CHECK(format_disk(2048, 1000) < 0);
+  CHECK(format_disk(2048, MINBLOCKSIZE / 2) < 0);
+  CHECK(format_disk(2048, MAXBLOCKSIZE * 2) < 0);
+  CHECK(format_disk(2, 1024) < 0);
+  CHECK(MAXBLOCKS == 1 << 18 && BLOCKSIZE == 1024);
+  CHECK(read_file("/far", got, sizeof(got)) == FILELEN);
+
+  // An image's geometry comes back with it.
+  const char *image = test_image("geometry");
+  CHECK(format_disk(512, 8192) == 0);
+  write_read("/d/file");
+  writedisk(image);
+  format();
+  CHECK(BLOCKSIZE != 8192);
+  readdisk(image);
+  CHECK(BLOCKSIZE == 8192 && MAXBLOCKS == 512);
+  CHECK(read_file("/d/file", got, sizeof(got)) == FILELEN);
+  format();
+  CHECK(mountdisk(image) == 0);
+  CHECK(BLOCKSIZE == 8192 && MAXBLOCKS == 512);
+  CHECK(read_file("/d/file", got, sizeof(got)) == FILELEN);
+  CHECK(memcmp(got, want, FILELEN) == 0);
+  unmountdisk();
+
+  // A new geometry on a disk read from an image is written back whole, at its new size.
+  readdisk(image);
+  CHECK(format_disk(2048, 4096) == 0);
+  write_read("/d/file");
+  long fullwrites = diskStats.fullwrites;
+  writedisk(image);
+  CHECK(diskStats.fullwrites == fullwrites + 1);
+  format();
+  readdisk(image);
+  CHECK(BLOCKSIZE == 4096 && MAXBLOCKS == 2048);
+  CHECK(read_file("/d/file", got, sizeof(got)) == FILELEN);
+  CHECK(memcmp(got, want, FILELEN) == 0);
+  unlink(image);
+
+  return CHECK_DONE();
+}
@@ -0,0 +1,113 @@
+/* test_inline.c
+ *
+ * Inline files: a file of up to INLINEMAX bytes lives in its directory entry and takes no blocks,
+ * it is promoted to a chain when it outgrows that, and it reads, seeks, clones, truncates and
+ * reloads like any other file. One removed while it is open leaves its old entry's slot alone.
+ */
+
+#include "check.h"
+
+Byte got[8192];
+
+void write_string(const char *path, const char *mode, const char *s)
+{
+  MyFILE *file = myfopen(path, mode);
+  CHECK(file != NULL);
+  myfwrite(s, 1, strlen(s), file);
+  myfclose(file);
+}
+
+// The file's first block, as its directory entry records it (0 while it is inline).
+fatentry_t first_block(const char *path)
+{
+  MyFILE *file = myfopen(path, "r");
+  fatentry_t first = file->first_block;
+  myfclose(file);
+  return first;
+}
+
+int main()
+{
+  format_disk(8192, 1024);
+  fatentry_t free0 = free_block_count();
+
+  // A small file takes no blocks, and grows in place up to INLINEMAX.
+  write_string("/a.txt", "w", "First file for CGS A");
+  CHECK(free_block_count() == free0);
+  CHECK(first_block("/a.txt") == 0);
+  CHECK(read_file("/a.txt", got, sizeof(got)) == 20);
+  CHECK(memcmp(got, "First file for CGS A", 20) == 0);
+  char fill[INLINEMAX + 1];
+  memset(fill, 'x', INLINEMAX - 20);
+  fill[INLINEMAX - 20] = '\0';
+  write_string("/a.txt", "a", fill);
+  CHECK(free_block_count() == free0);
+  CHECK(read_file("/a.txt", got, sizeof(got)) == INLINEMAX);
+
+  // One byte more and it moves out to a block, keeping what it had.
+  write_string("/a.txt", "a", "y");
+  CHECK(first_block("/a.txt") > 0);
+  CHECK(free0 - free_block_count() == 1);
+  CHECK(read_file("/a.txt", got, sizeof(got)) == INLINEMAX + 1);
+  CHECK(memcmp(got, "First file for CGS A", 20) == 0 && got[INLINEMAX - 1] == 'x' && got[INLINEMAX] == 'y');
+
+  // Seeking past the end inside the entry leaves zeros, and survives a reload.
+  MyFILE *file = myfopen("/small", "w");
+  myfwrite("hello", 1, 5, file);
+  myfseek(file, 50, SEEK_SET);
+  myfwrite("end", 1, 3, file);
+  myfclose(file);
+  const char *image = test_image("inline");
+  writedisk(image);
+  readdisk(image);
+  unlink(image);
+  CHECK(first_block("/small") == 0);
+  CHECK(read_file("/small", got, sizeof(got)) == 53);
+  CHECK(memcmp(got, "hello", 5) == 0 && got[5] == 0 && got[49] == 0 && memcmp(got + 50, "end", 3) == 0);
+  file = myfopen("/small", "r");
+  myfseek(file, 51, SEEK_SET);
+  CHECK(myfgetc(file) == 'n');
+  CHECK(myfgetc(file) == 'd');
+  CHECK(myfgetc(file) == EOF);
+  myfclose(file);
+
+  // Clones copy the data, and truncation works within the entry and out of it.
+  CHECK(myclone("/small", "/small2") == 0);
+  CHECK(read_file("/small2", got, sizeof(got)) == 53);
+  CHECK(memcmp(got + 50, "end", 3) == 0);
+  CHECK(myftruncate("/small", 3) == 0);
+  CHECK(read_file("/small", got, sizeof(got)) == 3);
+  CHECK(myftruncate("/small", 10) == 0);
+  CHECK(read_file("/small", got, sizeof(got)) == 10);
+  CHECK(memcmp(got, "hel\0\0\0\0\0\0\0", 10) == 0);
+  CHECK(read_file("/small2", got, sizeof(got)) == 53);
+  CHECK(myftruncate("/small", 5000) == 0);
+  CHECK(first_block("/small") > 0);
+  CHECK(read_file("/small", got, sizeof(got)) == 5000);
+  CHECK(memcmp(got, "hel", 3) == 0 && got[3] == 0 && got[4999] == 0);
+
+  // Overwriting a chained file with a little data makes it inline again, and frees its blocks.
+  write_string("/a.txt", "w", "short again");
+  CHECK(first_block("/a.txt") == 0);
+  CHECK(read_file("/a.txt", got, sizeof(got)) == 11);
+
+  myremove("/a.txt");
+  myremove("/small");
+  myremove("/small2");
+  CHECK(free_block_count() == free0);
+
+  // A file removed while it is open writes nothing back when it is closed, even though a new file
+  // has taken its entry's place.
+  file = myfopen("/d/a.txt", "w");
+  myfwrite("AAAA", 1, 4, file);
+  myfflush(file);
+  myremove("/d/a.txt");
+  write_string("/d/b.txt", "w", "B");
+  myfwrite("AAAA", 1, 4, file);
+  myfclose(file);
+  CHECK(read_file("/d/b.txt", got, sizeof(got)) == 1);
+  CHECK(got[0] == 'B');
+  CHECK(read_file("/d/a.txt", got, sizeof(got)) < 0);
+
+  return CHECK_DONE();
+}
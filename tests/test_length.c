@@ -0,0 +1,65 @@
+/* test_length.c
+ *
+ * Exact file lengths: binary data with NUL bytes anywhere (and at the end) keeps its length, myfgetc
+ * stops at exactly that length, appends start where the data ends whatever is in it, and the lengths
+ * hold across a reload.
+ */
+
+#include "check.h"
+
+Byte got[20000];
+
+long length_of(const char *path)
+{
+  MyFILE *file = myfopen(path, "r");
+  long length = file->length;
+  myfclose(file);
+  return length;
+}
+
+int main()
+{
+  format_disk(4096, 4096);
+  long lengths[] = { 0, 1, 129, 4095, 4096, 4097, 10000 };
+  char path[32];
+  for(int i=0; i<7; i++) {
+    snprintf(path, sizeof(path), "/zeros%d", i);
+    MyFILE *file = myfopen(path, "w");
+    for(long k=0; k<lengths[i]; k++) myfputc(file, (k % 3 == 0) ? 0 : 'x'); // (ending in NULs too.)
+    myfclose(file);
+    CHECK(length_of(path) == lengths[i]);
+    file = myfopen(path, "r");
+    long n = 0;
+    while(myfgetc(file) != EOF) n++;
+    myfclose(file);
+    CHECK(n == lengths[i]);
+  }
+
+  // Appends land after the last byte, NUL or not.
+  MyFILE *file = myfopen("/bin", "w");
+  myfwrite("ab\0\0", 1, 4, file);
+  myfclose(file);
+  for(int i=0; i<300; i++) {
+    file = myfopen("/bin", "a");
+    CHECK(myftell(file) == 4 + i * 7L);
+    myfwrite("\0tail\0\0", 1, 7, file);
+    myfclose(file);
+  }
+  CHECK(read_file("/bin", got, sizeof(got)) == 4 + 300 * 7);
+  CHECK(memcmp(got, "ab\0\0\0tail\0\0", 11) == 0);
+  CHECK(memcmp(got + 4 + 299 * 7, "\0tail\0\0", 7) == 0);
+
+  // The lengths are stored, not worked out from the blocks.
+  const char *image = test_image("length");
+  writedisk(image);
+  format();
+  readdisk(image);
+  unlink(image);
+  CHECK(length_of("/bin") == 4 + 300 * 7);
+  for(int i=0; i<7; i++) {
+    snprintf(path, sizeof(path), "/zeros%d", i);
+    CHECK(length_of(path) == lengths[i]);
+  }
+
+  return CHECK_DONE();
+}
@@ -0,0 +1,72 @@
+/* test_mount.c
+ *
+ * Mounted images: a disk formatted on a mounted image lives in the image file, is there again
+ * when it is remounted, stays readable in memory after it is unmounted (whatever then happens to
+ * the file), and a file that is not a disk image is refused.
+ */
+
+#include "check.h"
+
+Byte got[100];
+
+int main()
+{
+  char image[256], other[256]; // (test_image's buffer is reused.)
+  strcpy(image, test_image("mount"));
+  strcpy(other, test_image("mount_other"));
+  unlink(image);
+
+  // Format and write through the mapping, then unmount.
+  CHECK(mountdisk(image) == 0);
+  format();
+  MyFILE *file = myfopen("/hello.txt", "w");
+  myfwrite("hello mmap", 1, 10, file);
+  myfclose(file);
+  unmountdisk();
+
+  // The in-memory disk keeps a copy of what was unmounted, which owes nothing to the image: writing
+  // the disk to another file and then back over the image leaves both whole.
+  CHECK(read_file("/hello.txt", got, sizeof(got)) == 10);
+  writedisk(other);
+  writedisk(image);
+  CHECK(read_file("/hello.txt", got, sizeof(got)) == 10);
+  format();
+  readdisk(image);
+  CHECK(read_file("/hello.txt", got, sizeof(got)) == 10);
+  format();
+  readdisk(other);
+  CHECK(read_file("/hello.txt", got, sizeof(got)) == 10);
+  unlink(other);
+
+  // A fresh disk doesn't have the file; mounting the image brings it back.
+  format();
+  CHECK(read_file("/hello.txt", got, sizeof(got)) < 0);
+  CHECK(mountdisk(image) == 0);
+  CHECK(read_file("/hello.txt", got, sizeof(got)) == 10);
+  CHECK(memcmp(got, "hello mmap", 10) == 0);
+
+  // Changes made while mounted reach the file without a writedisk.
+  file = myfopen("/second.txt", "w");
+  myfwrite("second", 1, 6, file);
+  myfclose(file);
+  syncdisk();
+  unmountdisk();
+  format();
+  readdisk(image);
+  CHECK(read_file("/second.txt", got, sizeof(got)) == 6);
+  unlink(image);
+
+  // A file that isn't an image is refused and left as it was, and the disk in use is kept.
+  const char *words = "not a disk image at all, just some text that is long enough to hold a superblock";
+  FILE *text = fopen(image, "w");
+  fputs(words, text);
+  fclose(text);
+  CHECK(mountdisk(image) < 0);
+  CHECK(read_file("/second.txt", got, sizeof(got)) == 6);
+  text = fopen(image, "r");
+  CHECK(fread(got, 1, sizeof(got), text) == strlen(words));
+  fclose(text);
+  unlink(image);
+
+  return CHECK_DONE();
+}
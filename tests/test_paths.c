@@ -0,0 +1,109 @@
+/* test_paths.c
+ *
+ * Path resolution: absolute and relative paths, "." and "..", directories made on the way, the
+ * dentry cache answering repeated lookups and forgetting names as they are added and removed, and
+ * a file's name never being taken for a directory.
+ */
+
+#include "check.h"
+
+char buf[100];
+
+void write_string(const char *path, const char *s)
+{
+  MyFILE *file = myfopen(path, "w");
+  CHECK(file != NULL);
+  myfwrite(s, 1, strlen(s), file);
+  myfclose(file);
+}
+
+const char *read_string(const char *path)
+{
+  long n = read_file(path, (Byte *) buf, sizeof(buf) - 1);
+  buf[n > 0 ? n : 0] = '\0';
+  return buf;
+}
+
+int main()
+{
+  format_disk(4096, 8192);
+  fatentry_t free0 = free_block_count();
+
+  // The same names under different directories.
+  mymkdir("/a/x");
+  mymkdir("/b/x");
+  write_string("/a/x/f", "in a");
+  write_string("/b/x/f", "in b");
+  CHECK(strcmp(read_string("/a/x/f"), "in a") == 0);
+  CHECK(strcmp(read_string("/b/x/f"), "in b") == 0);
+  CHECK(resolve_path("/a/x", NULL, FALSE) != resolve_path("/b/x", NULL, FALSE));
+
+  // Relative paths, "." and "..".
+  mychdir("/b");
+  CHECK(strcmp(read_string("x/f"), "in b") == 0);
+  CHECK(strcmp(read_string("../a/x/f"), "in a") == 0);
+  CHECK(strcmp(read_string("./x/../x/f"), "in b") == 0);
+  CHECK(resolve_path("/..", NULL, FALSE) == resolve_path("/", NULL, FALSE));
+  mychdir("/");
+
+  // Missing directories are only made when asked for.
+  CHECK(resolve_path("/nope/x", NULL, FALSE) < 0);
+  CHECK(read_file("/nope/f", (Byte *) buf, sizeof(buf)) < 0);
+  write_string("/c/d/e", "deep");
+  CHECK(strcmp(read_string("c/d/e"), "deep") == 0);
+
+  // Repeated lookups are answered from the dentry cache.
+  resolve_path("/c/d", NULL, FALSE);
+  long hits = diskStats.dentryhits, misses = diskStats.dentrymisses;
+  for(int i=0; i<100; i++) resolve_path("/c/d", NULL, FALSE);
+  CHECK(diskStats.dentryhits - hits == 200);
+  CHECK(diskStats.dentrymisses == misses);
+
+  // ... but not once the answer has changed.
+  CHECK(resolve_path("/q", NULL, FALSE) < 0);
+  mymkdir("/q");
+  CHECK(resolve_path("/q", NULL, FALSE) > 0);
+  myremove("/c/d/e");
+  myrmdir("/c/d");
+  CHECK(resolve_path("/c/d", NULL, FALSE) < 0);
+  mymkdir("/c/d");
+  CHECK(resolve_path("/c/d", NULL, FALSE) > 0);
+  CHECK(read_file("/c/d/e", (Byte *) buf, sizeof(buf)) < 0);
+
+  // A file's name is not made into a directory as well.
+  write_string("/plain", "file");
+  mymkdir("/plain/sub");
+  CHECK(resolve_path("/plain", NULL, FALSE) < 0);
+  CHECK(myfopen("/plain/g", "w") == NULL);
+  MYDIR *dir = myopendir("/");
+  int plain = 0;
+  for(mydirent_t *entry = myreaddir(dir); entry != NULL; entry = myreaddir(dir)) plain += (strcmp(entry->name, "plain") == 0);
+  myclosedir(dir);
+  CHECK(plain == 1);
+  CHECK(strcmp(read_string("/plain"), "file") == 0);
+  myremove("/plain");
+
+  // Everything goes, and the root can't be removed through "..".
+  myrmdir("/c/d");
+  myrmdir("/c");
+  myrmdir("/q");
+  myremove("/a/x/f");
+  myremove("/b/x/f");
+  myrmdir("/a/x");
+  myrmdir("/b/x");
+  myrmdir("/a");
+  myrmdir("/b");
+  myrmdir("/a/..");
+  myrmdir("..");
+  CHECK(free_block_count() == free0);
+
+  // The cache does not outlive the disk it was filled from.
+  mymkdir("/a");
+  writedisk(test_image("paths"));
+  myrmdir("/a");
+  CHECK(resolve_path("/a", NULL, FALSE) < 0);
+  readdisk(test_image("paths"));
+  CHECK(resolve_path("/a", NULL, FALSE) > 0);
+  unlink(test_image("paths"));
+  return CHECK_DONE();
+}
@@ -0,0 +1,74 @@
+/* test_pin.c
+ *
+ * Borrowed blocks: a pinned block shows the same bytes readblock copies out, a change made through
+ * pinblock_rw is seen by readblock and marked dirty for the next flush, and on a cached disk a
+ * pinned block stays put however many other blocks pass through the cache.
+ */
+
+#include "check.h"
+
+extern int pinnedBlocks;
+
+// Fill blocks from..to-1 with a pattern of their own through writeblock.
+void fill(fatentry_t from, fatentry_t to)
+{
+  diskblock_t block;
+  for(fatentry_t b=from; b<to; b++) {
+    memset(block.data, (int) (b & 0xff), BLOCKSIZE);
+    writeblock(&block, b, TYPE_DATA);
+  }
+}
+
+void check_disk(int cached)
+{
+  diskblock_t block;
+  fatentry_t first = MAXBLOCKS - 200; // (well clear of the FAT and root directory.)
+  fill(first, MAXBLOCKS);
+
+  // A pin sees what readblock copies.
+  const diskblock_t *pinned = pinblock(first);
+  readblock(&block, first, TYPE_DATA);
+  CHECK(memcmp(pinned->data, block.data, BLOCKSIZE) == 0);
+  CHECK(pinnedBlocks == 1);
+
+  // A change through a writable pin is seen by readblock, and is dirty.
+  diskblock_t *writable = pinblock_rw(first + 1);
+  memcpy(writable->data, "changed in place", 16);
+  unpinblock_rw(first + 1);
+  readblock(&block, first + 1, TYPE_DATA);
+  CHECK(memcmp(block.data, "changed in place", 16) == 0);
+  CHECK(is_dirty(first + 1));
+
+  // Other blocks going through the cache don't move a pinned one.
+  for(fatentry_t b=first + 2; b<MAXBLOCKS; b++) {
+    readblock(&block, b, TYPE_DATA);
+    CHECK(block.data[0] == (Byte) (b & 0xff));
+  }
+  CHECK(pinned->data[0] == (Byte) (first & 0xff) && pinned->data[BLOCKSIZE - 1] == (Byte) (first & 0xff));
+  if(cached) CHECK(diskStats.evictions > 0);
+  unpinblock(first);
+  CHECK(pinnedBlocks == 0);
+}
+
+int main()
+{
+  format_disk(1024, 1024);
+  check_disk(FALSE);
+
+  const char *image = test_image("pin");
+  unlink(image);
+  CHECK(mountdisk_cached(image, CACHEMINFRAMES, CACHE_LRU) == 0);
+  format_disk(1024, 1024);
+  check_disk(TRUE);
+
+  // The change made through the pin reaches the image.
+  unmountdisk();
+  CHECK(mountdisk(image) == 0);
+  const diskblock_t *pinned = pinblock(MAXBLOCKS - 199);
+  CHECK(memcmp(pinned->data, "changed in place", 16) == 0);
+  unpinblock(MAXBLOCKS - 199);
+  unmountdisk();
+  unlink(image);
+
+  return CHECK_DONE();
+}
@@ -0,0 +1,59 @@
+/* test_readahead.c
+ *
+ * Readahead: a sequential read through a small cache is served almost entirely from blocks
+ * fetched ahead of it, random reads still read the right bytes, and prefetch_chain asked for
+ * nothing fetches nothing.
+ */
+
+#include "check.h"
+
+#define BIGLEN (2 << 20)
+
+Byte want[BIGLEN], got[BIGLEN];
+
+int main()
+{
+  srand(13);
+  for(int i=0; i<BIGLEN; i++) want[i] = rand();
+  const char *image = test_image("readahead");
+  unlink(image);
+  CHECK(mountdisk_cached(image, 64, CACHE_LRU) == 0);
+  format_disk(4096, 4096);
+  MyFILE *file = myfopen("/big", "w");
+  CHECK(myfwrite(want, 1, BIGLEN, file) == BIGLEN);
+  myfclose(file);
+  unmountdisk();
+
+  // A sequential read misses only at the start.
+  CHECK(mountdisk_cached(image, 64, CACHE_LRU) == 0);
+  long misses = diskStats.cachemisses, rahits = diskStats.rahits;
+  CHECK(read_file("/big", got, BIGLEN) == BIGLEN);
+  CHECK(memcmp(got, want, BIGLEN) == 0);
+  long blocks = BIGLEN / BLOCKSIZE;
+  CHECK(diskStats.cachemisses - misses < 8);
+  CHECK(diskStats.rahits - rahits > blocks * 9 / 10);
+
+  // Seeking about reads the right bytes, and what was read ahead and skipped is counted as wasted.
+  long wasted = diskStats.rawasted;
+  file = myfopen("/big", "r");
+  for(int i=0; i<200; i++) {
+    long offset = rand() % (BIGLEN - 5000);
+    myfseek(file, offset, SEEK_SET);
+    CHECK(myfread(got, 1, 5000, file) == 5000);
+    CHECK(memcmp(got, want + offset, 5000) == 0);
+  }
+  myfclose(file);
+  CHECK(diskStats.rawasted > wasted);
+
+  // Nothing asked for, nothing fetched.
+  long prefetched = diskStats.prefetched;
+  fatentry_t first = superBlock.rootdir;
+  CHECK(prefetch_chain(first, 0) == 0);
+  CHECK(prefetch_chain(first, -1) == 0);
+  CHECK(prefetch_chain(0, 8) == 0);
+  CHECK(diskStats.prefetched == prefetched);
+  unmountdisk();
+  unlink(image);
+
+  return CHECK_DONE();
+}
@@ -0,0 +1,86 @@
+/* test_readdir.c
+ *
+ * Directory streams: myreaddir returns a big directory's entries in the same order as mylistdir,
+ * with their sizes and kinds, and a directory changed while it is being read (split under the
+ * reader, entries removed ahead of it) is still read in order with nothing unchanged missed.
+ */
+
+#include "check.h"
+
+#define COUNT 50000
+
+char name[64];
+
+int main()
+{
+  format_disk(16384, 4096);
+  mymkdir("/big/sub");
+  long total = 0;
+  for(int i=0; i<COUNT; i++) {
+    snprintf(name, sizeof(name), "/big/n%06d", (int) ((i * 7919L) % COUNT));
+    MyFILE *file = myfopen(name, "w");
+    if(i % 7 == 0) {
+      myfwrite(name, 1, strlen(name), file);
+      total += strlen(name);
+    }
+    myfclose(file);
+  }
+
+  // The same entries as a listing, in the same order.
+  char **list = mylistdir("/big");
+  MYDIR *dir = myopendir("/big");
+  CHECK(dir != NULL);
+  long n = 0, size = 0, dirs = 0;
+  int bad = 0;
+  for(mydirent_t *entry = myreaddir(dir); entry != NULL; entry = myreaddir(dir), n++) {
+    if(list[n][0] == '\0' || strcmp(entry->name, list[n]) != 0) bad++;
+    size += entry->size;
+    dirs += entry->isdir;
+    if(bad) break;
+  }
+  CHECK(bad == 0);
+  CHECK(list[n][0] == '\0');
+  CHECK(size == total);
+  CHECK(dirs == 2); // (".." and sub)
+  CHECK(myreaddir(dir) == NULL);
+  myclosedir(dir);
+  for(long i=0; i<=n; i++) free(list[i]);
+  free(list);
+
+  CHECK(myopendir("/nope") == NULL);
+  CHECK(myopendir("/big/n000001") == NULL);
+  CHECK(myreaddir(NULL) == NULL);
+  myclosedir(NULL);
+
+  // A small directory that splits and loses entries while it is read.
+  for(int i=0; i<10; i++) {
+    snprintf(name, sizeof(name), "/s/a%02d", i * 10);
+    myfclose(myfopen(name, "w"));
+  }
+  dir = myopendir("/s");
+  char seen[200][MAXNAME];
+  int k = 0, removed = 0;
+  for(mydirent_t *entry = myreaddir(dir); entry != NULL && k < 200; entry = myreaddir(dir)) {
+    strcpy(seen[k++], entry->name);
+    if(strcmp(entry->name, "a50") == 0 || strcmp(entry->name, "a60") == 0) removed++;
+    if(k == 3) {
+      for(int i=0; i<3000; i++) {
+        snprintf(name, sizeof(name), "/s/b%05d", i);
+        myfclose(myfopen(name, "w"));
+      }
+    }
+    if(k == 5) {
+      myremove("/s/a50");
+      myremove("/s/a60");
+    }
+  }
+  myclosedir(dir);
+  int ordered = 1, kept = 0;
+  for(int i=1; i<k; i++) if(strcmp(seen[i - 1], seen[i]) >= 0) ordered = 0;
+  for(int i=0; i<k; i++) if(seen[i][0] == 'a') kept++;
+  CHECK(ordered);
+  CHECK(removed == 0);
+  CHECK(kept == 8);
+
+  return CHECK_DONE();
+}
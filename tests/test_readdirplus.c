@@ -0,0 +1,89 @@
+/* test_readdirplus.c
+ *
+ * Batched listings: myreaddirplus carries on from myreaddir, returns every entry once in name
+ * order across batches of any size, and its sizes, block counts and times agree with the files
+ * themselves, holes included, and with the chains of directories.
+ */
+
+#include "check.h"
+
+#define COUNT 20000
+
+char name[64];
+mystat_t buf[100];
+
+int main()
+{
+  format_disk(16384, 1024);
+  mymkdir("/big/sub");
+  long total = 0;
+  for(int i=0; i<COUNT; i++) {
+    snprintf(name, sizeof(name), "/big/n%06d", (int) ((i * 7919L) % COUNT));
+    MyFILE *file = myfopen(name, "w");
+    if(i % 1000 == 0) {
+      Byte data[5000];
+      memset(data, 'x', sizeof(data));
+      myfwrite(data, 1, sizeof(data), file);
+      total += sizeof(data);
+    }
+    myfclose(file);
+  }
+  for(int i=0; i<600; i++) {
+    snprintf(name, sizeof(name), "/big/sub/x%d", i);
+    myfclose(myfopen(name, "w"));
+  }
+  MyFILE *file = myfopen("/big/sparse", "w");
+  myfseek(file, 100000, SEEK_SET);
+  myfputc(file, 'z');
+  myfclose(file);
+  total += 100001;
+  long entries = dir_count(resolve_path("/big", NULL, FALSE));
+
+  // One entry from myreaddir, then the rest in batches, in order and with times.
+  MYDIR *dir = myopendir("/big");
+  char last[MAXNAME];
+  strcpy(last, myreaddir(dir)->name);
+  long n = 1, size = 0;
+  int got, bad = 0;
+  while((got = myreaddirplus(dir, buf, 100)) > 0) {
+    for(int i=0; i<got; i++) {
+      if(strcmp(buf[i].name, last) <= 0 || buf[i].mtime == 0) bad++;
+      strcpy(last, buf[i].name);
+      size += buf[i].size;
+    }
+    n += got;
+  }
+  myclosedir(dir);
+  CHECK(bad == 0);
+  CHECK(n == entries);
+  CHECK(size == total);
+
+  // Block counts are the files' own, holes left out; a directory's are those of its chain.
+  mychdir("/big");
+  dir = myopendir(".");
+  bad = 0;
+  n = 0;
+  while((got = myreaddirplus(dir, buf, 37)) > 0) {
+    for(int i=0; i<got; i++) {
+      if(buf[i].isdir) {
+        if(buf[i].blocks < 1 || buf[i].size != 0) bad++;
+        if(strcmp(buf[i].name, "sub") == 0) CHECK(buf[i].blocks > 1);
+        continue;
+      }
+      if(buf[i].blocks != file_block_length(buf[i].name)) bad++;
+      if(strcmp(buf[i].name, "sparse") == 0) {
+        CHECK(buf[i].size == 100001);
+        CHECK(buf[i].blocks < 100001 / BLOCKSIZE);
+      }
+    }
+    n += got;
+  }
+  myclosedir(dir);
+  mychdir("/");
+  CHECK(bad == 0);
+  CHECK(n == entries);
+
+  CHECK(myreaddirplus(NULL, buf, 5) == 0);
+
+  return CHECK_DONE();
+}
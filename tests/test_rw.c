@@ -0,0 +1,70 @@
+/* test_rw.c
+ *
+ * Bulk reads and writes: myfwrite and myfread move whole items of any size across block
+ * boundaries, mix with myfgetc and myfputc on the same file, stop short at the end of the file
+ * with the whole items read, report a full disk by writing fewer items, and write nothing to a
+ * file open for reading or one that failed to open.
+ */
+
+#include "check.h"
+
+#define FILELEN (3 << 20)
+
+Byte want[FILELEN], got[FILELEN];
+
+int main()
+{
+  srand(10);
+  for(int i=0; i<FILELEN; i++) want[i] = rand();
+  format_disk(1 << 14, 4096);
+
+  // One big write, read back in one go and in odd-sized pieces.
+  MyFILE *file = myfopen("/big", "w");
+  CHECK(myfwrite(want, 1, FILELEN, file) == FILELEN);
+  myfclose(file);
+  CHECK(read_file("/big", got, FILELEN) == FILELEN);
+  CHECK(memcmp(got, want, FILELEN) == 0);
+  file = myfopen("/big", "r");
+  long at = 0;
+  size_t n;
+  memset(got, 0, FILELEN);
+  while((n = myfread(got + at, 1, 1 + at % 7919, file)) > 0) at += n;
+  myfclose(file);
+  CHECK(at == FILELEN);
+  CHECK(memcmp(got, want, FILELEN) == 0);
+
+  // Items: only whole ones are counted, and the end of the file stops the read.
+  file = myfopen("/big", "r");
+  CHECK(myfread(got, 1000, 3, file) == 3);
+  CHECK(myfgetc(file) == want[3000]);
+  CHECK(myfread(got, 1 << 20, 4, file) == 2);
+  CHECK(memcmp(got, want + 3001, 2 << 20) == 0);
+  CHECK(myfread(got, 1, 10, file) == 0);
+  myfclose(file);
+
+  // Characters and blocks written to the same file line up.
+  file = myfopen("/mixed", "w");
+  myfputc(file, 'A');
+  CHECK(myfwrite(want, 5000, 2, file) == 2);
+  myfputc(file, 'B');
+  CHECK(myfwrite(want, 1, 0, file) == 0);
+  myfclose(file);
+  CHECK(myfwrite(want, 1, 10, NULL) == 0);
+  file = myfopen("/mixed", "r");
+  CHECK(myfwrite(want, 1, 10, file) == 0);
+  myfclose(file);
+  CHECK(read_file("/mixed", got, FILELEN) == 10002);
+  CHECK(got[0] == 'A' && memcmp(got + 1, want, 10000) == 0 && got[10001] == 'B');
+
+  // A full disk takes what fits, and the count says how much.
+  fatentry_t room = free_block_count();
+  file = myfopen("/fill", "w");
+  size_t items = 0, wrote;
+  while((wrote = myfwrite(want, BLOCKSIZE, FILELEN / BLOCKSIZE, file)) == FILELEN / BLOCKSIZE) items += wrote;
+  items += wrote;
+  myfclose(file);
+  CHECK(items <= (size_t) room && items + 2 >= (size_t) room);
+  CHECK(free_block_count() == 0);
+
+  return CHECK_DONE();
+}
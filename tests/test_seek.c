@@ -0,0 +1,64 @@
+/* test_seek.c
+ *
+ * Seeking: myfseek from the start, the current position and the end lands on the right byte at
+ * any offset in a long chain, myftell agrees, positions before the start are refused, and in
+ * append mode the position starts at the end and a seek past it leaves a hole before the write.
+ */
+
+#include "check.h"
+
+#define FILELEN (3 << 20)
+
+Byte want[FILELEN];
+
+int main()
+{
+  srand(11);
+  for(int i=0; i<FILELEN; i++) want[i] = rand();
+  format_disk(1 << 14, 1024);
+  MyFILE *file = myfopen("/big", "w");
+  myfwrite(want, 1, FILELEN, file);
+  myfclose(file);
+
+  // Random offsets, each way of counting them.
+  file = myfopen("/big", "r");
+  int bad = 0;
+  for(int k=0; k<100000; k++) {
+    long offset = rand() % FILELEN;
+    switch(k % 3) {
+    case 0: myfseek(file, offset, SEEK_SET); break;
+    case 1: myfseek(file, offset - myftell(file), SEEK_CUR); break;
+    case 2: myfseek(file, offset - FILELEN, SEEK_END); break;
+    }
+    if(myftell(file) != offset || (Byte) myfgetc(file) != want[offset]) bad++;
+  }
+  CHECK(bad == 0);
+
+  // The ends, and beyond them.
+  CHECK(myfseek(file, 0, SEEK_END) == 0);
+  CHECK(myftell(file) == FILELEN);
+  CHECK(myfgetc(file) == EOF);
+  CHECK(myfseek(file, -1, SEEK_END) == 0);
+  CHECK((Byte) myfgetc(file) == want[FILELEN - 1]);
+  CHECK(myfseek(file, 0, SEEK_SET) == 0);
+  CHECK((Byte) myfgetc(file) == want[0]);
+  CHECK(myfseek(file, -1, SEEK_SET) < 0);
+  CHECK(myftell(file) == 1);
+  CHECK(myfseek(file, 10, SEEK_END) == 0);
+  CHECK(myfgetc(file) == EOF);
+  myfclose(file);
+
+  // Appending starts at the end; seeking past it and writing leaves a hole of zeros.
+  file = myfopen("/big", "a");
+  CHECK(myftell(file) == FILELEN);
+  CHECK(myfseek(file, 5000, SEEK_END) == 0);
+  myfputc(file, 'Z');
+  CHECK(myftell(file) == FILELEN + 5001);
+  CHECK(myfseek(file, FILELEN + 5000, SEEK_SET) == 0);
+  CHECK(myfgetc(file) == 'Z');
+  CHECK(myfseek(file, FILELEN + 10, SEEK_SET) == 0);
+  CHECK(myfgetc(file) == 0);
+  myfclose(file);
+
+  return CHECK_DONE();
+}
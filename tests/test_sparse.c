@@ -0,0 +1,105 @@
+/* test_sparse.c
+ *
+ * Sparse files: writing past the end leaves a hole that takes no blocks and reads as zeros, holes
+ * survive a reload and a cached mount, myfallocate fills them in, and a file's extents show them as
+ * unallocated runs.
+ */
+
+#include "check.h"
+
+#define FILELEN 3000004
+
+long offsets[] = { 0, 5000, 100000, 100002, 3000000, 1500000, 1501020, 7000 };
+int noffsets = sizeof(offsets) / sizeof(offsets[0]);
+Byte want[FILELEN], got[FILELEN + 1];
+
+void write_sparse(const char *path)
+{
+  MyFILE *file = myfopen(path, "w");
+  for(int i=0; i<noffsets; i++) {
+    myfseek(file, offsets[i], SEEK_SET);
+    myfwrite("WXYZ", 1, 4, file);
+  }
+  myfclose(file);
+}
+
+void check_sparse(const char *path)
+{
+  CHECK(read_file(path, got, sizeof(got)) == FILELEN);
+  CHECK(memcmp(got, want, FILELEN) == 0);
+}
+
+long allocated(const char *path)
+{
+  MyFILE *file = myfopen(path, "r");
+  long blocks = file->allocblocks;
+  myfclose(file);
+  return blocks;
+}
+
+// The extents of a file: every block it covers, allocated or not, and the blocks it has.
+void check_extents(const char *path, long blocks)
+{
+  extent_t extents[64];
+  int n = file_extents(path + 1, extents, 64);
+  CHECK(n <= 64);
+  long covered = 0, held = 0;
+  for(int i=0; i<n && i<64; i++) {
+    covered += extents[i].length;
+    if(extents[i].start > 0) held += extents[i].length;
+    if(extents[i].start == 0 && i + 1 < n) CHECK(extents[i+1].start > 0); // (holes are never run together.)
+  }
+  CHECK(held == blocks);
+  CHECK(covered == (FILELEN + BLOCKSIZE - 1) / BLOCKSIZE);
+}
+
+int main()
+{
+  for(int i=0; i<noffsets; i++) memcpy(want + offsets[i], "WXYZ", 4);
+
+  format_disk(65536, 1024);
+  fatentry_t free0 = free_block_count();
+  write_sparse("/s");
+  check_sparse("/s");
+  long blocks = allocated("/s");
+  CHECK(blocks < 10);
+  CHECK(free0 - free_block_count() <= blocks + 1); // (and a block for the hole table.)
+  check_extents("/s", blocks);
+
+  // Reading through a hole a character at a time.
+  MyFILE *file = myfopen("/s", "r");
+  myfseek(file, 4998, SEEK_SET);
+  CHECK(myfgetc(file) == 0 && myfgetc(file) == 0 && myfgetc(file) == 'W' && myfgetc(file) == 'X');
+  myfclose(file);
+
+  // The holes are kept on disk.
+  writedisk(test_image("sparse"));
+  readdisk(test_image("sparse"));
+  check_sparse("/s");
+  CHECK(allocated("/s") == blocks);
+  check_extents("/s", blocks);
+
+  // myfallocate fills the holes it covers, without changing what the file reads as.
+  CHECK(myfallocate("/s", 200000) == 0);
+  check_sparse("/s");
+  long filled = allocated("/s");
+  CHECK(filled > 200000 / BLOCKSIZE);
+  check_extents("/s", filled);
+
+  myremove("/s");
+  CHECK(free0 - free_block_count() <= 1);
+  unlink(test_image("sparse"));
+
+  // The same through the block cache.
+  mountdisk_cached(test_image("cached"), 64, CACHE_LRU);
+  format_disk(65536, 1024);
+  write_sparse("/s");
+  syncdisk();
+  unmountdisk();
+  mountdisk_cached(test_image("cached"), 64, CACHE_LRU);
+  check_sparse("/s");
+  check_extents("/s", allocated("/s"));
+  unmountdisk();
+  unlink(test_image("cached"));
+  return CHECK_DONE();
+}
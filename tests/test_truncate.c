@@ -0,0 +1,175 @@
+/* test_truncate.c
+ *
+ * myftruncate, myfallocate and "w" over an existing file, checked against a model of the file's
+ * bytes: whatever the sequence of writes, seeks past the end, truncates and reopens, the file reads
+ * back as the model says, with zeros wherever nothing was written since the file was last emptied.
+ * Handles held open across a truncate follow the file's new length.
+ */
+
+#include "check.h"
+
+#define MAXLEN (16 * 1024)
+
+Byte model[MAXLEN], got[MAXLEN + 1];
+long modellen;
+
+void write_at(MyFILE *file, long at, long n, Byte fill)
+{
+  Byte buf[MAXLEN];
+  memset(buf, fill, n);
+  myfseek(file, at, SEEK_SET);
+  myfwrite(buf, 1, n, file);
+  memset(model + at, fill, n);
+  if(at + n > modellen) modellen = at + n;
+}
+
+void check_file(const char *path)
+{
+  long n = read_file(path, got, MAXLEN + 1);
+  CHECK(n == modellen);
+  CHECK(memcmp(got, model, modellen) == 0);
+}
+
+// The cases from the review: stale data must not come back after "w", a trim, or truncating to 0.
+void stale_cases()
+{
+  format_disk(256, 1024);
+  MyFILE *file = myfopen("/f", "w");
+  memset(model, 0, sizeof(model));
+  modellen = 0;
+  write_at(file, 0, 2000, 'A');
+  myfclose(file);
+
+  // "w" over it, then a write past the (new) end.
+  file = myfopen("/f", "w");
+  memset(model, 0, sizeof(model));
+  modellen = 0;
+  write_at(file, 2000, 1, 'B');
+  myfclose(file);
+  check_file("/f");
+
+  // A "w" close that trims the chain, then an append past the end.
+  file = myfopen("/f", "w");
+  memset(model, 0, sizeof(model));
+  modellen = 0;
+  write_at(file, 0, 100, 'C');
+  myfclose(file);
+  file = myfopen("/f", "a");
+  write_at(file, 1500, 10, 'D');
+  myfclose(file);
+  check_file("/f");
+
+  // Truncating to nothing, then writing past the end.
+  CHECK(myftruncate("/f", 0) == 0);
+  memset(model, 0, sizeof(model));
+  modellen = 0;
+  file = myfopen("/f", "a");
+  write_at(file, 700, 1, 'E');
+  myfclose(file);
+  check_file("/f");
+  CHECK(file_block_length("f") == 1);
+
+  // A chain set aside with myfallocate is written over, not replaced.
+  CHECK(myfallocate("/g", 5000) == 0);
+  fatentry_t first = file_index("g");
+  CHECK(first > 0);
+  file = myfopen("/g", "w");
+  memset(model, 0, sizeof(model));
+  modellen = 0;
+  write_at(file, 0, 3000, 'F');
+  myfclose(file);
+  CHECK(file_index("g") == first);
+  check_file("/g");
+}
+
+// Handles open while the file is cut short take the new length: a reader finds the end there, and a
+// writer's next write lands in the file (past the end, leaving a hole), never in the blocks freed
+// by the truncate, which another file has taken since.
+void open_handle_cases()
+{
+  format_disk(64, 1024);
+  long disklen = (long) MAXBLOCKS * BLOCKSIZE;
+  Byte *buf = malloc(disklen);
+  memset(buf, 'W', 10000);
+  MyFILE *writer = myfopen("/a", "w");
+  myfwrite(buf, 1, 10000, writer);
+  CHECK(myfflush(writer) == 0);
+  MyFILE *reader = myfopen("/a", "r");
+  myfseek(reader, 5000, SEEK_SET);
+  MyFILE *spare = myfopen("/spare", "w");
+  myfwrite(buf, 1, 3000, spare);
+  myfclose(spare);
+
+  CHECK(myftruncate("/a", 100) == 0);
+  CHECK(myfgetc(reader) == EOF);
+  myfclose(reader);
+
+  // Another file takes every free block, then a little room is made for the writer.
+  memset(buf, 'F', BLOCKSIZE);
+  MyFILE *fill = myfopen("/fill", "w");
+  while(myfwrite(buf, 1, BLOCKSIZE, fill) == BLOCKSIZE);
+  myfclose(fill);
+  CHECK(free_block_count() == 0);
+  myremove("/spare");
+  CHECK(myfwrite("XXXXXXX", 1, 7, writer) == 7);
+  myfclose(writer);
+
+  long filled = read_file("/fill", buf, disklen);
+  CHECK(filled > 30 * BLOCKSIZE);
+  long bad = 0;
+  for(long i=0; i<filled; i++) if(buf[i] != 'F') bad++;
+  CHECK(bad == 0);
+  CHECK(read_file("/a", buf, disklen) == 10007);
+  bad = 0;
+  for(long i=0; i<10000; i++) if(buf[i] != (i < 100 ? 'W' : 0)) bad++;
+  CHECK(bad == 0);
+  CHECK(memcmp(buf + 10000, "XXXXXXX", 7) == 0);
+  free(buf);
+}
+
+// Random operations against the model.
+void random_cases(int blocksize, unsigned seed)
+{
+  srand(seed);
+  format_disk(512, blocksize);
+  memset(model, 0, sizeof(model));
+  modellen = 0;
+  MyFILE *file = myfopen("/r", "w");
+  myfclose(file);
+  for(int op=0; op<400; op++) {
+    int what = rand() % 5;
+    if(what == 0) { // reopen with "w" and write in a few places.
+      file = myfopen("/r", "w");
+      memset(model, 0, sizeof(model));
+      modellen = 0;
+      for(int i = rand() % 4; i > 0; i--) write_at(file, rand() % (MAXLEN / 2), rand() % (MAXLEN / 4), 'a' + rand() % 26);
+      myfclose(file);
+    }
+    else if(what == 1) { // append, or write anywhere in "a" mode.
+      file = myfopen("/r", "a");
+      long at = (rand() % 2) ? modellen : rand() % (MAXLEN / 2);
+      long n = rand() % (MAXLEN / 4);
+      if(at + n <= MAXLEN) write_at(file, at, n, 'a' + rand() % 26);
+      myfclose(file);
+    }
+    else if(what == 2) { // truncate, shorter or longer.
+      long len = rand() % (MAXLEN / 2);
+      if(rand() % 4 == 0) len = 0;
+      CHECK(myftruncate("/r", len) == 0);
+      if(len < modellen) memset(model + len, 0, modellen - len);
+      modellen = len;
+    }
+    else if(what == 3) CHECK(myfallocate("/r", rand() % MAXLEN) == 0);
+    else check_file("/r");
+  }
+  check_file("/r");
+}
+
+int main()
+{
+  stale_cases();
+  open_handle_cases();
+  random_cases(1024, 1);
+  random_cases(4096, 2);
+  return CHECK_DONE();
+}